@@ -0,0 +1,119 @@
+#include <dlfcn.h>
+#include "gb.h"
+
+/*
+ * Loader for objects generated by the static recompiler (see recomp.c)
+ *
+ * The recompiled blocks work directly on the CPU state and only call back into
+ * the emulator, through `gb_aot_ops`, for the memory accesses that can't go
+ * through the page tables, the device events, the idle loop detection and the
+ * interrupt state. Any PC that doesn't start a known block, including all the
+ * code running from RAM and the code in ROM banks the recompiler didn't
+ * explore, is handled by the JIT or the interpreter.
+ */
+
+static const struct gb_aot_ops gb_aot_ops = {
+     .readb = gb_cpu_bus_readb,
+     .writeb = gb_cpu_bus_writeb,
+     .check_events = gb_sync_check_events,
+     .idle_loop = gb_cpu_idle_loop,
+     .update_irq = gb_irq_update_pending,
+};
+
+void gb_aot_load(struct gb *gb, const char *path) {
+     struct gb_aot *aot = &gb->aot;
+     struct gb_cart *cart = &gb->cart;
+     const struct gb_aot_image *image;
+
+     aot->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+     if (aot->handle == NULL) {
+          fprintf(stderr, "Can't load recompiled image: %s\n", dlerror());
+          die();
+     }
+
+     image = dlsym(aot->handle, GB_AOT_IMAGE_SYMBOL);
+     if (image == NULL) {
+          fprintf(stderr, "'%s' isn't a recompiled image\n", path);
+          die();
+     }
+
+     if (image->version != GB_AOT_VERSION) {
+          fprintf(stderr, "Recompiled image version mismatch: %u, expected %u\n",
+                  image->version, GB_AOT_VERSION);
+          die();
+     }
+
+     if (image->gb_size != sizeof(struct gb) ||
+         image->layout != GB_AOT_LAYOUT) {
+          fprintf(stderr, "Recompiled image was built with different emulator "
+                  "headers\n");
+          die();
+     }
+
+     if (image->rom_length != cart->rom_length ||
+         image->rom_hash != gb_aot_rom_hash(cart->rom, cart->rom_length)) {
+          fprintf(stderr, "Recompiled image was generated for a different ROM\n");
+          die();
+     }
+
+     aot->image = image;
+
+     printf("Loaded recompiled image '%s' (%u blocks)\n",
+            path, image->block_count);
+}
+
+void gb_aot_unload(struct gb *gb) {
+     struct gb_aot *aot = &gb->aot;
+
+     if (aot->handle) {
+          dlclose(aot->handle);
+     }
+
+     aot->handle = NULL;
+     aot->image = NULL;
+}
+
+bool gb_aot_run(struct gb *gb) {
+     struct gb_aot *aot = &gb->aot;
+     const struct gb_aot_image *image = aot->image;
+     const struct gb_cpu_decoded *d;
+     uint32_t lo, hi;
+
+     if (image == NULL) {
+          return false;
+     }
+
+     d = gb_cpu_decode(gb, gb->cpu.pc);
+     if (d == NULL) {
+          /* Not running from ROM */
+          return false;
+     }
+
+     if (gb->cpu.pc >= GB_ROM_BANK_SIZE && d->rom_off < GB_ROM_BANK_SIZE) {
+          /* Bank 0 mapped in the switchable area. The blocks compiled for bank
+           * 0 run at 0x0000-0x3fff, their addresses would be wrong. */
+          return false;
+     }
+
+     /* Binary search for the block starting at this offset */
+     lo = 0;
+     hi = image->block_count;
+     while (lo < hi) {
+          uint32_t mid = lo + (hi - lo) / 2;
+
+          if (image->block_rom_off[mid] < d->rom_off) {
+               lo = mid + 1;
+          } else {
+               hi = mid;
+          }
+     }
+
+     if (lo == image->block_count || image->block_rom_off[lo] != d->rom_off) {
+          /* The recompiler didn't find this block */
+          return false;
+     }
+
+     image->blocks[lo](gb, &gb_aot_ops);
+
+     return true;
+}
@@ -0,0 +1,114 @@
+#ifndef _GB_AOT_H_
+#define _GB_AOT_H_
+
+/* This header is also included by the C code generated by the static
+ * recompiler, through gb.h */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct gb;
+
+/* Bumped every time the generated code or the structures below change. The
+ * generated code also depends on the layout of `struct gb`, see `gb_size` and
+ * `layout` below. */
+#define GB_AOT_VERSION 3
+
+/* Mix the offset and size of `struct gb` field `f` into the FNV-1a hash `h` */
+#define GB_AOT_LAYOUT_FIELD(h, f)                                       \
+     (((((h) ^ (uint32_t)offsetof(struct gb, f)) * 16777619U) ^         \
+       (uint32_t)sizeof(((struct gb *)0)->f)) * 16777619U)
+
+/* Fingerprint of the `struct gb` fields accessed by the recompiled code. It's
+ * a constant expression, evaluated both when the image is compiled and by the
+ * loader, so it can only be used where `struct gb` is complete. */
+#define GB_AOT_LAYOUT                                                   \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+     GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(GB_AOT_LAYOUT_FIELD(       \
+          2166136261U,                                                  \
+          cpu.irq_enable), cpu.irq_enable_next), cpu.pc), cpu.sp),      \
+          cpu.a), cpu.b), cpu.c), cpu.d), cpu.e), cpu.h), cpu.l),       \
+          cpu.bc), cpu.de), cpu.hl),                                    \
+          cpu.f_res), cpu.f_op_a), cpu.f_op_b), cpu.f_n), cpu.limit),   \
+          timestamp), mcycle_duration), sync.first_event),              \
+          cart.rom_bank_off), memory.read_map), memory.write_map),      \
+          zram), dma.running), hdma.run_on_hblank), irq.pending),       \
+          cpu)
+
+/* Name of the `struct gb_aot_image` exported by recompiled objects */
+#define GB_AOT_IMAGE_SYMBOL "gb_aot_image"
+
+/* Emulator functions called by the recompiled code. They're passed through a
+ * table so that the recompiled object doesn't need to link against the
+ * emulator. */
+struct gb_aot_ops {
+     /* gb_cpu_bus_readb */
+     uint8_t (*readb)(struct gb *gb, uint16_t addr);
+     /* gb_cpu_bus_writeb */
+     void (*writeb)(struct gb *gb, uint16_t addr, uint8_t v);
+     /* gb_sync_check_events */
+     void (*check_events)(struct gb *gb);
+     /* gb_cpu_idle_loop */
+     void (*idle_loop)(struct gb *gb, uint16_t jr_pc);
+     /* gb_irq_update_pending */
+     void (*update_irq)(struct gb *gb);
+};
+
+/* Entry point of a recompiled block. Returns with the PC pointing at the next
+ * instruction to run. */
+typedef void (*gb_aot_block_f)(struct gb *gb, const struct gb_aot_ops *ops);
+
+struct gb_aot_image {
+     /* GB_AOT_VERSION */
+     uint32_t version;
+     /* sizeof(struct gb) in the headers the image has been compiled with */
+     uint32_t gb_size;
+     /* GB_AOT_LAYOUT in the headers the image has been compiled with */
+     uint32_t layout;
+     /* Length of the ROM the image has been generated from */
+     uint32_t rom_length;
+     /* gb_aot_rom_hash() of the ROM the image has been generated from */
+     uint32_t rom_hash;
+     /* Number of entries in `block_rom_off` and `blocks` */
+     uint32_t block_count;
+     /* ROM offset of the first instruction of every block, sorted */
+     const uint32_t *block_rom_off;
+     /* Code for every block */
+     const gb_aot_block_f *blocks;
+};
+
+struct gb_aot {
+     /* Handle returned by dlopen(), NULL if no image is loaded */
+     void *handle;
+     /* Recompiled image, NULL if none is loaded */
+     const struct gb_aot_image *image;
+};
+
+/* FNV-1a hash of the ROM, used to make sure that we don't run an image
+ * generated from a different ROM */
+static inline uint32_t gb_aot_rom_hash(const uint8_t *rom, size_t len) {
+     uint32_t h = 2166136261U;
+     size_t i;
+
+     for (i = 0; i < len; i++) {
+          h ^= rom[i];
+          h *= 16777619U;
+     }
+
+     return h;
+}
+
+void gb_aot_load(struct gb *gb, const char *path);
+void gb_aot_unload(struct gb *gb);
+bool gb_aot_run(struct gb *gb);
+
+#endif /* _GB_AOT_H_ */
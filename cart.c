@@ -5,8 +5,6 @@
 #include <errno.h>
 #include "gb.h"
 
-/* 16KB ROM banks */
-#define GB_ROM_BANK_SIZE (16 * 1024)
 /* 8KB RAM banks */
 #define GB_RAM_BANK_SIZE (8 * 1024)
 
@@ -46,6 +44,58 @@ static void gb_cart_get_rom_title(struct gb *gb, char title[17]) {
      title[i] = '\0';
 }
 
+/* Recompute `rom_bank_off` from the current mapper configuration */
+static void gb_cart_update_rom_bank(struct gb *gb) {
+     struct gb_cart *cart = &gb->cart;
+     unsigned bank;
+
+     switch (cart->model) {
+     case GB_CART_SIMPLE:
+          /* No mapper */
+          bank = 1;
+          break;
+     case GB_CART_MBC1:
+          /* Bank 1 can be remapped through this controller */
+          bank = cart->cur_rom_bank;
+
+          if (cart->mbc1_bank_ram) {
+               /* When MBC1 is configured to bank RAM it can only address
+                * 16 ROM banks */
+               bank %= 32;
+          } else {
+               bank %= 128;
+          }
+
+          if (bank == 0) {
+               /* Bank 0 can't be mirrored that way, using a bank of 0 is
+                * the same thing as using 1 */
+               bank = 1;
+          }
+
+          bank %= cart->rom_banks;
+          break;
+     case GB_CART_MBC2:
+          /* The bank register is 4 bits wide but small cartridges don't
+           * decode all of them, the bank number wraps around */
+          bank = cart->cur_rom_bank % cart->rom_banks;
+          break;
+     case GB_CART_MBC3:
+          /* Already wrapped when the register is written */
+          bank = cart->cur_rom_bank;
+          break;
+     case GB_CART_MBC5:
+          /* Bank 0 can be remapped as bank 1 with this controller, so we
+           * need to be careful to handle that case correctly */
+          bank = cart->cur_rom_bank % cart->rom_banks;
+          break;
+     default:
+          /* Should not be reached */
+          die();
+     }
+
+     cart->rom_bank_off = bank * GB_ROM_BANK_SIZE;
+}
+
 void gb_cart_load(struct gb *gb, const char *rom_path) {
      struct gb_cart *cart = &gb->cart;
      FILE *f = fopen(rom_path, "rb");
@@ -319,6 +369,8 @@ void gb_cart_load(struct gb *gb, const char *rom_path) {
      /* Success */
      fclose(f);
 
+     gb_cart_update_rom_bank(gb);
+
      /* See if we have a DMG or GBC game */
      gb->gbc = (cart->rom[GB_CART_OFF_GBC] & 0x80);
 
@@ -424,53 +476,9 @@ uint8_t gb_cart_rom_readb(struct gb *gb, uint16_t addr) {
      struct gb_cart *cart = &gb->cart;
      unsigned rom_off = addr;
 
-     switch (cart->model) {
-     case GB_CART_SIMPLE:
-          /* No mapper */
-          break;
-     case GB_CART_MBC1:
-          if (addr >= GB_ROM_BANK_SIZE) {
-               /* Bank 1 can be remapped through this controller */
-               unsigned bank = cart->cur_rom_bank;
-
-               if (cart->mbc1_bank_ram) {
-                    /* When MBC1 is configured to bank RAM it can only address
-                     * 16 ROM banks */
-                    bank %= 32;
-               } else {
-                    bank %= 128;
-               }
-
-               if (bank == 0) {
-                    /* Bank 0 can't be mirrored that way, using a bank of 0 is
-                     * the same thing as using 1 */
-                    bank = 1;
-               }
-
-               bank %= cart->rom_banks;
-
-               rom_off += (bank - 1) * GB_ROM_BANK_SIZE;
-          }
-          break;
-     case GB_CART_MBC2:
-     case GB_CART_MBC3:
-          if (addr >= GB_ROM_BANK_SIZE) {
-               rom_off += (cart->cur_rom_bank - 1) * GB_ROM_BANK_SIZE;
-          }
-          break;
-     case GB_CART_MBC5:
-          if (addr >= GB_ROM_BANK_SIZE) {
-               /* Bank 0 can be remapped as bank 1 with this controller, so we
-                * need to be careful to handle that case correctly */
-               unsigned bank = cart->cur_rom_bank % cart->rom_banks;
-
-               rom_off -= GB_ROM_BANK_SIZE;
-               rom_off += bank * GB_ROM_BANK_SIZE;
-          }
-          break;
-     default:
-          /* Should not be reached */
-          die();
+     if (addr >= GB_ROM_BANK_SIZE) {
+          rom_off -= GB_ROM_BANK_SIZE;
+          rom_off += cart->rom_bank_off;
      }
 
      return cart->rom[rom_off];
@@ -553,6 +561,9 @@ void gb_cart_rom_writeb(struct gb *gb, uint16_t addr, uint8_t v) {
           /* Should not be reached */
           die();
      }
+
+     gb_cart_update_rom_bank(gb);
+     gb_memory_map_cart(gb);
 }
 
 unsigned gb_cart_mbc1_ram_off(struct gb *gb, uint16_t addr) {
@@ -577,18 +588,22 @@ unsigned gb_cart_mbc1_ram_off(struct gb *gb, uint16_t addr) {
      return bank * GB_RAM_BANK_SIZE + addr;
 }
 
-uint8_t gb_cart_ram_readb(struct gb *gb, uint16_t addr) {
+/* Return the location in cartridge RAM read at `addr`, or NULL if the read
+ * doesn't hit the RAM (no RAM or RTC register). Since the RAM is never banked
+ * or mirrored with a granularity smaller than 512 bytes the result can be used
+ * for the whole 256-byte page containing `addr`. */
+const uint8_t *gb_cart_ram_map(struct gb *gb, uint16_t addr) {
      struct gb_cart *cart = &gb->cart;
      unsigned ram_off;
 
      switch (cart->model) {
      case GB_CART_SIMPLE:
           /* No RAM */
-          return 0xff;
+          return NULL;
      case GB_CART_MBC1:
           if (cart->ram_banks == 0) {
                /* No RAM */
-               return 0xff;
+               return NULL;
           }
 
           ram_off = gb_cart_mbc1_ram_off(gb, addr);
@@ -603,27 +618,22 @@ uint8_t gb_cart_ram_readb(struct gb *gb, uint16_t addr) {
 
                if (cart->ram_banks == 0) {
                     /* No RAM */
-                    return 0xff;
+                    return NULL;
                }
 
                b = cart->cur_ram_bank % cart->ram_banks;
 
                ram_off = b * GB_RAM_BANK_SIZE + addr;
           } else {
-               /* RTC access. Only accessible when the RAM is not write
-                * protected (even for reads) */
-               if (cart->has_rtc && !cart->ram_write_protected) {
-                    return gb_rtc_read(gb, cart->cur_ram_bank);
-               } else {
-                    return 0xff;
-               }
+               /* RTC access */
+               return NULL;
           }
 
           break;
      case GB_CART_MBC5:
           if (cart->ram_banks == 0) {
                /* No RAM */
-               return 0xff;
+               return NULL;
           }
 
           ram_off = cart->cur_ram_bank * GB_RAM_BANK_SIZE + addr;
@@ -631,10 +641,29 @@ uint8_t gb_cart_ram_readb(struct gb *gb, uint16_t addr) {
      default:
           /* Should not be reached */
           die();
-          return 0xff;
+          return NULL;
+     }
+
+     return &cart->ram[ram_off];
+}
+
+uint8_t gb_cart_ram_readb(struct gb *gb, uint16_t addr) {
+     struct gb_cart *cart = &gb->cart;
+     const uint8_t *p = gb_cart_ram_map(gb, addr);
+
+     if (p != NULL) {
+          return *p;
+     }
+
+     if (cart->model == GB_CART_MBC3 && cart->cur_ram_bank > 3) {
+          /* RTC access. Only accessible when the RAM is not write protected
+           * (even for reads) */
+          if (cart->has_rtc && !cart->ram_write_protected) {
+               return gb_rtc_read(gb, cart->cur_ram_bank);
+          }
      }
 
-     return cart->ram[ram_off];
+     return 0xff;
 }
 
 void gb_cart_ram_writeb(struct gb *gb, uint16_t addr, uint8_t v) {
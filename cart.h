@@ -1,6 +1,9 @@
 #ifndef _GB_CART_H_
 #define _GB_CART_H_
 
+/* 16KB ROM banks */
+#define GB_ROM_BANK_SIZE (16 * 1024)
+
 enum gb_cart_model {
      /* No mapper: 2 ROM banks, no RAM */
      GB_CART_SIMPLE = 0,
@@ -23,6 +26,9 @@ struct gb_cart {
      unsigned rom_banks;
      /* Currently selected ROM bank */
      unsigned cur_rom_bank;
+     /* Offset in `rom` of the bank currently mapped at 0x4000-0x7fff. Updated
+      * every time the mapper configuration changes. */
+     unsigned rom_bank_off;
      /* Full cartrige ram contents */
      uint8_t *ram;
      /* RAM length in bytes */
@@ -55,6 +61,7 @@ void gb_cart_unload(struct gb *gb);
 void gb_cart_sync(struct gb *gb);
 uint8_t gb_cart_rom_readb(struct gb *gb, uint16_t addr);
 void gb_cart_rom_writeb(struct gb *gb, uint16_t addr, uint8_t v);
+const uint8_t *gb_cart_ram_map(struct gb *gb, uint16_t addr);
 uint8_t gb_cart_ram_readb(struct gb *gb, uint16_t addr);
 void gb_cart_ram_writeb(struct gb *gb, uint16_t addr, uint8_t v);
 
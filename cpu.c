@@ -2,6 +2,52 @@
 #include <assert.h>
 #include "gb.h"
 
+/* Return the value of the zero flag */
+static inline bool gb_cpu_flag_z(struct gb *gb) {
+     return (gb->cpu.f_res & 0xff) == 0;
+}
+
+/* Return the value of the half-carry flag */
+static inline bool gb_cpu_flag_h(struct gb *gb) {
+     struct gb_cpu *cpu = &gb->cpu;
+
+     return (cpu->f_op_a ^ cpu->f_op_b ^ cpu->f_res) & 0x10;
+}
+
+/* Return the value of the carry flag */
+static inline bool gb_cpu_flag_c(struct gb *gb) {
+     return gb->cpu.f_res & 0x100;
+}
+
+/* Update the flags after an ALU operation that computed `r` from `a` and `b`.
+ * Bits [7:0] of `r` are the result and bit 8 is the carry out, the
+ * half-carry is then bit 4 of a ^ b ^ r. The flags will only be computed if
+ * something needs them. */
+static inline void gb_cpu_set_alu_flags(struct gb *gb,
+                                        uint16_t r, uint8_t a, uint8_t b,
+                                        bool n) {
+     struct gb_cpu *cpu = &gb->cpu;
+
+     cpu->f_res = r;
+     cpu->f_op_a = a;
+     cpu->f_op_b = b;
+     cpu->f_n = n;
+}
+
+/* Set all the flags explicitly, for the instructions whose flags don't follow
+ * the usual ALU rules */
+static inline void gb_cpu_set_flags(struct gb *gb,
+                                    bool z, bool n, bool h, bool c) {
+     struct gb_cpu *cpu = &gb->cpu;
+
+     /* The low byte of the result is 0 if Z is set, 1 otherwise. Since bit 4 is
+      * always 0 we can put H directly in one of the operands */
+     cpu->f_res = ((uint16_t)c << 8) | !z;
+     cpu->f_op_a = h << 4;
+     cpu->f_op_b = 0;
+     cpu->f_n = n;
+}
+
 void gb_cpu_reset(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
 
@@ -19,10 +65,25 @@ void gb_cpu_reset(struct gb *gb) {
      cpu->h  = 0;
      cpu->l  = 0;
 
-     cpu->f_z = false;
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = false;
+     gb_cpu_set_flags(gb, false, false, false, false);
+
+     if (cpu->decode_cache == NULL) {
+          cpu->decode_cache = malloc(GB_CPU_DECODE_CACHE_SIZE *
+                                     sizeof(*cpu->decode_cache));
+          if (cpu->decode_cache == NULL) {
+               perror("Can't allocate decode cache");
+               die();
+          }
+     }
+
+     /* Invalidate the decode cache */
+     for (unsigned i = 0; i < GB_CPU_DECODE_CACHE_SIZE; i++) {
+          cpu->decode_cache[i].rom_off = GB_CPU_DECODED_INVALID;
+     }
+     cpu->operands = NULL;
+     cpu->fetch_ptr = NULL;
+     cpu->idle.jr_rom_off = GB_CPU_DECODED_INVALID;
+     cpu->idle.armed = false;
 
      /* XXX For the time being we don't emulate the BOOTROM so we start the
       * execution just past it */
@@ -37,73 +98,126 @@ void gb_cpu_reset(struct gb *gb) {
 
 }
 
+void gb_cpu_destroy(struct gb *gb) {
+     struct gb_cpu *cpu = &gb->cpu;
+
+     free(cpu->decode_cache);
+     cpu->decode_cache = NULL;
+}
+
+/* Advance the CPU clock. We don't check for device events here, they only
+ * run at instruction boundaries and before accesses to device-visible state
+ * (see gb_cpu_sync_events) which saves a comparison on every memory access */
 static inline void gb_cpu_clock_tick(struct gb *gb, int32_t cycles) {
-     gb->timestamp += cycles >> gb->double_speed;
+     /* `cycles` is always a multiple of 4 */
+     gb->timestamp += (cycles / 4) * gb->mcycle_duration;
+}
 
+/* Run all the device events that are due by now */
+static inline void gb_cpu_sync_events(struct gb *gb) {
      if (gb->timestamp >= gb->sync.first_event) {
           /* We have a device sync pending */
           gb_sync_check_events(gb);
      }
 }
 
-static uint8_t gb_cpu_readb(struct gb *gb, uint16_t addr) {
-     uint8_t b = gb_memory_readb(gb, addr);
+/* Returns true if a read at `addr` can observe the state of a device, in which
+ * case the pending events must run first */
+static inline bool gb_cpu_read_needs_sync(uint16_t addr) {
+     if (addr < 0x8000) {
+          /* ROM */
+          return false;
+     }
 
-     gb_cpu_clock_tick(gb, 4);
+     if (addr >= 0xc000 && addr < 0xfe00) {
+          /* Internal RAM and its mirror */
+          return false;
+     }
 
-     return b;
+     if (addr >= 0xff80 && addr < 0xffff) {
+          /* Zero page RAM */
+          return false;
+     }
+
+     /* VRAM, cartridge RAM, OAM and I/O registers */
+     return true;
 }
 
-static void gb_cpu_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
-     gb_memory_writeb(gb, addr, val);
+/* Returns true if a write at `addr` can be observed by a device, in which case
+ * the pending events must run first */
+static inline bool gb_cpu_write_needs_sync(struct gb *gb, uint16_t addr) {
+     if (addr >= 0xc000 && addr < 0xfe00) {
+          /* Internal RAM is only visible to the DMAs */
+          return gb->dma.running || gb->hdma.run_on_hblank;
+     }
 
-     gb_cpu_clock_tick(gb, 4);
+     if (addr >= 0xff80 && addr < 0xffff) {
+          /* Zero page RAM */
+          return false;
+     }
+
+     /* ROM (mapper configuration), VRAM, cartridge RAM, OAM and I/O
+      * registers */
+     return true;
 }
 
-static uint16_t gb_cpu_bc(struct gb *gb) {
-     uint16_t b = gb->cpu.b;
-     uint16_t c = gb->cpu.c;
+/* Read a byte from the bus without advancing the clock. Also used by the JIT,
+ * which accounts for the cycles itself. */
+uint8_t gb_cpu_bus_readb(struct gb *gb, uint16_t addr) {
+     const uint8_t *page;
 
-     return (b << 8) | c;
-}
+     if (gb_cpu_read_needs_sync(addr)) {
+          gb_cpu_sync_events(gb);
+     }
+
+     page = gb->memory.read_map[addr >> 8];
+     if (page != NULL) {
+          /* Plain memory, we can skip the call to gb_memory_readb */
+          return page[addr & 0xff];
+     }
 
-static void gb_cpu_set_bc(struct gb *gb, uint16_t v) {
-     gb->cpu.b = v >> 8;
-     gb->cpu.c = v & 0xff;
+     return gb_memory_readb(gb, addr);
 }
 
-static uint16_t gb_cpu_de(struct gb *gb) {
-     uint16_t d = gb->cpu.d;
-     uint16_t e = gb->cpu.e;
+/* Write a byte to the bus without advancing the clock */
+void gb_cpu_bus_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
+     uint8_t *page;
 
-     return (d << 8) | e;
-}
+     if (gb_cpu_write_needs_sync(gb, addr)) {
+          gb_cpu_sync_events(gb);
+     }
 
-static void gb_cpu_set_de(struct gb *gb, uint16_t v) {
-     gb->cpu.d = v >> 8;
-     gb->cpu.e = v & 0xff;
+     page = gb->memory.write_map[addr >> 8];
+     if (page != NULL) {
+          /* Plain memory, we can skip the call to gb_memory_writeb */
+          page[addr & 0xff] = val;
+     } else {
+          gb_memory_writeb(gb, addr, val);
+     }
 }
 
-static uint16_t gb_cpu_hl(struct gb *gb) {
-     uint16_t h = gb->cpu.h;
-     uint16_t l = gb->cpu.l;
+static uint8_t gb_cpu_readb(struct gb *gb, uint16_t addr) {
+     uint8_t b = gb_cpu_bus_readb(gb, addr);
 
-     return (h << 8) | l;
+     gb_cpu_clock_tick(gb, 4);
+
+     return b;
 }
 
-static void gb_cpu_set_hl(struct gb *gb, uint16_t v) {
-     gb->cpu.h = v >> 8;
-     gb->cpu.l = v & 0xff;
+static void gb_cpu_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_cpu_bus_writeb(gb, addr, val);
+
+     gb_cpu_clock_tick(gb, 4);
 }
 
 void gb_cpu_dump(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
 
      fprintf(stderr, "Flags: %c %c %c %c  IME: %d\n",
-             cpu->f_z ? 'Z' : '-',
+             gb_cpu_flag_z(gb) ? 'Z' : '-',
              cpu->f_n ? 'N' : '-',
-             cpu->f_h ? 'H' : '-',
-             cpu->f_c ? 'C' : '-',
+             gb_cpu_flag_h(gb) ? 'H' : '-',
+             gb_cpu_flag_c(gb) ? 'C' : '-',
              cpu->irq_enable);
      fprintf(stderr, "PC: 0x%04x [%02x %02x %02x]\n",
              cpu->pc,
@@ -113,11 +227,11 @@ void gb_cpu_dump(struct gb *gb) {
      fprintf(stderr, "SP: 0x%04x\n", cpu->sp);
      fprintf(stderr, "A : 0x%02x\n",   cpu->a);
      fprintf(stderr, "B : 0x%02x  C : 0x%02x  BC : 0x%04x\n",
-             cpu->b, cpu->c, gb_cpu_bc(gb));
+             cpu->b, cpu->c, cpu->bc);
      fprintf(stderr, "D : 0x%02x  E : 0x%02x  DE : 0x%04x\n",
-             cpu->d, cpu->e, gb_cpu_de(gb));
+             cpu->d, cpu->e, cpu->de);
      fprintf(stderr, "H : 0x%02x  L : 0x%02x  HL : 0x%04x\n",
-             cpu->h, cpu->l, gb_cpu_hl(gb));
+             cpu->h, cpu->l, cpu->hl);
      fprintf(stderr, "\n");
 }
 
@@ -157,10 +271,66 @@ static uint16_t gb_cpu_popw(struct gb *gb) {
      return b0 | (b1 << 8);
 }
 
+/* Size of the fetch window */
+#define GB_CPU_FETCH_REGION_SIZE 0x1000U
+
+/* Point the fetch window at the region containing `addr`. Returns false if the
+ * region isn't plain memory that can be read without syncing the devices. */
+static bool gb_cpu_fetch_map(struct gb *gb, uint16_t addr) {
+     struct gb_cpu *cpu = &gb->cpu;
+     uint16_t region = addr & ~(GB_CPU_FETCH_REGION_SIZE - 1);
+     uint16_t last = region + GB_CPU_FETCH_REGION_SIZE - 1;
+     const uint8_t *const *map = &gb->memory.read_map[region >> 8];
+     unsigned p;
+
+     cpu->fetch_ptr = NULL;
+
+     if (gb_cpu_read_needs_sync(region) || gb_cpu_read_needs_sync(last)) {
+          return false;
+     }
+
+     /* The pages must be contiguous in host memory */
+     for (p = 0; p < GB_CPU_FETCH_REGION_SIZE / GB_MEMORY_PAGE_SIZE; p++) {
+          if (map[p] == NULL || map[p] != map[0] + p * GB_MEMORY_PAGE_SIZE) {
+               return false;
+          }
+     }
+
+     cpu->fetch_ptr = map[0];
+     cpu->fetch_region = region;
+
+     return true;
+}
+
+/* Read an instruction byte at `addr` through the fetch window */
+static uint8_t gb_cpu_fetchb(struct gb *gb, uint16_t addr) {
+     struct gb_cpu *cpu = &gb->cpu;
+     uint16_t region = addr & ~(GB_CPU_FETCH_REGION_SIZE - 1);
+
+     if (cpu->fetch_ptr == NULL || cpu->fetch_region != region) {
+          if (!gb_cpu_fetch_map(gb, addr)) {
+               return gb_cpu_readb(gb, addr);
+          }
+     }
+
+     gb_cpu_clock_tick(gb, 4);
+
+     return cpu->fetch_ptr[addr - region];
+}
+
 static uint8_t gb_cpu_next_i8(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
+     uint8_t i8;
 
-     uint8_t i8 = gb_cpu_readb(gb, cpu->pc);
+     if (cpu->operands) {
+          /* We're running a pre-decoded instruction, the operand bytes have
+           * already been fetched but we still need to account for the bus
+           * cycle */
+          i8 = *cpu->operands++;
+          gb_cpu_clock_tick(gb, 4);
+     } else {
+          i8 = gb_cpu_fetchb(gb, cpu->pc);
+     }
 
      cpu->pc = (cpu->pc + 1) & 0xffff;
 
@@ -178,8 +348,6 @@ static uint16_t gb_cpu_next_i16(struct gb *gb) {
  * Instructions *
  ****************/
 
-typedef void (*gb_instruction_f)(struct gb *);
-
 /*****************
  * Miscellaneous *
  *****************/
@@ -203,14 +371,20 @@ static void gb_i_undefined(struct gb *gb) {
 static void gb_i_di(struct gb *gb) {
      gb->cpu.irq_enable = false;
      gb->cpu.irq_enable_next = false;
+     gb_irq_update_pending(gb);
 }
 
 static void gb_i_ei(struct gb *gb) {
      /* Interrupts are re-enabled after the *next* instruction */
      gb->cpu.irq_enable_next = true;
+     gb_irq_update_pending(gb);
 }
 
 static void gb_i_stop(struct gb *gb) {
+     /* Make sure that all the devices are up to date before we change the
+      * clock speed */
+     gb_cpu_sync_events(gb);
+
      if (gb->speed_switch_pending) {
           /* If a speed change has been requested it is executed on STOP and the
            * execution resumes normally after that. */
@@ -223,6 +397,7 @@ static void gb_i_stop(struct gb *gb) {
           gb_dma_sync(gb);
 
           gb->double_speed = !gb->double_speed;
+          gb->mcycle_duration = 4 >> gb->double_speed;
 
           /* Re-sync with new prediction */
           gb_timer_sync(gb);
@@ -239,24 +414,17 @@ static void gb_i_stop(struct gb *gb) {
 /* Halt and wait for interrupt */
 static void gb_i_halt(struct gb *gb) {
      gb->cpu.halted = true;
+     gb_irq_update_pending(gb);
 }
 
 /* Set Carry Flag */
 static void gb_i_scf(struct gb *gb) {
-     struct gb_cpu *cpu = &gb->cpu;
-
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = true;
+     gb_cpu_set_flags(gb, gb_cpu_flag_z(gb), false, false, true);
 }
 
 /* Complement Carry Flag */
 static void gb_i_ccf(struct gb *gb) {
-     struct gb_cpu *cpu = &gb->cpu;
-
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = !cpu->f_c;
+     gb_cpu_set_flags(gb, gb_cpu_flag_z(gb), false, false, !gb_cpu_flag_c(gb));
 }
 
 /**************
@@ -268,11 +436,12 @@ static uint8_t gb_cpu_inc(struct gb *gb, uint8_t v) {
 
      uint8_t r = (v + 1) & 0xff;
 
-     cpu->f_z = (r == 0);
+     /* Carry is not modified by this instruction. We'll have a half-carry if
+      * the low nibble is 0xf, which is what v ^ 1 ^ r gives us */
+     cpu->f_res = (cpu->f_res & 0x100) | r;
+     cpu->f_op_a = v;
+     cpu->f_op_b = 1;
      cpu->f_n = false;
-     /* We'll have a half-carry if the low nibble is 0xf */
-     cpu->f_h = ((v & 0xf) == 0xf);
-     /* Carry is not modified by this instruction */
 
      return r;
 }
@@ -282,11 +451,12 @@ static uint8_t gb_cpu_dec(struct gb *gb, uint8_t v) {
 
      uint8_t r = (v - 1) & 0xff;
 
-     cpu->f_z = (r == 0);
+     /* Carry is not modified by this instruction. We'll have a half-carry if
+      * the low nibble is 0, which is what v ^ 1 ^ r gives us */
+     cpu->f_res = (cpu->f_res & 0x100) | r;
+     cpu->f_op_a = v;
+     cpu->f_op_b = 1;
      cpu->f_n = true;
-     /* We'll have a half-carry if the low nibble is 0 */
-     cpu->f_h = ((v & 0xf) == 0);
-     /* Carry is not modified by this instruction */
 
      return r;
 }
@@ -320,7 +490,7 @@ static void gb_i_inc_l(struct gb *gb) {
 }
 
 static void gb_i_inc_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      v = gb_cpu_inc(gb, v);
@@ -357,7 +527,7 @@ static void gb_i_dec_l(struct gb *gb) {
 }
 
 static void gb_i_dec_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      v = gb_cpu_dec(gb, v);
@@ -367,18 +537,15 @@ static void gb_i_dec_mhl(struct gb *gb) {
 
 /* Add two 16 bit values, update the CPU flags and return the result */
 static uint16_t gb_cpu_addw_set_flags(struct gb *gb, uint16_t a, uint16_t b) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      /* Widen to 32bits to get the carry */
      uint32_t wa = a;
      uint32_t wb = b;
 
      uint32_t r = a + b;
 
-     cpu->f_n = false;
-     cpu->f_c = r & 0x10000;
-     cpu->f_h = (wa ^ wb ^ r) & 0x1000;
-     /* cpu->f_z is not altered */
+     /* Z is not altered */
+     gb_cpu_set_flags(gb, gb_cpu_flag_z(gb), false,
+                      (wa ^ wb ^ r) & 0x1000, r & 0x10000);
 
      gb_cpu_clock_tick(gb, 4);
 
@@ -386,18 +553,13 @@ static uint16_t gb_cpu_addw_set_flags(struct gb *gb, uint16_t a, uint16_t b) {
 }
 
 static uint8_t gb_cpu_sub_set_flags(struct gb *gb, uint8_t a, uint8_t b) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      /* Check for carry using 16bit arithmetic */
      uint16_t al = a;
      uint16_t bl = b;
 
      uint16_t r = al - bl;
 
-     cpu->f_z = !(r & 0xff);
-     cpu->f_n = true;
-     cpu->f_h = (a ^ b ^ r) & 0x10;
-     cpu->f_c = r & 0x100;
+     gb_cpu_set_alu_flags(gb, r, a, b, true);
 
      return r;
 }
@@ -446,7 +608,7 @@ static void gb_i_sub_a_l(struct gb *gb) {
 
 static void gb_i_sub_a_mhl(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -462,19 +624,14 @@ static void gb_i_sub_a_i8(struct gb *gb) {
 
 /* Subtract with carry */
 static uint8_t gb_cpu_sbc_set_flags(struct gb *gb, uint8_t a, uint8_t b) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      /* Check for carry using 16bit arithmetic */
      uint16_t al = a;
      uint16_t bl = b;
-     uint16_t c = cpu->f_c;
+     uint16_t c = gb_cpu_flag_c(gb);
 
      uint16_t r = al - bl - c;
 
-     cpu->f_z = !(r & 0xff);
-     cpu->f_n = true;
-     cpu->f_h = (a ^ b ^ r) & 0x10;
-     cpu->f_c = r & 0x100;
+     gb_cpu_set_alu_flags(gb, r, a, b, true);
 
      return r;
 }
@@ -523,7 +680,7 @@ static void gb_i_sbc_a_l(struct gb *gb) {
 
 static void gb_i_sbc_a_mhl(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -538,18 +695,13 @@ static void gb_i_sbc_a_i8(struct gb *gb) {
 }
 
 static uint8_t gb_cpu_add_set_flags(struct gb *gb, uint8_t a, uint8_t b) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      /* Check for carry using 16bit arithmetic */
      uint16_t al = a;
      uint16_t bl = b;
 
      uint16_t r = al + bl;
 
-     cpu->f_z = !(r & 0xff);
-     cpu->f_n = false;
-     cpu->f_h = (a ^ b ^ r) & 0x10;
-     cpu->f_c = r & 0x100;
+     gb_cpu_set_alu_flags(gb, r, a, b, false);
 
      return r;
 }
@@ -598,7 +750,7 @@ static void gb_i_add_a_l(struct gb *gb) {
 
 static void gb_i_add_a_mhl(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -614,19 +766,14 @@ static void gb_i_add_a_i8(struct gb *gb) {
 
 /* Add with carry and set flags */
 static uint8_t gb_cpu_adc_set_flags(struct gb *gb, uint8_t a, uint8_t b) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      /* Check for carry using 16bit arithmetic */
      uint16_t al = a;
      uint16_t bl = b;
-     uint16_t c = cpu->f_c;
+     uint16_t c = gb_cpu_flag_c(gb);
 
      uint16_t r = al + bl + c;
 
-     cpu->f_z = !(r & 0xff);
-     cpu->f_n = false;
-     cpu->f_h = (a ^ b ^ r) & 0x10;
-     cpu->f_c = r & 0x100;
+     gb_cpu_set_alu_flags(gb, r, a, b, false);
 
      return r;
 }
@@ -675,7 +822,7 @@ static void gb_i_adc_a_l(struct gb *gb) {
 
 static void gb_i_adc_a_mhl(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -698,11 +845,10 @@ static uint16_t gb_add_sp_si8(struct gb *gb) {
      int32_t r = cpu->sp;
      r += i8;
 
-     cpu->f_z = false;
-     cpu->f_n = false;
      /* Carry and Half-carry are for the low byte */
-     cpu->f_h = (cpu->sp ^ i8 ^ r) & 0x10;
-     cpu->f_c = (cpu->sp ^ i8 ^ r) & 0x100;
+     gb_cpu_set_flags(gb, false, false,
+                      (cpu->sp ^ i8 ^ r) & 0x10,
+                      (cpu->sp ^ i8 ^ r) & 0x100);
 
      return (uint16_t)r;
 }
@@ -714,37 +860,37 @@ static void gb_i_add_sp_si8(struct gb *gb) {
 }
 
 static void gb_i_add_hl_bc(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
-     uint16_t bc = gb_cpu_bc(gb);
+     uint16_t hl = gb->cpu.hl;
+     uint16_t bc = gb->cpu.bc;
 
      hl = gb_cpu_addw_set_flags(gb, hl, bc);
 
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_add_hl_de(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
-     uint16_t de = gb_cpu_de(gb);
+     uint16_t hl = gb->cpu.hl;
+     uint16_t de = gb->cpu.de;
 
      hl = gb_cpu_addw_set_flags(gb, hl, de);
 
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_add_hl_hl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      hl = gb_cpu_addw_set_flags(gb, hl, hl);
 
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_add_hl_sp(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      hl = gb_cpu_addw_set_flags(gb, hl, gb->cpu.sp);
 
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_inc_sp(struct gb *gb) {
@@ -758,31 +904,31 @@ static void gb_i_inc_sp(struct gb *gb) {
 }
 
 static void gb_i_inc_bc(struct gb *gb) {
-     uint16_t bc = gb_cpu_bc(gb);
+     uint16_t bc = gb->cpu.bc;
 
      bc = (bc + 1) & 0xffff;
 
-     gb_cpu_set_bc(gb, bc);
+     gb->cpu.bc = bc;
 
      gb_cpu_clock_tick(gb, 4);
 }
 
 static void gb_i_inc_de(struct gb *gb) {
-     uint16_t de = gb_cpu_de(gb);
+     uint16_t de = gb->cpu.de;
 
      de = (de + 1) & 0xffff;
 
-     gb_cpu_set_de(gb, de);
+     gb->cpu.de = de;
 
      gb_cpu_clock_tick(gb, 4);
 }
 
 static void gb_i_inc_hl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      hl = (hl + 1) & 0xffff;
 
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 
      gb_cpu_clock_tick(gb, 4);
 }
@@ -798,31 +944,31 @@ static void gb_i_dec_sp(struct gb *gb) {
 }
 
 static void gb_i_dec_bc(struct gb *gb) {
-     uint16_t bc = gb_cpu_bc(gb);
+     uint16_t bc = gb->cpu.bc;
 
      bc = (bc - 1) & 0xffff;
 
-     gb_cpu_set_bc(gb, bc);
+     gb->cpu.bc = bc;
 
      gb_cpu_clock_tick(gb, 4);
 }
 
 static void gb_i_dec_de(struct gb *gb) {
-     uint16_t de = gb_cpu_de(gb);
+     uint16_t de = gb->cpu.de;
 
      de = (de - 1) & 0xffff;
 
-     gb_cpu_set_de(gb, de);
+     gb->cpu.de = de;
 
      gb_cpu_clock_tick(gb, 4);
 }
 
 static void gb_i_dec_hl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      hl = (hl - 1) & 0xffff;
 
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 
      gb_cpu_clock_tick(gb, 4);
 }
@@ -871,7 +1017,7 @@ static void gb_i_cp_a_l(struct gb *gb) {
 
 static void gb_i_cp_a_mhl(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -886,14 +1032,10 @@ static void gb_i_cp_a_i8(struct gb *gb) {
 }
 
 static uint8_t gb_cpu_and_set_flags(struct gb *gb, uint8_t a, uint8_t b) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      uint8_t r = a & b;
 
-     cpu->f_z = (r == 0);
-     cpu->f_n = false;
-     cpu->f_h = true;
-     cpu->f_c = false;
+     /* Half-carry is always set */
+     gb_cpu_set_alu_flags(gb, r, r ^ 0x10, 0, false);
 
      return r;
 }
@@ -942,7 +1084,7 @@ static void gb_i_and_a_l(struct gb *gb) {
 
 static void gb_i_and_a_mhl(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -957,14 +1099,9 @@ static void gb_i_and_a_i8(struct gb *gb) {
 }
 
 static uint8_t gb_cpu_xor_set_flags(struct gb *gb, uint8_t a, uint8_t b) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      uint8_t r = a ^ b;
 
-     cpu->f_z = (r == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = false;
+     gb_cpu_set_alu_flags(gb, r, r, 0, false);
 
      return r;
 }
@@ -1013,7 +1150,7 @@ static void gb_i_xor_a_l(struct gb *gb) {
 
 static void gb_i_xor_a_mhl(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -1028,14 +1165,9 @@ static void gb_i_xor_a_i8(struct gb *gb) {
 }
 
 static uint8_t gb_cpu_or_set_flags(struct gb *gb, uint8_t a, uint8_t b) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      uint8_t r = a | b;
 
-     cpu->f_z = (r == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = false;
+     gb_cpu_set_alu_flags(gb, r, r, 0, false);
 
      return r;
 }
@@ -1084,7 +1216,7 @@ static void gb_i_or_a_l(struct gb *gb) {
 
 static void gb_i_or_a_mhl(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -1104,8 +1236,7 @@ static void gb_i_cpl_a(struct gb *gb) {
      /* Complement A */
      cpu->a = ~cpu->a;
 
-     cpu->f_n = true;
-     cpu->f_h = true;
+     gb_cpu_set_flags(gb, gb_cpu_flag_z(gb), true, true, gb_cpu_flag_c(gb));
 }
 
 /* Rotate Left A */
@@ -1120,17 +1251,14 @@ static void gb_i_rlca(struct gb *gb) {
 
      cpu->a = a;
 
-     cpu->f_z = false;
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = c;
+     gb_cpu_set_flags(gb, false, false, false, c);
 }
 
 /* Rotate Left A through carry */
 static void gb_i_rla(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
      uint8_t a = cpu->a;
-     uint8_t c = cpu->f_c;
+     uint8_t c = gb_cpu_flag_c(gb);
      uint8_t new_c;
 
      /* Current carry goes to LSB of A, MSB of A becomes new carry */
@@ -1140,10 +1268,7 @@ static void gb_i_rla(struct gb *gb) {
 
      cpu->a = a;
 
-     cpu->f_z = false;
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = new_c;
+     gb_cpu_set_flags(gb, false, false, false, new_c);
 }
 
 /* Rotate Right A */
@@ -1158,17 +1283,14 @@ static void gb_i_rrca(struct gb *gb) {
 
      cpu->a = a;
 
-     cpu->f_z = false;
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = c;
+     gb_cpu_set_flags(gb, false, false, false, c);
 }
 
 /* Rotate Right A through carry */
 static void gb_i_rra(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
      uint8_t a = cpu->a;
-     uint8_t c = cpu->f_c;
+     uint8_t c = gb_cpu_flag_c(gb);
      uint8_t new_c;
 
      /* Current carry goes to MSB of A, LSB of A becomes new carry */
@@ -1178,10 +1300,7 @@ static void gb_i_rra(struct gb *gb) {
 
      cpu->a = a;
 
-     cpu->f_z = false;
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = new_c;
+     gb_cpu_set_flags(gb, false, false, false, new_c);
 }
 
 /* Decimal adjust `A` for BCD operations */
@@ -1191,13 +1310,13 @@ static void gb_i_daa(struct gb *gb) {
      uint8_t adj = 0;
 
      /* See if we had a carry/borrow for the low nibble in the last operation */
-     if (cpu->f_h) {
+     if (gb_cpu_flag_h(gb)) {
           /* Yes, we have to adjust it. */
           adj |= 0x06;
      }
 
      /* See if we had a carry/borrow for the high nibble in the last operation */
-     if (cpu->f_c) {
+     if (gb_cpu_flag_c(gb)) {
           // Yes, we have to adjust it.
           adj |= 0x60;
      }
@@ -1223,9 +1342,7 @@ static void gb_i_daa(struct gb *gb) {
         };
 
      cpu->a = a;
-     cpu->f_z = (a == 0);
-     cpu->f_c = ((adj & 0x60) != 0);
-     cpu->f_h = false;
+     gb_cpu_set_flags(gb, a == 0, cpu->f_n, false, (adj & 0x60) != 0);
 }
 
 /*********
@@ -1276,7 +1393,7 @@ static void gb_i_ld_l_i8(struct gb *gb) {
 
 static void gb_i_ld_mhl_i8(struct gb *gb) {
      uint8_t i8 = gb_cpu_next_i8(gb);
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      gb_cpu_writeb(gb, hl, i8);
 }
@@ -1332,13 +1449,13 @@ static void gb_i_ldh_a_mc(struct gb *gb) {
 static void gb_i_ld_bc_i16(struct gb *gb) {
      uint16_t i16 = gb_cpu_next_i16(gb);
 
-     gb_cpu_set_bc(gb, i16);
+     gb->cpu.bc = i16;
 }
 
 static void gb_i_ld_de_i16(struct gb *gb) {
      uint16_t i16 = gb_cpu_next_i16(gb);
 
-     gb_cpu_set_de(gb, i16);
+     gb->cpu.de = i16;
 }
 
 static void gb_i_ld_sp_i16(struct gb *gb) {
@@ -1348,7 +1465,7 @@ static void gb_i_ld_sp_i16(struct gb *gb) {
 }
 
 static void gb_i_ld_sp_hl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      gb->cpu.sp = hl;
 
@@ -1358,168 +1475,168 @@ static void gb_i_ld_sp_hl(struct gb *gb) {
 static void gb_i_ld_hl_i16(struct gb *gb) {
      uint16_t i16 = gb_cpu_next_i16(gb);
 
-     gb_cpu_set_hl(gb, i16);
+     gb->cpu.hl = i16;
 }
 
 static void gb_i_ld_mbc_a(struct gb *gb) {
-     uint16_t bc = gb_cpu_bc(gb);
+     uint16_t bc = gb->cpu.bc;
      uint16_t a = gb->cpu.a;
 
      gb_cpu_writeb(gb, bc, a);
 }
 
 static void gb_i_ld_mde_a(struct gb *gb) {
-     uint16_t de = gb_cpu_de(gb);
+     uint16_t de = gb->cpu.de;
      uint16_t a = gb->cpu.a;
 
      gb_cpu_writeb(gb, de, a);
 }
 
 static void gb_i_ld_mhl_a(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t a = gb->cpu.a;
 
      gb_cpu_writeb(gb, hl, a);
 }
 
 static void gb_i_ld_mhl_b(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t b = gb->cpu.b;
 
      gb_cpu_writeb(gb, hl, b);
 }
 
 static void gb_i_ld_mhl_c(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t c = gb->cpu.c;
 
      gb_cpu_writeb(gb, hl, c);
 }
 
 static void gb_i_ld_mhl_d(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t d = gb->cpu.d;
 
      gb_cpu_writeb(gb, hl, d);
 }
 
 static void gb_i_ld_mhl_e(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t e = gb->cpu.e;
 
      gb_cpu_writeb(gb, hl, e);
 }
 
 static void gb_i_ld_mhl_h(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t h = gb->cpu.h;
 
      gb_cpu_writeb(gb, hl, h);
 }
 
 static void gb_i_ld_mhl_l(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t l = gb->cpu.l;
 
      gb_cpu_writeb(gb, hl, l);
 }
 
 static void gb_i_ldi_mhl_a(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t a = gb->cpu.a;
 
      gb_cpu_writeb(gb, hl, a);
 
      hl = (hl + 1) & 0xffff;
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_ldd_mhl_a(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint16_t a = gb->cpu.a;
 
      gb_cpu_writeb(gb, hl, a);
 
      hl = (hl - 1) & 0xffff;
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_ld_a_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      gb->cpu.a = v;
 }
 
 static void gb_i_ldi_a_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      gb->cpu.a = gb_cpu_readb(gb, hl);
 
      hl = (hl + 1) & 0xffff;
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_ldd_a_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      gb->cpu.a = gb_cpu_readb(gb, hl);
 
      hl = (hl - 1) & 0xffff;
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_ld_a_mbc(struct gb *gb) {
-     uint16_t bc = gb_cpu_bc(gb);
+     uint16_t bc = gb->cpu.bc;
      uint8_t v = gb_cpu_readb(gb, bc);
 
      gb->cpu.a = v;
 }
 
 static void gb_i_ld_a_mde(struct gb *gb) {
-     uint16_t de = gb_cpu_de(gb);
+     uint16_t de = gb->cpu.de;
      uint8_t v = gb_cpu_readb(gb, de);
 
      gb->cpu.a = v;
 }
 
 static void gb_i_ld_b_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      gb->cpu.b = v;
 }
 
 static void gb_i_ld_c_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      gb->cpu.c = v;
 }
 
 static void gb_i_ld_d_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      gb->cpu.d = v;
 }
 
 static void gb_i_ld_e_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      gb->cpu.e = v;
 }
 
 static void gb_i_ld_h_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      gb->cpu.h = v;
 }
 
 static void gb_i_ld_l_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v = gb_cpu_readb(gb, hl);
 
      gb->cpu.l = v;
@@ -1528,13 +1645,13 @@ static void gb_i_ld_l_mhl(struct gb *gb) {
 static void gb_i_ld_hl_sp_si8(struct gb *gb) {
      uint16_t hl = gb_add_sp_si8(gb);
 
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 
      gb_cpu_clock_tick(gb, 4);
 }
 
 static void gb_i_push_bc(struct gb *gb) {
-     uint16_t bc = gb_cpu_bc(gb);
+     uint16_t bc = gb->cpu.bc;
 
      gb_cpu_pushw(gb, bc);
 
@@ -1542,7 +1659,7 @@ static void gb_i_push_bc(struct gb *gb) {
 }
 
 static void gb_i_push_de(struct gb *gb) {
-     uint16_t de = gb_cpu_de(gb);
+     uint16_t de = gb->cpu.de;
 
      gb_cpu_pushw(gb, de);
 
@@ -1550,7 +1667,7 @@ static void gb_i_push_de(struct gb *gb) {
 }
 
 static void gb_i_push_hl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      gb_cpu_pushw(gb, hl);
 
@@ -1561,10 +1678,10 @@ static void gb_i_push_af(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
      uint8_t f = 0;
 
-     f |= cpu->f_z << 7;
+     f |= gb_cpu_flag_z(gb) << 7;
      f |= cpu->f_n << 6;
-     f |= cpu->f_h << 5;
-     f |= cpu->f_c << 4;
+     f |= gb_cpu_flag_h(gb) << 5;
+     f |= gb_cpu_flag_c(gb) << 4;
 
      gb_cpu_pushb(gb, cpu->a);
      gb_cpu_pushb(gb, f);
@@ -1575,19 +1692,19 @@ static void gb_i_push_af(struct gb *gb) {
 static void gb_i_pop_bc(struct gb *gb) {
      uint16_t bc = gb_cpu_popw(gb);
 
-     gb_cpu_set_bc(gb, bc);
+     gb->cpu.bc = bc;
 }
 
 static void gb_i_pop_de(struct gb *gb) {
      uint16_t de = gb_cpu_popw(gb);
 
-     gb_cpu_set_de(gb, de);
+     gb->cpu.de = de;
 }
 
 static void gb_i_pop_hl(struct gb *gb) {
      uint16_t hl = gb_cpu_popw(gb);
 
-     gb_cpu_set_hl(gb, hl);
+     gb->cpu.hl = hl;
 }
 
 static void gb_i_pop_af(struct gb *gb) {
@@ -1598,10 +1715,11 @@ static void gb_i_pop_af(struct gb *gb) {
      cpu->a = a;
 
      /* Restore flags from memory (low 4 bits are ignored) */
-     cpu->f_z = f & (1U << 7);
-     cpu->f_n = f & (1U << 6);
-     cpu->f_h = f & (1U << 5);
-     cpu->f_c = f & (1U << 4);
+     gb_cpu_set_flags(gb,
+                      f & (1U << 7),
+                      f & (1U << 6),
+                      f & (1U << 5),
+                      f & (1U << 4));
 }
 
 static void gb_i_ld_a_b(struct gb *gb) {
@@ -1783,61 +1901,375 @@ static void gb_i_jp_i16(struct gb *gb) {
 }
 
 static void gb_i_jp_nz_i16(struct gb *gb) {
-     struct gb_cpu *cpu = &gb->cpu;
      uint16_t i16 = gb_cpu_next_i16(gb);
 
-     if (!cpu->f_z) {
+     if (!gb_cpu_flag_z(gb)) {
           gb_cpu_load_pc(gb, i16);
      }
 }
 
 static void gb_i_jp_z_i16(struct gb *gb) {
-     struct gb_cpu *cpu = &gb->cpu;
      uint16_t i16 = gb_cpu_next_i16(gb);
 
-     if (cpu->f_z) {
+     if (gb_cpu_flag_z(gb)) {
           gb_cpu_load_pc(gb, i16);
      }
 }
 
 static void gb_i_jp_nc_i16(struct gb *gb) {
-     struct gb_cpu *cpu = &gb->cpu;
      uint16_t i16 = gb_cpu_next_i16(gb);
 
-     if (!cpu->f_c) {
+     if (!gb_cpu_flag_c(gb)) {
           gb_cpu_load_pc(gb, i16);
      }
 }
 
 static void gb_i_jp_c_i16(struct gb *gb) {
-     struct gb_cpu *cpu = &gb->cpu;
      uint16_t i16 = gb_cpu_next_i16(gb);
 
-     if (cpu->f_c) {
+     if (gb_cpu_flag_c(gb)) {
           gb_cpu_load_pc(gb, i16);
      }
 }
 
 static void gb_i_jp_hl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
 
      /* This doesn't incur any additional delay so we don't call gb_cpu_load_pc
       */
      gb->cpu.pc = hl;
 }
 
+/*
+ * Idle loop detection
+ *
+ * Games often spin in tight loops polling LY, STAT, IF, the joypad or a RAM
+ * flag set by an interrupt handler. As long as no event runs the values they
+ * read can't change, so once the CPU has gone through the loop once and came
+ * back to its head in the same state every following iteration will do
+ * exactly the same thing. We can then skip whole iterations at once up to the
+ * next event, the same way we do for HALT, without changing the timing at
+ * all.
+ */
+
+/* Returns true if reading `addr` returns the same value until the next event
+ * as long as the CPU doesn't write to memory */
+static bool gb_cpu_idle_addr_stable(uint16_t addr) {
+     if (addr < 0x8000) {
+          /* ROM */
+          return true;
+     }
+
+     if (addr >= 0xc000 && addr < 0xfe00) {
+          /* Internal RAM and its mirror */
+          return true;
+     }
+
+     if (addr >= 0xff80) {
+          /* Zero page RAM and IE */
+          return true;
+     }
+
+     switch (addr) {
+     /* Joypad, only updated by the frontend between two time slices */
+     case 0xff00:
+     /* IF */
+     case 0xff0f:
+     /* STAT, gb_cpu_idle_loop bounds the skip at the next mode change
+      * returned by gb_gpu_next_mode_change */
+     case 0xff41:
+     /* LY */
+     case 0xff44:
+     /* LYC */
+     case 0xff45:
+          return true;
+     default:
+          return false;
+     }
+}
+
+/* Look at the body of the loop between `head` and the JR at `jr_pc`. Returns
+ * true if it can only read stable locations and modify A and the flags. */
+static bool gb_cpu_idle_analyze(struct gb *gb, uint16_t head, uint16_t jr_pc) {
+     struct gb_cpu_idle *idle = &gb->cpu.idle;
+     uint16_t pc = head;
+
+     idle->reads_stat = false;
+     idle->pointers = 0;
+     /* Taken JR */
+     idle->cycles = 12;
+
+     if (head > jr_pc || jr_pc - head > GB_CPU_IDLE_MAX_BODY) {
+          return false;
+     }
+
+     while (pc < jr_pc) {
+          const struct gb_cpu_decoded *d = gb_cpu_decode(gb, pc);
+          uint16_t addr;
+          uint8_t op;
+
+          if (d == NULL) {
+               return false;
+          }
+
+          op = d->opcode;
+
+          switch (op) {
+          /* NOP */
+          case 0x00:
+          /* RLCA, RRCA, RLA, RRA */
+          case 0x07:
+          case 0x0f:
+          case 0x17:
+          case 0x1f:
+          /* DAA, CPL, SCF, CCF */
+          case 0x27:
+          case 0x2f:
+          case 0x37:
+          case 0x3f:
+          /* INC A, DEC A */
+          case 0x3c:
+          case 0x3d:
+          /* LD A, r */
+          case 0x78:
+          case 0x79:
+          case 0x7a:
+          case 0x7b:
+          case 0x7c:
+          case 0x7d:
+          case 0x7f:
+               idle->cycles += 4;
+               break;
+          /* LD A, (BC) */
+          case 0x0a:
+               idle->pointers |= GB_CPU_IDLE_PTR_BC;
+               idle->cycles += 8;
+               break;
+          /* LD A, (DE) */
+          case 0x1a:
+               idle->pointers |= GB_CPU_IDLE_PTR_DE;
+               idle->cycles += 8;
+               break;
+          /* LD A, (HL) */
+          case 0x7e:
+               idle->pointers |= GB_CPU_IDLE_PTR_HL;
+               idle->cycles += 8;
+               break;
+          /* LD A, (0xff00 + C) */
+          case 0xf2:
+               idle->pointers |= GB_CPU_IDLE_PTR_C;
+               idle->cycles += 8;
+               break;
+          /* LD A, i8 and ALU A, i8 */
+          case 0x3e:
+          case 0xc6:
+          case 0xce:
+          case 0xd6:
+          case 0xde:
+          case 0xe6:
+          case 0xee:
+          case 0xf6:
+          case 0xfe:
+               idle->cycles += 8;
+               break;
+          /* LDH A, (0xff00 + i8) */
+          case 0xf0:
+               addr = 0xff00 | d->operands[0];
+               if (!gb_cpu_idle_addr_stable(addr)) {
+                    return false;
+               }
+               idle->reads_stat |= (addr == 0xff41);
+               idle->cycles += 12;
+               break;
+          /* LD A, (i16) */
+          case 0xfa:
+               addr = d->operands[0] | (d->operands[1] << 8);
+               if (!gb_cpu_idle_addr_stable(addr)) {
+                    return false;
+               }
+               idle->reads_stat |= (addr == 0xff41);
+               idle->cycles += 16;
+               break;
+          /* 0xCB-prefixed, we accept BIT with any operand and everything
+           * operating on A */
+          case 0xcb:
+               if ((d->operands[0] & 7) == 6) {
+                    if (d->operands[0] < 0x40 || d->operands[0] >= 0x80) {
+                         /* Read-modify-write of (HL) */
+                         return false;
+                    }
+                    idle->pointers |= GB_CPU_IDLE_PTR_HL;
+                    idle->cycles += 12;
+               } else if (d->operands[0] >= 0x40 && d->operands[0] < 0x80) {
+                    idle->cycles += 8;
+               } else if ((d->operands[0] & 7) == 7) {
+                    idle->cycles += 8;
+               } else {
+                    return false;
+               }
+               break;
+          default:
+               if (op >= 0x80 && op < 0xc0) {
+                    /* ALU A, r and ALU A, (HL) */
+                    if ((op & 7) == 6) {
+                         idle->pointers |= GB_CPU_IDLE_PTR_HL;
+                         idle->cycles += 8;
+                    } else {
+                         idle->cycles += 4;
+                    }
+                    break;
+               }
+
+               return false;
+          }
+
+          pc += gb_opcode_len[op];
+     }
+
+     /* The last instruction must end right where the JR starts */
+     return pc == jr_pc;
+}
+
+/* Returns true if the locations the loop reads through register pairs are
+ * stable. Since the body can only modify A the pointers don't change from one
+ * iteration to the next. */
+static bool gb_cpu_idle_pointers_stable(struct gb *gb, bool *reads_stat) {
+     struct gb_cpu *cpu = &gb->cpu;
+     uint8_t pointers = cpu->idle.pointers;
+     uint16_t addr[4];
+     unsigned n = 0;
+     unsigned i;
+
+     if (pointers & GB_CPU_IDLE_PTR_BC) {
+          addr[n++] = cpu->bc;
+     }
+     if (pointers & GB_CPU_IDLE_PTR_DE) {
+          addr[n++] = cpu->de;
+     }
+     if (pointers & GB_CPU_IDLE_PTR_HL) {
+          addr[n++] = cpu->hl;
+     }
+     if (pointers & GB_CPU_IDLE_PTR_C) {
+          addr[n++] = 0xff00 | cpu->c;
+     }
+
+     for (i = 0; i < n; i++) {
+          if (!gb_cpu_idle_addr_stable(addr[i])) {
+               return false;
+          }
+          *reads_stat |= (addr[i] == 0xff41);
+     }
+
+     return true;
+}
+
+/* Called after a backward JR at `jr_pc` has been taken, with PC pointing at
+ * the head of the loop */
+void gb_cpu_idle_loop(struct gb *gb, uint16_t jr_pc) {
+     struct gb_cpu *cpu = &gb->cpu;
+     struct gb_cpu_idle *idle = &cpu->idle;
+     struct gb_irq *irq = &gb->irq;
+     const struct gb_cpu_decoded *d;
+     bool reads_stat;
+     int64_t horizon;
+     int32_t iterations;
+
+     d = gb_cpu_decode(gb, jr_pc);
+     if (d == NULL) {
+          /* Not running from ROM */
+          return;
+     }
+
+     if (d->rom_off != idle->jr_rom_off) {
+          /* New loop */
+          idle->jr_rom_off = d->rom_off;
+          idle->armed = false;
+          idle->pure = gb_cpu_idle_analyze(gb, cpu->pc, jr_pc);
+     }
+
+     if (!idle->pure) {
+          return;
+     }
+
+     reads_stat = idle->reads_stat;
+
+     if (gb->timestamp >= gb->sync.first_event ||
+         irq->pending ||
+         !gb_cpu_idle_pointers_stable(gb, &reads_stat)) {
+          /* The main loop has something to do before the next iteration */
+          idle->armed = false;
+          return;
+     }
+
+     /* If we've run exactly one iteration since the last time we were here
+      * without any event in between, and we're back in the same state, then
+      * every iteration until the horizon will be identical */
+     if (idle->armed &&
+         gb->timestamp - idle->date ==
+         (idle->cycles / 4) * gb->mcycle_duration &&
+         gb->timestamp < idle->horizon &&
+         cpu->a == idle->a &&
+         cpu->f_res == idle->f_res &&
+         cpu->f_op_a == idle->f_op_a &&
+         cpu->f_op_b == idle->f_op_b &&
+         cpu->f_n == idle->f_n) {
+          int32_t period = gb->timestamp - idle->date;
+
+          horizon = idle->horizon;
+          if (cpu->limit < horizon) {
+               /* We never skip past the end of the time slice */
+               horizon = cpu->limit;
+          }
+
+          /* Skip as many iterations as we can while making sure that all the
+           * reads happen before the horizon. We leave the last one to the
+           * interpreter so that it ends up in the same state as if we had
+           * run everything. We're still at an instruction boundary so
+           * there's no need to go through gb_cpu_clock_tick. */
+          iterations = (horizon - gb->timestamp) / period - 1;
+          if (iterations > 0) {
+               gb->timestamp += iterations * period;
+          }
+     }
+
+     horizon = gb->sync.first_event;
+     if (reads_stat) {
+          int64_t mode_change = gb_gpu_next_mode_change(gb);
+
+          if (mode_change < horizon) {
+               horizon = mode_change;
+          }
+     }
+
+     idle->armed = true;
+     idle->date = gb->timestamp;
+     idle->horizon = horizon;
+     idle->a = cpu->a;
+     idle->f_res = cpu->f_res;
+     idle->f_op_a = cpu->f_op_a;
+     idle->f_op_b = cpu->f_op_b;
+     idle->f_n = cpu->f_n;
+}
+
 static void gb_i_jr_si8(struct gb *gb) {
      struct gb_cpu *cpu = &gb->cpu;
      uint8_t i8 = gb_cpu_next_i8(gb);
      uint16_t pc = cpu->pc;
+     /* Address of the JR itself */
+     uint16_t jr_pc = (pc - 2) & 0xffff;
 
      pc = pc + (int8_t)i8;
 
      gb_cpu_load_pc(gb, pc);
+
+     if ((int8_t)i8 < 0) {
+          /* Backward jump, we may be spinning in a polling loop */
+          gb_cpu_idle_loop(gb, jr_pc);
+     }
 }
 
 static void gb_i_jr_z_si8(struct gb *gb) {
-     if (gb->cpu.f_z) {
+     if (gb_cpu_flag_z(gb)) {
           gb_i_jr_si8(gb);
      } else {
           /* Discard immediate value */
@@ -1846,7 +2278,7 @@ static void gb_i_jr_z_si8(struct gb *gb) {
 }
 
 static void gb_i_jr_c_si8(struct gb *gb) {
-     if (gb->cpu.f_c) {
+     if (gb_cpu_flag_c(gb)) {
           gb_i_jr_si8(gb);
      } else {
           /* Discard immediate value */
@@ -1855,7 +2287,7 @@ static void gb_i_jr_c_si8(struct gb *gb) {
 }
 
 static void gb_i_jr_nz_si8(struct gb *gb) {
-     if (!gb->cpu.f_z) {
+     if (!gb_cpu_flag_z(gb)) {
           gb_i_jr_si8(gb);
      } else {
           /* Discard immediate value */
@@ -1864,7 +2296,7 @@ static void gb_i_jr_nz_si8(struct gb *gb) {
 }
 
 static void gb_i_jr_nc_si8(struct gb *gb) {
-     if (!gb->cpu.f_c) {
+     if (!gb_cpu_flag_c(gb)) {
           gb_i_jr_si8(gb);
      } else {
           /* Discard immediate value */
@@ -1881,7 +2313,7 @@ static void gb_i_call_i16(struct gb *gb) {
 }
 
 static void gb_i_call_nz_i16(struct gb *gb) {
-     if (!gb->cpu.f_z) {
+     if (!gb_cpu_flag_z(gb)) {
           gb_i_call_i16(gb);
      } else {
           /* Discard immediate value */
@@ -1890,7 +2322,7 @@ static void gb_i_call_nz_i16(struct gb *gb) {
 }
 
 static void gb_i_call_z_i16(struct gb *gb) {
-     if (gb->cpu.f_z) {
+     if (gb_cpu_flag_z(gb)) {
           gb_i_call_i16(gb);
      } else {
           /* Discard immediate value */
@@ -1899,7 +2331,7 @@ static void gb_i_call_z_i16(struct gb *gb) {
 }
 
 static void gb_i_call_nc_i16(struct gb *gb) {
-     if (!gb->cpu.f_c) {
+     if (!gb_cpu_flag_c(gb)) {
           gb_i_call_i16(gb);
      } else {
           /* Discard immediate value */
@@ -1908,7 +2340,7 @@ static void gb_i_call_nc_i16(struct gb *gb) {
 }
 
 static void gb_i_call_c_i16(struct gb *gb) {
-     if (gb->cpu.f_c) {
+     if (gb_cpu_flag_c(gb)) {
           gb_i_call_i16(gb);
      } else {
           /* Discard immediate value */
@@ -1923,7 +2355,7 @@ static void gb_i_ret(struct gb *gb) {
 }
 
 static void gb_i_ret_z(struct gb *gb) {
-     if (gb->cpu.f_z) {
+     if (gb_cpu_flag_z(gb)) {
           gb_i_ret(gb);
      }
 
@@ -1931,7 +2363,7 @@ static void gb_i_ret_z(struct gb *gb) {
 }
 
 static void gb_i_ret_c(struct gb *gb) {
-     if (gb->cpu.f_c) {
+     if (gb_cpu_flag_c(gb)) {
           gb_i_ret(gb);
      }
 
@@ -1939,7 +2371,7 @@ static void gb_i_ret_c(struct gb *gb) {
 }
 
 static void gb_i_ret_nz(struct gb *gb) {
-     if (!gb->cpu.f_z) {
+     if (!gb_cpu_flag_z(gb)) {
           gb_i_ret(gb);
      }
 
@@ -1947,7 +2379,7 @@ static void gb_i_ret_nz(struct gb *gb) {
 }
 
 static void gb_i_ret_nc(struct gb *gb) {
-     if (!gb->cpu.f_c) {
+     if (!gb_cpu_flag_c(gb)) {
           gb_i_ret(gb);
      }
 
@@ -1959,6 +2391,7 @@ static void gb_i_reti(struct gb *gb) {
 
      gb->cpu.irq_enable = true;
      gb->cpu.irq_enable_next = true;
+     gb_irq_update_pending(gb);
 }
 
 static void gb_cpu_rst(struct gb *gb, uint16_t target) {
@@ -2001,7 +2434,7 @@ static void gb_i_rst_38(struct gb *gb) {
 
 static void gb_i_op_cb(struct gb *gb);
 
-static gb_instruction_f gb_instructions[0x100] = {
+static const gb_instruction_f gb_instructions[0x100] = {
      // 0x00
      gb_i_nop,
      gb_i_ld_bc_i16,
@@ -2337,49 +2770,489 @@ static void gb_cpu_check_interrupts(struct gb *gb) {
      gb_cpu_load_pc(gb, handler);
 }
 
-static void gb_cpu_run_instruction(struct gb *gb) {
-     uint8_t instruction;
+/* Run gb_cpu_check_interrupts and update the IME, but only if IF, IE, the IME
+ * or the halted state changed in a way that could make it do something. This
+ * is the same as doing it for every instruction. */
+static inline void gb_cpu_handle_interrupts(struct gb *gb) {
+     struct gb_cpu *cpu = &gb->cpu;
+
+     if (!gb->irq.pending) {
+          /* Common case, nothing to do */
+          return;
+     }
 
-     instruction = gb_cpu_next_i8(gb);
+     gb_cpu_check_interrupts(gb);
+     cpu->irq_enable = cpu->irq_enable_next;
 
-     gb_instructions[instruction](gb);
+     gb_irq_update_pending(gb);
 }
 
-int32_t gb_cpu_run_cycles(struct gb *gb, int32_t cycles) {
+/*
+ * Superinstructions
+ *
+ * Some short instruction sequences show up all the time in copy, delay and
+ * polling loops. When one of them is found in ROM the decode cache entry of
+ * its first instruction gets a fused handler which runs the whole sequence in
+ * one dispatch from the interpreter loop.
+ *
+ * Between two instructions the fused handler does exactly what the main loop
+ * would do before running the next one, and gives control back to the main
+ * loop if it would have done anything else. The instructions are run by their
+ * regular handlers so the timing is unchanged.
+ *
+ * Build with GB_CPU_NO_FUSION defined to disable this.
+ */
+
+#ifndef GB_CPU_NO_FUSION
+
+/* Called between two instructions of a fused sequence. If the main loop would
+ * simply run `opcode` next we fetch it and return true, otherwise we return
+ * false and the fused handler must give control back to the main loop. */
+static bool gb_cpu_fused_next(struct gb *gb, uint8_t opcode) {
      struct gb_cpu *cpu = &gb->cpu;
-     /* Rebase the synchronization timestamps, which has the side effect of
-      * setting gb->timestamp to 0 */
-     gb_sync_rebase(gb);
+     const struct gb_cpu_decoded *d;
 
-     while (gb->timestamp < cycles) {
-          /* We check for interrupt before anything else since it could get us
-           * out of halted mode */
-          gb_cpu_check_interrupts(gb);
-          cpu->irq_enable = cpu->irq_enable_next;
+     cpu->operands = NULL;
 
-          if (cpu->halted) {
-               int32_t skip_cycles;
+     /* Instruction boundary, run the events that came due during the
+      * instruction */
+     gb_cpu_sync_events(gb);
 
-               /* The CPU is halted so we skip to the next event or `cycles`,
-                * whichever comes first */
-               if (cycles < gb->sync.first_event) {
-                    skip_cycles = cycles - gb->timestamp;
-               } else {
-                    skip_cycles = gb->sync.first_event - gb->timestamp;
+     if (gb->timestamp >= cpu->limit ||
+         cpu->halted || gb->irq.pending) {
+          return false;
+     }
+
+     /* The previous instruction may have switched ROM banks */
+     d = gb_cpu_decode(gb, cpu->pc);
+     if (d == NULL || d->opcode != opcode) {
+          return false;
+     }
+
+     /* Opcode fetch */
+     cpu->pc = (cpu->pc + 1) & 0xffff;
+     gb_cpu_clock_tick(gb, 4);
+
+     cpu->operands = d->operands;
+
+     return true;
+}
+
+/* LD A, (HL+) ; LD (DE), A ; INC DE */
+static void gb_f_ldi_a_mhl_ld_mde_a_inc_de(struct gb *gb) {
+     gb_i_ldi_a_mhl(gb);
+     if (!gb_cpu_fused_next(gb, 0x12)) {
+          return;
+     }
+     gb_i_ld_mde_a(gb);
+     if (!gb_cpu_fused_next(gb, 0x13)) {
+          return;
+     }
+     gb_i_inc_de(gb);
+}
+
+/* DEC BC ; LD A, B ; OR A, C ; JR NZ, si8 */
+static void gb_f_dec_bc_ld_a_b_or_a_c_jr_nz(struct gb *gb) {
+     gb_i_dec_bc(gb);
+     if (!gb_cpu_fused_next(gb, 0x78)) {
+          return;
+     }
+     gb_i_ld_a_b(gb);
+     if (!gb_cpu_fused_next(gb, 0xb1)) {
+          return;
+     }
+     gb_i_or_a_c(gb);
+     if (!gb_cpu_fused_next(gb, 0x20)) {
+          return;
+     }
+     gb_i_jr_nz_si8(gb);
+}
+
+/* DEC B ; JR NZ, si8 */
+static void gb_f_dec_b_jr_nz(struct gb *gb) {
+     gb_i_dec_b(gb);
+     if (!gb_cpu_fused_next(gb, 0x20)) {
+          return;
+     }
+     gb_i_jr_nz_si8(gb);
+}
+
+/* DEC C ; JR NZ, si8 */
+static void gb_f_dec_c_jr_nz(struct gb *gb) {
+     gb_i_dec_c(gb);
+     if (!gb_cpu_fused_next(gb, 0x20)) {
+          return;
+     }
+     gb_i_jr_nz_si8(gb);
+}
+
+/* LDH A, (i8) ; CP A, i8 ; JR NZ, si8 */
+static void gb_f_ldh_a_mi8_cp_a_i8_jr_nz(struct gb *gb) {
+     gb_i_ldh_a_mi8(gb);
+     if (!gb_cpu_fused_next(gb, 0xfe)) {
+          return;
+     }
+     gb_i_cp_a_i8(gb);
+     if (!gb_cpu_fused_next(gb, 0x20)) {
+          return;
+     }
+     gb_i_jr_nz_si8(gb);
+}
+
+/* LDH A, (i8) ; CP A, i8 ; JR Z, si8 */
+static void gb_f_ldh_a_mi8_cp_a_i8_jr_z(struct gb *gb) {
+     gb_i_ldh_a_mi8(gb);
+     if (!gb_cpu_fused_next(gb, 0xfe)) {
+          return;
+     }
+     gb_i_cp_a_i8(gb);
+     if (!gb_cpu_fused_next(gb, 0x28)) {
+          return;
+     }
+     gb_i_jr_z_si8(gb);
+}
+
+/* LDH A, (i8) ; AND A, i8 ; JR NZ, si8 */
+static void gb_f_ldh_a_mi8_and_a_i8_jr_nz(struct gb *gb) {
+     gb_i_ldh_a_mi8(gb);
+     if (!gb_cpu_fused_next(gb, 0xe6)) {
+          return;
+     }
+     gb_i_and_a_i8(gb);
+     if (!gb_cpu_fused_next(gb, 0x20)) {
+          return;
+     }
+     gb_i_jr_nz_si8(gb);
+}
+
+/* LDH A, (i8) ; AND A, i8 ; JR Z, si8 */
+static void gb_f_ldh_a_mi8_and_a_i8_jr_z(struct gb *gb) {
+     gb_i_ldh_a_mi8(gb);
+     if (!gb_cpu_fused_next(gb, 0xe6)) {
+          return;
+     }
+     gb_i_and_a_i8(gb);
+     if (!gb_cpu_fused_next(gb, 0x28)) {
+          return;
+     }
+     gb_i_jr_z_si8(gb);
+}
+
+/* Maximum number of instructions in a fused sequence */
+#define GB_CPU_FUSED_MAX_LEN 4
+
+struct gb_cpu_fused_seq {
+     /* Number of instructions in the sequence */
+     unsigned len;
+     /* Opcodes of the instructions */
+     uint8_t opcodes[GB_CPU_FUSED_MAX_LEN];
+     gb_instruction_f handler;
+};
+
+static const struct gb_cpu_fused_seq gb_cpu_fused_seqs[] = {
+     { 3, { 0x2a, 0x12, 0x13 }, gb_f_ldi_a_mhl_ld_mde_a_inc_de },
+     { 4, { 0x0b, 0x78, 0xb1, 0x20 }, gb_f_dec_bc_ld_a_b_or_a_c_jr_nz },
+     { 2, { 0x05, 0x20 }, gb_f_dec_b_jr_nz },
+     { 2, { 0x0d, 0x20 }, gb_f_dec_c_jr_nz },
+     { 3, { 0xf0, 0xfe, 0x20 }, gb_f_ldh_a_mi8_cp_a_i8_jr_nz },
+     { 3, { 0xf0, 0xfe, 0x28 }, gb_f_ldh_a_mi8_cp_a_i8_jr_z },
+     { 3, { 0xf0, 0xe6, 0x20 }, gb_f_ldh_a_mi8_and_a_i8_jr_nz },
+     { 3, { 0xf0, 0xe6, 0x28 }, gb_f_ldh_a_mi8_and_a_i8_jr_z },
+};
+
+/* Set the handler used in the interpreter loop for the cached instruction
+ * `d`, fused with the instructions following it if they form one of the
+ * sequences above. We only look within the same ROM bank. */
+static void gb_cpu_fuse(struct gb *gb, struct gb_cpu_decoded *d) {
+     const uint8_t *rom = gb->cart.rom;
+     uint32_t bank_end = d->rom_off - (d->rom_off % GB_ROM_BANK_SIZE) +
+          GB_ROM_BANK_SIZE;
+     unsigned s;
+
+     d->fused = d->handler;
+     d->len = gb_opcode_len[d->opcode];
+     d->ends_block = gb_opcode_ends_block(d->opcode);
+
+     for (s = 0; s < sizeof(gb_cpu_fused_seqs) / sizeof(*gb_cpu_fused_seqs);
+          s++) {
+          const struct gb_cpu_fused_seq *seq = &gb_cpu_fused_seqs[s];
+          uint32_t off = d->rom_off;
+          unsigned i;
+
+          for (i = 0; i < seq->len; i++) {
+               uint8_t opcode = seq->opcodes[i];
+
+               if (off + gb_opcode_len[opcode] > bank_end ||
+                   rom[off] != opcode) {
+                    break;
                }
 
-               gb_cpu_clock_tick(gb, skip_cycles << gb->double_speed);
+               off += gb_opcode_len[opcode];
+          }
+
+          if (i == seq->len) {
+               d->fused = seq->handler;
+               d->len = off - d->rom_off;
+               d->ends_block =
+                    gb_opcode_ends_block(seq->opcodes[seq->len - 1]);
+               return;
+          }
+     }
+}
+
+#else /* GB_CPU_NO_FUSION */
+
+static void gb_cpu_fuse(struct gb *gb, struct gb_cpu_decoded *d) {
+     d->fused = d->handler;
+     d->len = gb_opcode_len[d->opcode];
+     d->ends_block = gb_opcode_ends_block(d->opcode);
+}
+
+#endif /* GB_CPU_NO_FUSION */
+
+/* Return the decode cache entry for the instruction mapped at `pc`, found at
+ * offset `rom_off` in the ROM, decoding it if necessary */
+static const struct gb_cpu_decoded *gb_cpu_decode_rom(struct gb *gb,
+                                                      uint16_t pc,
+                                                      uint32_t rom_off) {
+     struct gb_cart *cart = &gb->cart;
+     struct gb_cpu_decoded *d;
+
+     /* The cache is indexed by CPU address so that bank 0 and the switchable
+      * bank never evict each other. It's tagged with the ROM offset so we
+      * don't have to flush it when the game switches banks. */
+     d = &gb->cpu.decode_cache[pc & (GB_CPU_DECODE_CACHE_SIZE - 1)];
+
+     if (d->rom_off != rom_off) {
+          d->rom_off = rom_off;
+          d->opcode = cart->rom[rom_off];
+          d->operands[0] = cart->rom[rom_off + 1];
+          d->operands[1] = cart->rom[rom_off + 2];
+          d->handler = gb_instructions[d->opcode];
+          gb_cpu_fuse(gb, d);
+     }
+
+     return d;
+}
+
+/* Return the decode cache entry for the instruction at `pc`, decoding it if
+ * necessary. Returns NULL if the instruction can't be cached because it's not
+ * running from ROM or because it could straddle a bank boundary. */
+const struct gb_cpu_decoded *gb_cpu_decode(struct gb *gb, uint16_t pc) {
+     unsigned rom_off;
+
+     if (pc >= 0x8000) {
+          /* Not running from ROM */
+          return NULL;
+     }
+
+     if ((pc & (GB_ROM_BANK_SIZE - 1)) > GB_ROM_BANK_SIZE - 3) {
+          /* The operands could be in a different bank */
+          return NULL;
+     }
+
+     if (pc < GB_ROM_BANK_SIZE) {
+          rom_off = pc;
+     } else {
+          rom_off = gb->cart.rom_bank_off + (pc - GB_ROM_BANK_SIZE);
+     }
+
+     return gb_cpu_decode_rom(gb, pc, rom_off);
+}
+
+/* The CPU is halted so we skip to the next event or `limit`, whichever comes
+ * first */
+static void gb_cpu_skip_halted(struct gb *gb, int64_t limit) {
+     int64_t skip_cycles;
+
+     if (limit < gb->sync.first_event) {
+          skip_cycles = limit - gb->timestamp;
+     } else {
+          skip_cycles = gb->sync.first_event - gb->timestamp;
+     }
+
+     /* Already in timestamp ticks, no need to go through
+      * gb_cpu_clock_tick */
+     gb->timestamp += skip_cycles;
+
+     /* See if any event needs to run. This may trigger an IRQ which will
+      * un-halt the CPU in the next iteration */
+     gb_sync_check_events(gb);
+}
+
+/*
+ * Block runner
+ *
+ * Runs the straight-line block of cached instructions starting with a decode
+ * cache entry. Within the block we go from one instruction to the next
+ * directly, without going back to the main loop, as long as the main loop
+ * would simply run the next instruction: no event due, no interrupt state
+ * change, CPU not halted and same ROM bank. The next instruction is found from
+ * the ROM offset of the current one, so it costs a single tag check in the
+ * decode cache.
+ *
+ * Like the fused sequences, blocks don't look for recompiled code between
+ * instructions: the recompilers are only tried by the main loop, at the start
+ * of a block.
+ *
+ * When the compiler supports computed gotos (a GCC and clang extension) the
+ * block runner is threaded, see the end of the file. Build with
+ * GB_CPU_NO_THREADED defined to use a plain loop instead.
+ */
+
+#if defined(__GNUC__) && !defined(GB_CPU_NO_THREADED)
+#define GB_CPU_THREADED
+#endif
+
+/* State of the block being run */
+struct gb_cpu_block {
+     /* ROM window (bank 0 or switchable bank) running the block */
+     uint16_t window;
+     /* ROM bank mapped when the block started */
+     uint32_t bank_off;
+     /* Address and ROM offset of the instruction following the current one */
+     uint16_t next_pc;
+     uint32_t next_off;
+};
+
+/* Fetch the opcode of the cached instruction `d` and point `cpu->operands` to
+ * its operands */
+static inline void gb_cpu_block_fetch(struct gb *gb,
+                                      struct gb_cpu_block *block,
+                                      const struct gb_cpu_decoded *d) {
+     struct gb_cpu *cpu = &gb->cpu;
+
+     block->next_pc = cpu->pc + d->len;
+     block->next_off = d->rom_off + d->len;
+
+     /* Opcode fetch */
+     cpu->pc = (cpu->pc + 1) & 0xffff;
+     gb_cpu_clock_tick(gb, 4);
+
+     cpu->operands = d->operands;
+}
 
-               /* See if any event needs to run. This may trigger an IRQ which
-                * will un-halt the CPU in the next iteration */
-               gb_sync_check_events(gb);
+/* Called once the instruction `d` has run. Returns the decode cache entry of
+ * the next instruction if the block continues, NULL if we have to go back to
+ * the main loop. */
+static inline const struct gb_cpu_decoded *
+gb_cpu_block_next(struct gb *gb, struct gb_cpu_block *block,
+                  const struct gb_cpu_decoded *d) {
+     struct gb_cpu *cpu = &gb->cpu;
+     uint16_t next_pc = block->next_pc;
+
+     cpu->operands = NULL;
+
+     if (d->ends_block) {
+          return NULL;
+     }
 
-          } else {
+     /* Instruction boundary, run the events that came due during the
+      * instruction */
+     gb_cpu_sync_events(gb);
+
+     if (gb->timestamp >= cpu->limit ||
+         cpu->halted || gb->irq.pending) {
+          return NULL;
+     }
+
+     if (cpu->pc != next_pc) {
+          /* A fused sequence gave control back before its end */
+          return NULL;
+     }
+
+     if ((next_pc & ~(GB_ROM_BANK_SIZE - 1)) != block->window ||
+         (next_pc & (GB_ROM_BANK_SIZE - 1)) > GB_ROM_BANK_SIZE - 3) {
+          /* The next instruction is in a different window or can't be
+           * cached, let gb_cpu_decode deal with it */
+          return NULL;
+     }
+
+     if (block->window != 0 && gb->cart.rom_bank_off != block->bank_off) {
+          /* The game switched ROM banks under our feet */
+          return NULL;
+     }
+
+     return gb_cpu_decode_rom(gb, next_pc, block->next_off);
+}
+
+#ifdef GB_CPU_THREADED
+
+/* Defined at the end of the file, after the CB opcode map */
+static void gb_cpu_run_block(struct gb *gb, const struct gb_cpu_decoded *d);
+
+#else
+
+static void gb_cpu_run_block(struct gb *gb, const struct gb_cpu_decoded *d) {
+     struct gb_cpu *cpu = &gb->cpu;
+     struct gb_cpu_block block;
+
+     block.window = cpu->pc & ~(GB_ROM_BANK_SIZE - 1);
+     block.bank_off = gb->cart.rom_bank_off;
+
+     do {
+          gb_cpu_block_fetch(gb, &block, d);
+          d->fused(gb);
+          d = gb_cpu_block_next(gb, &block, d);
+     } while (d != NULL);
+}
+
+#endif /* GB_CPU_THREADED */
+
+static void gb_cpu_run_instruction(struct gb *gb) {
+     struct gb_cpu *cpu = &gb->cpu;
+     const struct gb_cpu_decoded *d;
+
+     d = gb_cpu_decode(gb, cpu->pc);
+     if (d == NULL) {
+          uint8_t instruction = gb_cpu_next_i8(gb);
+
+          gb_instructions[instruction](gb);
+          return;
+     }
+
+     gb_cpu_run_block(gb, d);
+}
+
+static void gb_cpu_run_loop(struct gb *gb, int64_t limit) {
+     struct gb_cpu *cpu = &gb->cpu;
+
+     while (gb->timestamp < limit) {
+          /* Instruction boundary, run the events that came due during the
+           * last instruction */
+          gb_cpu_sync_events(gb);
+
+          /* We check for interrupt before anything else since it could get us
+           * out of halted mode */
+          gb_cpu_handle_interrupts(gb);
+
+          if (cpu->halted) {
+               gb_cpu_skip_halted(gb, limit);
+          } else if (!gb_aot_run(gb) && !gb_jit_run(gb)) {
                gb_cpu_run_instruction(gb);
           }
      }
+}
+
+/* Run the emulation for at least `cycles` cycles. Returns the number of cycles
+ * actually run, which can be slightly more since we only stop at instruction
+ * boundaries. */
+int32_t gb_cpu_run_cycles(struct gb *gb, int32_t cycles) {
+     int64_t start = gb->timestamp;
+     int64_t limit = start + cycles;
+
+     gb->cpu.limit = limit;
+
+     /* The frontend may have changed the joypad state */
+     gb->cpu.idle.armed = false;
+
+     gb_cpu_run_loop(gb, limit);
+
+     /* Run the events that came due during the last instruction so that the
+      * devices are up to date when we return to the frontend */
+     gb_cpu_sync_events(gb);
 
-     return gb->timestamp;
+     return gb->timestamp - start;
 }
 
 /*
@@ -2387,15 +3260,11 @@ int32_t gb_cpu_run_cycles(struct gb *gb, int32_t cycles) {
  */
 
 static void gb_cpu_rlc_set_flags(struct gb *gb, uint8_t *v) {
-     struct gb_cpu *cpu = &gb->cpu;
      uint8_t c = *v >> 7;
 
      *v = (*v << 1) | c;
 
-     cpu->f_z = (*v == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = c;
+     gb_cpu_set_alu_flags(gb, ((uint16_t)c << 8) | *v, *v, 0, false);
 }
 
 static void gb_i_rlc_a(struct gb *gb) {
@@ -2441,7 +3310,7 @@ static void gb_i_rlc_l(struct gb *gb) {
 }
 
 static void gb_i_rlc_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -2452,15 +3321,11 @@ static void gb_i_rlc_mhl(struct gb *gb) {
 }
 
 static void gb_cpu_rrc_set_flags(struct gb *gb, uint8_t *v) {
-     struct gb_cpu *cpu = &gb->cpu;
      uint8_t c = *v & 1;
 
      *v = (*v >> 1) | (c << 7);
 
-     cpu->f_z = (*v == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = c;
+     gb_cpu_set_alu_flags(gb, ((uint16_t)c << 8) | *v, *v, 0, false);
 }
 
 static void gb_i_rrc_a(struct gb *gb) {
@@ -2506,7 +3371,7 @@ static void gb_i_rrc_l(struct gb *gb) {
 }
 
 static void gb_i_rrc_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -2517,15 +3382,11 @@ static void gb_i_rrc_mhl(struct gb *gb) {
 }
 
 static void gb_cpu_rl_set_flags(struct gb *gb, uint8_t *v) {
-     struct gb_cpu *cpu = &gb->cpu;
      bool new_c = *v >> 7;
 
-     *v = (*v << 1) | (uint8_t)cpu->f_c;
+     *v = (*v << 1) | gb_cpu_flag_c(gb);
 
-     cpu->f_z = (*v == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = new_c;
+     gb_cpu_set_alu_flags(gb, ((uint16_t)new_c << 8) | *v, *v, 0, false);
 }
 
 static void gb_i_rl_a(struct gb *gb) {
@@ -2571,7 +3432,7 @@ static void gb_i_rl_l(struct gb *gb) {
 }
 
 static void gb_i_rl_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -2582,16 +3443,12 @@ static void gb_i_rl_mhl(struct gb *gb) {
 }
 
 static void gb_cpu_rr_set_flags(struct gb *gb, uint8_t *v) {
-     struct gb_cpu *cpu = &gb->cpu;
      bool new_c = *v & 1;
-     uint8_t old_c = cpu->f_c;
+     uint8_t old_c = gb_cpu_flag_c(gb);
 
      *v = (*v >> 1) | (old_c << 7);
 
-     cpu->f_z = (*v == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = new_c;
+     gb_cpu_set_alu_flags(gb, ((uint16_t)new_c << 8) | *v, *v, 0, false);
 }
 
 static void gb_i_rr_a(struct gb *gb) {
@@ -2637,7 +3494,7 @@ static void gb_i_rr_l(struct gb *gb) {
 }
 
 static void gb_i_rr_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -2648,15 +3505,11 @@ static void gb_i_rr_mhl(struct gb *gb) {
 }
 
 static void gb_cpu_sla_set_flags(struct gb *gb, uint8_t *v) {
-     struct gb_cpu *cpu = &gb->cpu;
      bool c = *v >> 7;
 
      *v = *v << 1;
 
-     cpu->f_z = (*v == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = c;
+     gb_cpu_set_alu_flags(gb, ((uint16_t)c << 8) | *v, *v, 0, false);
 }
 
 static void gb_i_sla_a(struct gb *gb) {
@@ -2702,7 +3555,7 @@ static void gb_i_sla_l(struct gb *gb) {
 }
 
 static void gb_i_sla_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -2713,16 +3566,12 @@ static void gb_i_sla_mhl(struct gb *gb) {
 }
 
 static void gb_cpu_sra_set_flags(struct gb *gb, uint8_t *v) {
-     struct gb_cpu *cpu = &gb->cpu;
      bool c = *v & 1;
 
      /* Sign-extend */
      *v = (*v >> 1) | (*v & 0x80);
 
-     cpu->f_z = (*v == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = c;
+     gb_cpu_set_alu_flags(gb, ((uint16_t)c << 8) | *v, *v, 0, false);
 }
 
 static void gb_i_sra_a(struct gb *gb) {
@@ -2768,7 +3617,7 @@ static void gb_i_sra_l(struct gb *gb) {
 }
 
 static void gb_i_sra_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -2779,14 +3628,9 @@ static void gb_i_sra_mhl(struct gb *gb) {
 }
 
 static void gb_cpu_swap_set_flags(struct gb *gb, uint8_t *v) {
-     struct gb_cpu *cpu = &gb->cpu;
-
      *v = ((*v << 4) | (*v >> 4)) & 0xff;
 
-     cpu->f_z = (*v == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = false;
+     gb_cpu_set_alu_flags(gb, *v, *v, 0, false);
 }
 
 static void gb_i_swap_a(struct gb *gb) {
@@ -2832,7 +3676,7 @@ static void gb_i_swap_l(struct gb *gb) {
 }
 
 static void gb_i_swap_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -2843,15 +3687,11 @@ static void gb_i_swap_mhl(struct gb *gb) {
 }
 
 static void gb_cpu_srl_set_flags(struct gb *gb, uint8_t *v) {
-     struct gb_cpu *cpu = &gb->cpu;
      bool c = *v & 1;
 
      *v = *v >> 1;
 
-     cpu->f_z = (*v == 0);
-     cpu->f_n = false;
-     cpu->f_h = false;
-     cpu->f_c = c;
+     gb_cpu_set_alu_flags(gb, ((uint16_t)c << 8) | *v, *v, 0, false);
 }
 
 static void gb_i_srl_a(struct gb *gb) {
@@ -2897,7 +3737,7 @@ static void gb_i_srl_l(struct gb *gb) {
 }
 
 static void gb_i_srl_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -2908,12 +3748,9 @@ static void gb_i_srl_mhl(struct gb *gb) {
 }
 
 static void gb_cpu_bit_set_flags(struct gb *gb, uint8_t *v, unsigned bit) {
-     struct gb_cpu *cpu = &gb->cpu;
      bool set = *v & (1U << bit);
 
-     cpu->f_z = !set;
-     cpu->f_n = false;
-     cpu->f_h = true;
+     gb_cpu_set_flags(gb, !set, false, true, gb_cpu_flag_c(gb));
 }
 
 static void gb_i_bit_0_a(struct gb *gb) {
@@ -2959,7 +3796,7 @@ static void gb_i_bit_0_l(struct gb *gb) {
 }
 
 static void gb_i_bit_0_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3010,7 +3847,7 @@ static void gb_i_bit_1_l(struct gb *gb) {
 }
 
 static void gb_i_bit_1_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3061,7 +3898,7 @@ static void gb_i_bit_2_l(struct gb *gb) {
 }
 
 static void gb_i_bit_2_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3112,7 +3949,7 @@ static void gb_i_bit_3_l(struct gb *gb) {
 }
 
 static void gb_i_bit_3_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3163,7 +4000,7 @@ static void gb_i_bit_4_l(struct gb *gb) {
 }
 
 static void gb_i_bit_4_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3214,7 +4051,7 @@ static void gb_i_bit_5_l(struct gb *gb) {
 }
 
 static void gb_i_bit_5_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3265,7 +4102,7 @@ static void gb_i_bit_6_l(struct gb *gb) {
 }
 
 static void gb_i_bit_6_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3316,7 +4153,7 @@ static void gb_i_bit_7_l(struct gb *gb) {
 }
 
 static void gb_i_bit_7_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3371,7 +4208,7 @@ static void gb_i_res_0_l(struct gb *gb) {
 }
 
 static void gb_i_res_0_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3424,7 +4261,7 @@ static void gb_i_res_1_l(struct gb *gb) {
 }
 
 static void gb_i_res_1_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3477,7 +4314,7 @@ static void gb_i_res_2_l(struct gb *gb) {
 }
 
 static void gb_i_res_2_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3530,7 +4367,7 @@ static void gb_i_res_3_l(struct gb *gb) {
 }
 
 static void gb_i_res_3_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3583,7 +4420,7 @@ static void gb_i_res_4_l(struct gb *gb) {
 }
 
 static void gb_i_res_4_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3636,7 +4473,7 @@ static void gb_i_res_5_l(struct gb *gb) {
 }
 
 static void gb_i_res_5_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3689,7 +4526,7 @@ static void gb_i_res_6_l(struct gb *gb) {
 }
 
 static void gb_i_res_6_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3742,7 +4579,7 @@ static void gb_i_res_7_l(struct gb *gb) {
 }
 
 static void gb_i_res_7_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3799,7 +4636,7 @@ static void gb_i_set_0_l(struct gb *gb) {
 }
 
 static void gb_i_set_0_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3852,7 +4689,7 @@ static void gb_i_set_1_l(struct gb *gb) {
 }
 
 static void gb_i_set_1_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3905,7 +4742,7 @@ static void gb_i_set_2_l(struct gb *gb) {
 }
 
 static void gb_i_set_2_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -3958,7 +4795,7 @@ static void gb_i_set_3_l(struct gb *gb) {
 }
 
 static void gb_i_set_3_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -4011,7 +4848,7 @@ static void gb_i_set_4_l(struct gb *gb) {
 }
 
 static void gb_i_set_4_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -4064,7 +4901,7 @@ static void gb_i_set_5_l(struct gb *gb) {
 }
 
 static void gb_i_set_5_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -4117,7 +4954,7 @@ static void gb_i_set_6_l(struct gb *gb) {
 }
 
 static void gb_i_set_6_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -4170,7 +5007,7 @@ static void gb_i_set_7_l(struct gb *gb) {
 }
 
 static void gb_i_set_7_mhl(struct gb *gb) {
-     uint16_t hl = gb_cpu_hl(gb);
+     uint16_t hl = gb->cpu.hl;
      uint8_t v;
 
      v = gb_cpu_readb(gb, hl);
@@ -4180,7 +5017,7 @@ static void gb_i_set_7_mhl(struct gb *gb) {
      gb_cpu_writeb(gb, hl, v);
 }
 
-static gb_instruction_f gb_instructions_cb[0x100] = {
+static const gb_instruction_f gb_instructions_cb[0x100] = {
      // 0x00
      gb_i_rlc_b,
      gb_i_rlc_c,
@@ -4461,3 +5298,98 @@ static void gb_i_op_cb(struct gb *gb) {
 
      gb_instructions_cb[instruction](gb);
 }
+
+#ifdef GB_CPU_THREADED
+
+/*
+ * Threaded block runner
+ *
+ * Same thing as the loop in gb_cpu_run_block, using computed gotos. Every
+ * opcode gets its own label calling its handler followed by its own copy of
+ * the dispatch code, this way the branch predictor sees one indirect jump per
+ * opcode instead of a single shared call site. Since the opcode tables are
+ * const the compiler resolves the handlers statically and can inline them.
+ * Fused sequences go through their handler like in the plain loop.
+ */
+
+/* Call `_x` with every opcode, as a pair of hex digits */
+#define GB_CPU_OPCODE_ROW(_x, _h)                                       \
+     _x(_h##0) _x(_h##1) _x(_h##2) _x(_h##3)                            \
+     _x(_h##4) _x(_h##5) _x(_h##6) _x(_h##7)                            \
+     _x(_h##8) _x(_h##9) _x(_h##a) _x(_h##b)                            \
+     _x(_h##c) _x(_h##d) _x(_h##e) _x(_h##f)
+
+#define GB_CPU_OPCODES(_x)                                              \
+     GB_CPU_OPCODE_ROW(_x, 0) GB_CPU_OPCODE_ROW(_x, 1)                  \
+     GB_CPU_OPCODE_ROW(_x, 2) GB_CPU_OPCODE_ROW(_x, 3)                  \
+     GB_CPU_OPCODE_ROW(_x, 4) GB_CPU_OPCODE_ROW(_x, 5)                  \
+     GB_CPU_OPCODE_ROW(_x, 6) GB_CPU_OPCODE_ROW(_x, 7)                  \
+     GB_CPU_OPCODE_ROW(_x, 8) GB_CPU_OPCODE_ROW(_x, 9)                  \
+     GB_CPU_OPCODE_ROW(_x, a) GB_CPU_OPCODE_ROW(_x, b)                  \
+     GB_CPU_OPCODE_ROW(_x, c) GB_CPU_OPCODE_ROW(_x, d)                  \
+     GB_CPU_OPCODE_ROW(_x, e) GB_CPU_OPCODE_ROW(_x, f)
+
+#define GB_CPU_LABEL(_op)    [0x##_op] = &&op_##_op,
+#define GB_CPU_CB_LABEL(_op) [0x##_op] = &&cb_##_op,
+
+/* Start the instruction `d` */
+#define GB_CPU_DISPATCH()                                               \
+     do {                                                               \
+          gb_cpu_block_fetch(gb, &block, d);                            \
+          if (d->fused != d->handler) {                                 \
+               goto fused;                                              \
+          }                                                             \
+          goto *labels[d->opcode];                                      \
+     } while (0)
+
+/* Move on to the next instruction of the block, if any */
+#define GB_CPU_NEXT()                                                   \
+     do {                                                               \
+          d = gb_cpu_block_next(gb, &block, d);                         \
+          if (d == NULL) {                                              \
+               return;                                                  \
+          }                                                             \
+          GB_CPU_DISPATCH();                                            \
+     } while (0)
+
+#define GB_CPU_OP(_op)                                                  \
+     op_##_op:                                                          \
+          if (0x##_op == 0xcb) {                                        \
+               goto cb_prefix;                                          \
+          }                                                             \
+          gb_instructions[0x##_op](gb);                                 \
+          GB_CPU_NEXT();
+
+#define GB_CPU_CB_OP(_op)                                               \
+     cb_##_op:                                                          \
+          gb_instructions_cb[0x##_op](gb);                              \
+          GB_CPU_NEXT();
+
+static void gb_cpu_run_block(struct gb *gb, const struct gb_cpu_decoded *d) {
+     static const void *const labels[0x100] = {
+          GB_CPU_OPCODES(GB_CPU_LABEL)
+     };
+     static const void *const cb_labels[0x100] = {
+          GB_CPU_OPCODES(GB_CPU_CB_LABEL)
+     };
+     struct gb_cpu *cpu = &gb->cpu;
+     struct gb_cpu_block block;
+
+     block.window = cpu->pc & ~(GB_ROM_BANK_SIZE - 1);
+     block.bank_off = gb->cart.rom_bank_off;
+
+     GB_CPU_DISPATCH();
+
+fused:
+     d->fused(gb);
+     GB_CPU_NEXT();
+
+cb_prefix:
+     /* Opcode 0xCB is used as a prefix for a second opcode map */
+     goto *cb_labels[gb_cpu_next_i8(gb)];
+
+     GB_CPU_OPCODES(GB_CPU_OP)
+     GB_CPU_OPCODES(GB_CPU_CB_OP)
+}
+
+#endif /* GB_CPU_THREADED */
@@ -1,6 +1,106 @@
 #ifndef _GB_CPU_H_
 #define _GB_CPU_H_
 
+typedef void (*gb_instruction_f)(struct gb *);
+
+/* Instruction decoded from ROM */
+struct gb_cpu_decoded {
+     /* Handler for `opcode` */
+     gb_instruction_f handler;
+     /* Handler used by the interpreter loop. Runs the whole instruction
+      * sequence starting here if it's one of the sequences we fuse, otherwise
+      * it's the same as `handler` */
+     gb_instruction_f fused;
+     /* Offset of the instruction in the cartridge ROM. Since it uniquely
+      * identifies a (bank, address) pair we use it to check whether the entry
+      * is still valid for the currently mapped bank. */
+     uint32_t rom_off;
+     /* Instruction opcode */
+     uint8_t opcode;
+     /* The two bytes following the opcode. Depending on the instruction they
+      * may be an immediate value, the second byte of a 0xCB opcode or simply
+      * unused */
+     uint8_t operands[2];
+     /* Number of bytes of code run by `fused`. If the block continues, the
+      * next instruction starts that many bytes further. */
+     uint8_t len;
+     /* True if the last instruction run by `fused` ends its straight-line
+      * block (see gb_opcode_ends_block) */
+     bool ends_block;
+};
+
+/* Value of `rom_off` for entries that don't hold a valid instruction */
+#define GB_CPU_DECODED_INVALID 0xffffffffU
+
+/* Number of decode cache entries, the size of the CPU-visible ROM area */
+#define GB_CPU_DECODE_CACHE_SIZE 0x8000
+
+/* Maximum size in bytes of the body of a loop we consider for idle loop
+ * detection */
+#define GB_CPU_IDLE_MAX_BODY 16
+
+/* Register pairs used as pointers by an idle loop */
+#define GB_CPU_IDLE_PTR_BC  (1U << 0)
+#define GB_CPU_IDLE_PTR_DE  (1U << 1)
+#define GB_CPU_IDLE_PTR_HL  (1U << 2)
+/* 0xff00 + C */
+#define GB_CPU_IDLE_PTR_C   (1U << 3)
+
+/* State of the idle loop detection. We look at the last loop closed by a
+ * backward JR and, if it only polls memory without side effects, skip whole
+ * iterations up to the next event. */
+struct gb_cpu_idle {
+     /* ROM offset of the JR closing the loop, GB_CPU_DECODED_INVALID if we
+      * haven't seen any */
+     uint32_t jr_rom_off;
+     /* True if the loop body only reads stable locations and only modifies A
+      * and the flags */
+     bool pure;
+     /* True if the loop reads STAT directly */
+     bool reads_stat;
+     /* GB_CPU_IDLE_PTR_* flags of the register pairs the loop reads through */
+     uint8_t pointers;
+     /* Number of cycles taken by one iteration, including the JR */
+     int32_t cycles;
+     /* True if the fields below hold the state of the CPU the last time it
+      * reached the head of the loop */
+     bool armed;
+     /* Timestamp at the head of the loop */
+     int64_t date;
+     /* Date until which everything the loop reads is guaranteed not to
+      * change */
+     int64_t horizon;
+     /* Register state at the head of the loop. The body can't modify anything
+      * else. */
+     uint8_t a;
+     uint16_t f_res;
+     uint8_t f_op_a;
+     uint8_t f_op_b;
+     bool f_n;
+};
+
+/* Register pair made of the `hi` and `lo` 8-bit registers overlapping with
+ * the 16-bit `hi ## lo` register */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define GB_CPU_PAIR(hi, lo)                                             \
+     union {                                                            \
+          uint16_t hi ## lo;                                            \
+          struct {                                                      \
+               uint8_t hi;                                              \
+               uint8_t lo;                                              \
+          };                                                            \
+     }
+#else
+#define GB_CPU_PAIR(hi, lo)                                             \
+     union {                                                            \
+          uint16_t hi ## lo;                                            \
+          struct {                                                      \
+               uint8_t lo;                                              \
+               uint8_t hi;                                              \
+          };                                                            \
+     }
+#endif
+
 struct gb_cpu {
      /* Interrupt Master Enable (IME) flag */
      bool irq_enable;
@@ -16,30 +116,55 @@ struct gb_cpu {
      uint16_t sp;
      /* A register */
      uint8_t a;
-     /* B register */
-     uint8_t b;
-     /* C register */
-     uint8_t c;
-     /* D register */
-     uint8_t d;
-     /* E register */
-     uint8_t e;
-     /* H register */
-     uint8_t h;
-     /* L register */
-     uint8_t l;
-
-     /* Zero flag */
-     bool f_z;
+     /* BC, DE and HL register pairs. Each pair can be accessed as a whole or
+      * through its 8-bit halves */
+     GB_CPU_PAIR(b, c);
+     GB_CPU_PAIR(d, e);
+     GB_CPU_PAIR(h, l);
+
+     /* The Zero, Half-Carry and Carry flags are evaluated lazily from the
+      * result and operands of the last operation that modified them:
+      *
+      * - Z is set if bits [7:0] of `f_res` are 0
+      * - C is bit 8 of `f_res`
+      * - H is bit 4 of `f_op_a ^ f_op_b ^ f_res`
+      *
+      * Use gb_cpu_flag_z/h/c to read them. */
+     uint16_t f_res;
+     uint8_t f_op_a;
+     uint8_t f_op_b;
      /* Substract flag */
      bool f_n;
-     /* Half-Carry flag */
-     bool f_h;
-     /* Carry flag */
-     bool f_c;
+     /* Start of the region pointed to by `fetch_ptr` below. Stored here to
+      * fill the padding before `limit`. */
+     uint16_t fetch_region;
+
+     /* End of the current time slice */
+     int64_t limit;
+
+     /* If the current instruction has been served from the decode cache this
+      * points to its remaining operand bytes, otherwise it's NULL and the
+      * operands are fetched from memory */
+     const uint8_t *operands;
+     /* Decode cache for the instructions running from ROM, indexed by CPU
+      * address. Allocated separately by gb_cpu_reset, it's too big to live
+      * in `struct gb`. */
+     struct gb_cpu_decoded *decode_cache;
+     /* Host pointer to the 4KiB region of the address space starting at
+      * `fetch_region`, used to fetch the instructions that don't come from the
+      * decode cache. NULL if it must be looked up again, the memory map code
+      * resets it every time the mapping changes. */
+     const uint8_t *fetch_ptr;
+     /* Idle loop detection */
+     struct gb_cpu_idle idle;
 };
 
 void gb_cpu_reset(struct gb *gb);
+void gb_cpu_destroy(struct gb *gb);
 int32_t gb_cpu_run_cycles(struct gb *gb, int32_t cycles);
+const struct gb_cpu_decoded *gb_cpu_decode(struct gb *gb, uint16_t pc);
+uint8_t gb_cpu_bus_readb(struct gb *gb, uint16_t addr);
+void gb_cpu_bus_writeb(struct gb *gb, uint16_t addr, uint8_t val);
+void gb_cpu_idle_loop(struct gb *gb, uint16_t jr_pc);
 
 #endif /* _GB_CPU_H_ */
@@ -8,6 +8,13 @@ void gb_dma_reset(struct gb *gb) {
      dma->running = false;
      dma->source = 0;
      dma->position = 0;
+
+     /* The GBC can copy directly from the cartridge, DMG only from RAM */
+     if (gb->gbc) {
+          dma->min_source = 0;
+     } else {
+          dma->min_source = 0x8000U;
+     }
 }
 
 void gb_dma_sync(struct gb *gb) {
@@ -24,12 +31,12 @@ void gb_dma_sync(struct gb *gb) {
      /* CPU always increments the counter in multiples of 4 cycles (2 in
       * double-speed mode) so we know for sure that there won't be any remainder
       * here. */
-     length = elapsed / (4 >> gb->double_speed);
+     length = elapsed / gb->mcycle_duration;
 
      while (length && dma->position < GB_DMA_LENGTH_BYTES) {
           uint32_t b = gb_memory_readb(gb, dma->source + dma->position);
 
-          gb->gpu.oam[dma->position] = b;
+          gb_gpu_write_oam(gb, dma->position, b);
 
           length--;
           dma->position++;
@@ -42,7 +49,7 @@ void gb_dma_sync(struct gb *gb) {
      } else {
           /* The DMA copies one byte ever 4 cycles (2 cycles in double-speed
            * mode) */
-          gb_sync_next(gb, GB_SYNC_DMA, 4 >> gb->double_speed);
+          gb_sync_next(gb, GB_SYNC_DMA, gb->mcycle_duration);
      }
 }
 
@@ -55,8 +62,7 @@ void gb_dma_start(struct gb *gb, uint8_t source) {
      dma->source = (uint16_t)source << 8;
      dma->position = 0;
 
-     /* The GBC can copy directly from the cartridge, DMG only from RAM */
-     if ((!gb->gbc && dma->source < 0x8000U) || dma->source >= 0xe000U) {
+     if (dma->source < dma->min_source || dma->source >= 0xe000U) {
           /* The DMA can't access this memory region */
           dma->running = false;
      } else {
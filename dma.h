@@ -7,6 +7,9 @@ struct gb_dma {
      uint16_t source;
      /* Number of bytes copied so far */
      uint8_t position;
+     /* Lowest address the DMA can copy from, set at reset for the emulated
+      * model */
+     uint16_t min_source;
 };
 
 void gb_dma_reset(struct gb *gb);
@@ -5,16 +5,25 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <semaphore.h>
 
 struct gb;
 
+/* Size of a host cache line, used to keep the hot part of `struct gb`
+ * compact */
+#define GB_CACHE_LINE 64
+
 #include "sync.h"
 #include "irq.h"
+#include "opcode.h"
 #include "cpu.h"
+#include "jit.h"
+#include "aot.h"
 #include "memory.h"
 #include "rtc.h"
 #include "cart.h"
+#include "pixel.h"
 #include "gpu.h"
 #include "input.h"
 #include "dma.h"
@@ -26,26 +35,48 @@ struct gb;
 /* DMG CPU frequency. Super GameBoy runs slightly faster (4.295454MHz). */
 #define GB_CPU_FREQ_HZ 4194304U
 
+/* Force a function to be inlined. Used to generate separate DMG and GBC
+ * versions of hot code from a single implementation taking a constant `gbc`
+ * parameter. */
+#define GB_ALWAYS_INLINE inline __attribute__((always_inline))
+
+/* The context is laid out so that everything the CPU loop touches for every
+ * instruction (timestamp, IRQ state, CPU registers and the date of the next
+ * event) is packed at the start, within the first two cache lines. The memory
+ * page tables, looked up for every access, start on the first cache line
+ * after the sync state. The devices come next and the big memory arrays last.
+ * The assertions below the definition check that it stays that way. */
 struct gb {
+     /* Counter keeping track of how many CPU cycles have elapsed since reset.
+      * Used to synchronize the other devices. It's monotonic and wide enough
+      * to never wrap around, so it never needs to be rebased. */
+     _Alignas(GB_CACHE_LINE) int64_t timestamp;
+     /* Duration of a 4-cycle CPU machine cycle in timestamp ticks: 4 in
+      * normal speed, 2 in double-speed mode. Only changes on speed switch so
+      * that the clock doesn't have to check `double_speed` on every access */
+     int32_t mcycle_duration;
+     /* True if the GBC is running in double-speed mode */
+     bool double_speed;
      /* True if we're emulating a GBC, false if we're emulating a DMG */
      bool gbc;
 
+     struct gb_irq irq;
+     struct gb_cpu cpu;
+     /* Must come right after `cpu`: `sync.first_event` is checked after every
+      * instruction */
+     struct gb_sync sync;
+
+     /* Address decoding, looked up for every memory access */
+     struct gb_memory memory;
+
      /* True if a speed switch has been requested. It will take effect when a
       * STOP operation is executed */
      bool speed_switch_pending;
-     /* True if the GBC is running in double-speed mode */
-     bool double_speed;
-
-     /* Counter keeping track of how many CPU cycles have elapsed since an
-      * arbitrary point in time. Used to synchronize the other devices. */
-     int32_t timestamp;
      /* Set by the frontend when the user requested that the emulation stops */
      bool quit;
 
-     struct gb_irq irq;
-     struct gb_frontend frontend;
-     struct gb_sync sync;
-     struct gb_cpu cpu;
+     struct gb_jit jit;
+     struct gb_aot aot;
      struct gb_cart cart;
      struct gb_gpu gpu;
      struct gb_input input;
@@ -53,18 +84,42 @@ struct gb {
      struct gb_hdma hdma;
      struct gb_timer timer;
      struct gb_spu spu;
-     /* Internal RAM: 8KiB on DMG, 32 KiB on GBC */
-     uint8_t iram[0x8000];
+     struct gb_frontend frontend;
+
      /* Always 1 on DMG, 1-7 on GBC */
      uint8_t iram_high_bank;
+     /* Always false on DMG */
+     bool    vram_high_bank;
      /* Zero-page RAM */
      uint8_t zram[0x7f];
+     /* Internal RAM: 8KiB on DMG, 32 KiB on GBC */
+     uint8_t iram[0x8000];
      /* Video RAM: 8KiB on DMG, 16KiB on GBC */
      uint8_t vram[0x4000];
-     /* Always false on DMG */
-     bool    vram_high_bank;
 };
 
+/* Layout report: end offset of the fields used by the CPU loop for every
+ * instruction. If one of these fails, something got inserted in the hot part
+ * of `struct gb` and should probably go further down. */
+#define GB_FIELD_END(_f) \
+     (offsetof(struct gb, _f) + sizeof(((struct gb *)0)->_f))
+
+_Static_assert(GB_FIELD_END(irq) <= GB_CACHE_LINE,
+               "IRQ state isn't in the first cache line");
+_Static_assert(GB_FIELD_END(cpu.fetch_ptr) <= GB_CACHE_LINE * 2,
+               "CPU registers don't fit in two cache lines");
+_Static_assert(GB_FIELD_END(cpu.idle) <= GB_CACHE_LINE * 2,
+               "Idle loop state doesn't fit in two cache lines");
+_Static_assert(GB_FIELD_END(sync.first_event) <= GB_CACHE_LINE * 2,
+               "Next event date doesn't fit in two cache lines");
+_Static_assert(offsetof(struct gb, memory.read_map) % GB_CACHE_LINE == 0 &&
+               offsetof(struct gb, memory.read_map) <
+               GB_FIELD_END(sync) + GB_CACHE_LINE,
+               "Read page table doesn't follow the CPU state");
+_Static_assert(offsetof(struct gb, memory.write_map) ==
+               GB_FIELD_END(memory.read_map),
+               "Write page table doesn't follow the read page table");
+
 static inline void die(void) {
      exit(EXIT_FAILURE);
 }
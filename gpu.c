@@ -39,6 +39,10 @@
 /* Total number of lines (including vertical blanking) */
 #define VTOTAL (VSYNC_START + VSYNC_LINES)
 
+static void gb_gpu_draw_line_dmg(struct gb *gb);
+static void gb_gpu_draw_line_gbc(struct gb *gb);
+static void gb_gpu_sprite_rebuild_masks(struct gb *gb);
+
 void gb_gpu_reset(struct gb *gb) {
      struct gb_gpu *gpu = &gb->gpu;
      unsigned i;
@@ -66,25 +70,79 @@ void gb_gpu_reset(struct gb *gb) {
      gpu->wy = 0;
      gpu->line_pos = 0;
 
+     if (gb->gbc) {
+          gpu->draw_line = gb_gpu_draw_line_gbc;
+     } else {
+          gpu->draw_line = gb_gpu_draw_line_dmg;
+     }
+
      for (i = 0; i < sizeof(gpu->oam); i++) {
           gpu->oam[i] = 0;
      }
+
+     gb_gpu_sprite_rebuild_masks(gb);
+
+     gpu->kernels = gb_pixel_get_kernels();
+
+     gpu->frameskip.enabled = false;
+     gpu->frameskip.skip = false;
+     gpu->frameskip.consecutive = 0;
+     gpu->frameskip.drawn = 0;
+     gpu->frameskip.skipped = 0;
+
+     for (i = 0; i < 2 * GB_GPU_BANK_TILES; i++) {
+          gpu->tile_valid[i] = false;
+     }
 }
 
-static uint8_t gb_gpu_get_mode(struct gb *gb) {
-     struct gb_gpu *gpu = &gb->gpu;
+void gb_gpu_set_frameskip(struct gb *gb, bool enable) {
+     struct gb_gpu_frameskip *fs = &gb->gpu.frameskip;
+
+     fs->enabled = enable;
+     fs->skip = false;
+     fs->consecutive = 0;
+}
+
+/* Called at the start of every frame to decide whether it should be drawn */
+static void gb_gpu_frameskip_update(struct gb *gb) {
+     struct gb_gpu_frameskip *fs = &gb->gpu.frameskip;
+
+     if (fs->enabled &&
+         fs->consecutive < GB_GPU_FRAMESKIP_MAX &&
+         gb_spu_is_late(gb)) {
+          fs->skip = true;
+          fs->consecutive++;
+     } else {
+          fs->skip = false;
+          fs->consecutive = 0;
+     }
+}
+
+/* Must be called whenever the byte at offset `off` in VRAM (including the
+ * bank offset) is modified */
+void gb_gpu_vram_written(struct gb *gb, uint16_t off) {
+     unsigned bank = off / 0x2000;
+     unsigned tile_off = off % 0x2000;
+
+     if (tile_off < GB_GPU_BANK_TILES * 16) {
+          /* Tile data, the decoded rows have to be rebuilt */
+          gb->gpu.tile_valid[bank * GB_GPU_BANK_TILES + tile_off / 16] = false;
+     }
+}
 
-     if (gpu->ly >= VSYNC_START) {
+/* Return the mode of the GPU at position `line_pos` in line `ly` */
+static uint8_t gb_gpu_mode_at(unsigned ly, unsigned line_pos) {
+     if (ly >= VSYNC_START) {
           /* Mode 1: VBLANK */
           return 1;
      }
 
-     if (gpu->line_pos < MODE_2_CYCLES) {
+     if (line_pos < MODE_2_CYCLES) {
           /* Mode 2: OAM access */
           return 2;
      }
 
-     if (gpu->line_pos < MODE_3_END) {
+     if (line_pos < MODE_3_END) {
           /* Mode 3: OAM + display RAM in use */
           return 3;
      }
@@ -93,52 +151,95 @@ static uint8_t gb_gpu_get_mode(struct gb *gb) {
      return 0;
 }
 
-struct gb_gpu_pixel {
-     union gb_gpu_color color;
-     bool opaque;
-     /* GBC only: true if the background pixel has priority */
-     bool priority;
+static uint8_t gb_gpu_get_mode(struct gb *gb) {
+     struct gb_gpu *gpu = &gb->gpu;
+
+     return gb_gpu_mode_at(gpu->ly, gpu->line_pos);
+}
+
+/* Compute the current position of the beam from the state of the GPU at the
+ * last sync without actually syncing. The line rendering and the IRQs are
+ * left to the next sync, so this is only meant for register reads: LY and
+ * the STAT mode only depend on the time elapsed since the last sync. */
+static void gb_gpu_peek_position(struct gb *gb,
+                                 unsigned *ly, unsigned *line_pos) {
+     struct gb_gpu *gpu = &gb->gpu;
+     int64_t elapsed = gb->timestamp - gb->sync.last_sync[GB_SYNC_GPU];
+     int64_t pos;
+
+     *ly = gpu->ly;
+     *line_pos = gpu->line_pos;
+
+     if (!gpu->master_enable || elapsed <= 0) {
+          return;
+     }
+
+     /* The GPU always schedules an event at the end of the current line so
+      * in practice we never leave it here, but it doesn't cost much to be
+      * thorough */
+     pos = gpu->line_pos + elapsed;
+     *ly = (gpu->ly + pos / HTOTAL) % VTOTAL;
+     *line_pos = pos % HTOTAL;
+}
+
+/* Background and window layers of a line, before the sprites are drawn on
+ * top */
+struct gb_gpu_bg_line {
+     /* Color index of every pixel. On GBC bits [4:2] hold the palette number,
+      * so that the value indexes the palettes directly. */
+     uint8_t col[GB_LCD_WIDTH];
+     /* GBC only: true if the background pixel has priority over the
+      * sprites */
+     bool priority[GB_LCD_WIDTH];
 };
 
-/* Get a pixel value from the tileset, original DMG model version */
-static enum gb_color gb_gpu_get_tile_color(struct gb *gb,
-                                           uint8_t tile_index,
-                                           uint8_t x, uint8_t y,
-                                           bool use_sprite_ts,
-                                           bool use_high_bank) {
-     unsigned tile_addr;
+/* Decode the 8 rows of the tile at index `tile` in `tile_rows` */
+static void gb_gpu_decode_tile(struct gb *gb, unsigned tile) {
+     struct gb_gpu *gpu = &gb->gpu;
+     unsigned bank = tile / GB_GPU_BANK_TILES;
      /* Each tile is 8x8 pixels and stores 2bits per pixels for a total of
       * 16bytes per tile */
-     const unsigned tile_size = 16;
-     unsigned lsb;
-     unsigned msb;
+     const uint8_t *data = &gb->vram[bank * 0x2000 +
+                                     (tile % GB_GPU_BANK_TILES) * 16];
+
+     gpu->kernels->decode_tile(data, &gpu->tile_rows[tile * 8]);
+
+     gpu->tile_valid[tile] = true;
+}
+
+/* Get row `y` of a tile from the tile set, decoded to one color per pixel.
+ * The pixels are flipped horizontally if `x_flip` is true. */
+static const uint8_t *gb_gpu_get_tile_row(struct gb *gb,
+                                          uint8_t tile_index,
+                                          unsigned y,
+                                          bool use_sprite_ts,
+                                          bool use_high_bank,
+                                          bool x_flip) {
+     struct gb_gpu *gpu = &gb->gpu;
+     unsigned tile;
 
      if (use_sprite_ts) {
           /* Sprite tile set starts at the beginning of VRAM */
-          tile_addr = tile_index * tile_size;
+          tile = tile_index;
      } else {
           /* The other tile set (which can optionally be used by the background
            * and window) starts just after the sprite tile set but there's a
            * trick: the tile index is used as a *signed* value, which means that
            * values above 127 index *back* into the second half of the sprite
            * tile set, effectively sharing the region between the two sets */
-          tile_addr = 0x1000 + (int8_t)tile_index * tile_size;
+          tile = 256 + (int8_t)tile_index;
      }
 
      /* GBC-only: use the high bank if requested */
      if (use_high_bank) {
-          tile_addr += 0x2000;
+          tile += GB_GPU_BANK_TILES;
      }
 
-     /* Pixel data is stored "backwards" in VRAM: the leftmost pixel (x = 0) is
-      * stored in the MSB (byte >> 7) */
-     x = 7 - x;
-
-     /* The pixel value is two bits split across two contiguous bytes */
-     lsb = (gb->vram[tile_addr + y * 2 + 0] >> x) & 1;
-     msb = (gb->vram[tile_addr + y * 2 + 1] >> x) & 1;
+     if (!gpu->tile_valid[tile]) {
+          gb_gpu_decode_tile(gb, tile);
+     }
 
-     return (msb << 1) | lsb;
+     return gpu->tile_rows[tile * 8 + y].pix[x_flip];
 }
 
 static enum gb_color gb_gpu_palette_transform(enum gb_color color,
@@ -148,100 +249,6 @@ static enum gb_color gb_gpu_palette_transform(enum gb_color color,
      return (palette >> off) & 3;
 }
 
-static struct gb_gpu_pixel gb_gpu_get_bg_win_pixel(struct gb *gb,
-                                                   uint8_t x, uint8_t y,
-                                                   bool use_high_tm) {
-     struct gb_gpu *gpu = &gb->gpu;
-
-     /* Coordinates of the tile in the tile map (each tile is 8x8 pixels) */
-     unsigned tile_map_x = x / 8;
-     unsigned tile_map_y = y / 8;
-     /* Coordinates of the pixel within the tile */
-     unsigned tile_x = x % 8;
-     unsigned tile_y = y % 8;
-     /* Offset of the tile map entry in the VRAM */
-     unsigned tm_addr;
-     /* Index of the tile entry in the tile set */
-     uint8_t tile_index;
-     struct gb_gpu_pixel pix;
-     bool use_sprite_ts = gpu->bg_window_use_sprite_ts;
-
-     /* There are two independent tile maps the game can use */
-     if (use_high_tm) {
-          tm_addr = 0x1c00;
-     } else {
-          tm_addr = 0x1800;
-     }
-
-     /* The tile map is a square map of 32*32 tiles. For each tile it contains
-      * one byte (8bits) which is an index in the tile set. */
-     tm_addr += tile_map_y * 32 + tile_map_x;
-
-     /* Look up the tile map entry in VRAM */
-     tile_index = gb->vram[tm_addr];
-
-     if (gb->gbc) {
-          /* On the GBC we have additional attributes in the 2nd VRAM bank */
-          uint8_t attrs = gb->vram[tm_addr + 0x2000];
-          bool priority = attrs & 0x80;
-          bool y_flip = attrs & 0x40;
-          bool x_flip = attrs & 0x20;
-          bool high_bank = attrs & 0x08;
-          uint8_t palette = attrs & 0x07;
-          enum gb_color col;
-
-          pix.priority = priority;
-
-          if (x_flip) {
-               tile_x = 7 - tile_x;
-          }
-
-          if (y_flip) {
-               tile_y = 7 - tile_y;
-          }
-
-          col = gb_gpu_get_tile_color(gb, tile_index,
-                                      tile_x, tile_y,
-                                      use_sprite_ts,
-                                      high_bank);
-
-          pix.opaque = col != GB_COL_WHITE;
-
-          pix.color.gbc_color = gpu->bg_palettes.colors[palette][col];
-     } else {
-          pix.priority = false;
-
-          pix.color.dmg_color = gb_gpu_get_tile_color(gb, tile_index,
-                                                      tile_x, tile_y,
-                                                      use_sprite_ts,
-                                                      false);
-          pix.opaque = pix.color.dmg_color != GB_COL_WHITE;
-
-          pix.color.dmg_color = gb_gpu_palette_transform(pix.color.dmg_color,
-                                                         gpu->bgp);
-     }
-
-     return pix;
-}
-
-static struct gb_gpu_pixel gb_gpu_get_bg_pixel(struct gb *gb,
-                                               unsigned x, unsigned y) {
-     struct gb_gpu *gpu = &gb->gpu;
-     uint8_t bgx = (x + gpu->scx) & 0xff;
-     uint8_t bgy = (y + gpu->scy) & 0xff;
-
-     return gb_gpu_get_bg_win_pixel(gb, bgx, bgy, gpu->bg_use_high_tm);
-}
-
-static struct gb_gpu_pixel gb_gpu_get_win_pixel(struct gb *gb,
-                                                unsigned x, unsigned y) {
-     struct gb_gpu *gpu = &gb->gpu;
-     uint8_t wx = x + 7 - gpu->wx;
-     uint8_t wy = y - gpu->wy;
-
-     return gb_gpu_get_bg_win_pixel(gb, wx, wy, gpu->window_use_high_tm);
-}
-
 struct gb_sprite {
      /* Coordinates of the sprite's top-left corner */
      int x;
@@ -270,7 +277,9 @@ struct gb_sprite {
      uint8_t palette;
 };
 
-static struct gb_sprite gb_get_oam_sprite(struct gb *gb, unsigned index) {
+static GB_ALWAYS_INLINE struct gb_sprite gb_get_oam_sprite(struct gb *gb,
+                                                           bool gbc,
+                                                           unsigned index) {
      struct gb_gpu *gpu = &gb->gpu;
      struct gb_sprite s;
      unsigned oam_off = index * 4;
@@ -293,7 +302,7 @@ static struct gb_sprite gb_get_oam_sprite(struct gb *gb, unsigned index) {
      s.y_flip = flags & 0x40;
      s.background = flags & 0x80;
 
-     if (gb->gbc) {
+     if (gbc) {
           s.high_bank = flags & 0x08;
           s.palette = flags & 0x07;
      } else {
@@ -304,57 +313,104 @@ static struct gb_sprite gb_get_oam_sprite(struct gb *gb, unsigned index) {
      return s;
 }
 
-/* Max number of sprites per line */
-#define GB_GPU_LINE_SPRITES 10
+/* Set the bit of sprite `index` in the masks of the visible lines it covers
+ * to `visible` and invalidate the sprite lists of these lines */
+static void gb_gpu_sprite_update_lines(struct gb *gb, unsigned index,
+                                       bool visible) {
+     struct gb_gpu *gpu = &gb->gpu;
+     uint64_t bit = 1ULL << index;
+     int start = (int)gpu->oam[index * 4] - 16;
+     int end;
+     int l;
 
-static void gb_gpu_get_line_sprites(
-     struct gb *gb,
-     unsigned ly,
-     struct gb_sprite sprites[GB_GPU_LINE_SPRITES + 1]) {
+     if (gpu->tall_sprites) {
+          end = start + 16;
+     } else {
+          end = start + 8;
+     }
 
-     struct gb_gpu *gpu = &gb->gpu;
-     int i;
-     unsigned n_sprites;
-     unsigned sprite_height;
+     if (start < 0) {
+          start = 0;
+     }
 
-     if (!gpu->sprite_enable) {
-          /* Sprites are disabled, mark the end of the list with an out-of-frame
-           * sprite and bail out */
-          sprites[0].x = GB_LCD_WIDTH * 2;
-          return;
+     if (end > GB_LCD_HEIGHT) {
+          end = GB_LCD_HEIGHT;
      }
 
-     if (gpu->tall_sprites) {
-          sprite_height = 16;
-     } else {
-          sprite_height = 8;
+     for (l = start; l < end; l++) {
+          if (visible) {
+               gpu->line_sprite_mask[l] |= bit;
+          } else {
+               gpu->line_sprite_mask[l] &= ~bit;
+          }
+
+          gpu->line_sprites_valid[l] = false;
+     }
+}
+
+/* Recompute the line masks of all the sprites from scratch, needed when the
+ * sprite height changes */
+static void gb_gpu_sprite_rebuild_masks(struct gb *gb) {
+     struct gb_gpu *gpu = &gb->gpu;
+     unsigned i;
+
+     for (i = 0; i < GB_LCD_HEIGHT; i++) {
+          gpu->line_sprite_mask[i] = 0;
+          gpu->line_sprites_valid[i] = false;
      }
 
-     /* Iterate over the OAM and store the sprites that are in the current line.
-      */
-     n_sprites = 0;
      for (i = 0; i < GB_GPU_MAX_SPRITES; i++) {
-          struct gb_sprite s = gb_get_oam_sprite(gb, i);
+          gb_gpu_sprite_update_lines(gb, i, true);
+     }
+}
 
-          if ((int)ly < s.y || (int)ly >= (s.y + (int)sprite_height)) {
-               /* Sprite isn't on this line */
-               continue;
-          }
+/* Write `val` at offset `off` in OAM. The caller is responsible for syncing
+ * the GPU first if needed. */
+void gb_gpu_write_oam(struct gb *gb, unsigned off, uint8_t val) {
+     struct gb_gpu *gpu = &gb->gpu;
+     unsigned index = off / 4;
+
+     switch (off % 4) {
+     case 0:
+          /* Y coordinate: the sprite moves from one set of lines to
+           * another */
+          gb_gpu_sprite_update_lines(gb, index, false);
+          gpu->oam[off] = val;
+          gb_gpu_sprite_update_lines(gb, index, true);
+          break;
+     case 1:
+          /* X coordinate: the lines stay the same but on DMG the sprite order
+           * depends on it, so the lists have to be rebuilt */
+          gpu->oam[off] = val;
+          gb_gpu_sprite_update_lines(gb, index, true);
+          break;
+     default:
+          /* Tile and flags are only looked up when drawing */
+          gpu->oam[off] = val;
+          break;
+     }
+}
 
-          sprites[n_sprites] = s;
+/* Build the list of the sprites displayed on line `ly` from its mask */
+static void gb_gpu_build_line_sprites(struct gb *gb, bool gbc, unsigned ly) {
+     struct gb_gpu *gpu = &gb->gpu;
+     uint8_t *list = gpu->line_sprites[ly];
+     uint64_t mask = gpu->line_sprite_mask[ly];
+     unsigned n_sprites = 0;
+     unsigned i;
+
+     /* Take the first sprites in OAM order, up to the maximum that can be
+      * displayed on a line */
+     while (mask != 0 && n_sprites < GB_GPU_LINE_SPRITES) {
+          list[n_sprites] = __builtin_ctzll(mask);
+          mask &= mask - 1;
           n_sprites++;
-          if (n_sprites >= GB_GPU_LINE_SPRITES) {
-               /* We reached the maximum number of sprites that can be displayed
-                * on this line, ignore the rest */
-               break;
-          }
      }
 
-     /* Mark the end of the sprite list with an unreachable out-of-frame sprite
-      */
-     sprites[n_sprites].x = GB_LCD_WIDTH * 2;
+     gpu->line_sprite_count[ly] = n_sprites;
+     gpu->line_sprites_valid[ly] = true;
 
-     if (gb->gbc) {
+     if (gbc) {
           /* In GBC mode the sprite priority is not based on X-coordinates but
            * simply on the index in OAM, so we already have the entries in the
            * array in the right order (from highest priority to lowest) */
@@ -366,46 +422,70 @@ static void gb_gpu_get_line_sprites(
       * priority so we must use a stable sort to maintain the ordering of values
       * with the same x value */
      for (i = 1; i < n_sprites; i++) {
-          struct gb_sprite cur = sprites[i];
+          uint8_t cur = list[i];
+          uint8_t cur_x = gpu->oam[cur * 4 + 1];
           int j;
 
           /* We move cur back as long as we don't encounter a sprite with
            * greater-or-equal x value (or we reach the beginning of the list) */
           for (j = i - 1; j >= 0; j--) {
-               if (sprites[j].x <= cur.x) {
+               if (gpu->oam[list[j] * 4 + 1] <= cur_x) {
                     break;
                }
 
-               sprites[j + 1] = sprites[j];
+               list[j + 1] = list[j];
           }
 
-          sprites[j + 1] = cur;
+          list[j + 1] = cur;
      }
 }
 
-/* Attempt to sample the given sprite at the given location on the screen.
- * Returns false if the sprite is not visible at these coordinates, otherwise it
- * updates `p` with the pixel color and returns true. */
-static bool gb_gpu_get_sprite_col(struct gb *gb,
-                                  const struct gb_sprite *sprite,
-                                  unsigned x,
-                                  unsigned y,
-                                  struct gb_gpu_pixel *p) {
+/* Fill `sprites` with the sprites displayed on line `ly`, from highest to
+ * lowest priority, and return their number */
+static GB_ALWAYS_INLINE unsigned gb_gpu_get_line_sprites(
+     struct gb *gb,
+     bool gbc,
+     unsigned ly,
+     struct gb_sprite sprites[GB_GPU_LINE_SPRITES]) {
+
      struct gb_gpu *gpu = &gb->gpu;
-     unsigned sprite_x;
-     unsigned sprite_y;
-     unsigned sprite_flip_height;
-     uint8_t tile_index;
-     enum gb_color col;
+     unsigned n_sprites;
+     unsigned i;
 
-     if (sprite->background && p->opaque) {
-          /* Sprite is behind the background layer and the background pixel is
-           * opaque so we return the background color directly */
-          return false;
+     if (!gpu->sprite_enable) {
+          /* Sprites are disabled */
+          return 0;
      }
 
-     sprite_x = (int)x - sprite->x;
-     sprite_y = (int)y - sprite->y;
+     if (!gpu->line_sprites_valid[ly]) {
+          gb_gpu_build_line_sprites(gb, gbc, ly);
+     }
+
+     n_sprites = gpu->line_sprite_count[ly];
+     for (i = 0; i < n_sprites; i++) {
+          sprites[i] = gb_get_oam_sprite(gb, gbc, gpu->line_sprites[ly][i]);
+     }
+
+     return n_sprites;
+}
+
+/* Draw the pixels of `sprite` on line `y` on top of the background and window
+ * layers. The sprites must be drawn from lowest to highest priority so that
+ * the highest priority sprite visible at a given location ends up on top. */
+static GB_ALWAYS_INLINE void gb_gpu_draw_sprite(struct gb *gb, bool gbc,
+                                                const struct gb_sprite *sprite,
+                                                unsigned y,
+                                                const struct gb_gpu_bg_line *bg,
+                                                union gb_gpu_color *line) {
+     struct gb_gpu *gpu = &gb->gpu;
+     unsigned sprite_y = (int)y - sprite->y;
+     unsigned sprite_flip_height;
+     uint8_t tile_index;
+     const uint8_t *row;
+     /* Opaque pixels of the sprite row, bit n is set for pixel n */
+     unsigned opaque = 0;
+     uint16_t colors[4];
+     unsigned i;
 
      if (gpu->tall_sprites) {
           /* 8x16 sprites use two consecutive tiles. The first tile's index's
@@ -417,26 +497,29 @@ static bool gb_gpu_get_sprite_col(struct gb *gb,
           sprite_flip_height = 7;
      }
 
-     if (sprite->x_flip) {
-          sprite_x = 7 - sprite_x;
-     }
-
      if (sprite->y_flip) {
           sprite_y = sprite_flip_height - sprite_y;
      }
 
-     col = gb_gpu_get_tile_color(gb, tile_index,
-                                 sprite_x, sprite_y,
-                                 true, sprite->high_bank);
+     /* The second tile of 8x16 sprites immediately follows the first one */
+     row = gb_gpu_get_tile_row(gb, tile_index + sprite_y / 8, sprite_y % 8,
+                               true, sprite->high_bank, sprite->x_flip);
 
-     /* White pixel color (pre-palette) denotes a transparent pixel */
-     if (col == GB_COL_WHITE) {
-          return false;
+     for (i = 0; i < 8; i++) {
+          /* White pixel color (pre-palette) denotes a transparent pixel */
+          if (row[i] != GB_COL_WHITE) {
+               opaque |= 1U << i;
+          }
      }
 
-     if (gb->gbc) {
-          p->color.gbc_color =
-               gpu->sprite_palettes.colors[sprite->palette][col];
+     if (opaque == 0) {
+          return;
+     }
+
+     if (gbc) {
+          for (i = 0; i < 4; i++) {
+               colors[i] = gpu->sprite_palettes.colors[sprite->palette][i];
+          }
      } else {
           uint8_t palette;
 
@@ -446,10 +529,140 @@ static bool gb_gpu_get_sprite_col(struct gb *gb,
                palette = gpu->obp0;
           }
 
-          p->color.dmg_color = gb_gpu_palette_transform(col, palette);
+          for (i = 0; i < 4; i++) {
+               colors[i] = gb_gpu_palette_transform(i, palette);
+          }
      }
 
-     return true;
+     while (opaque) {
+          unsigned px = __builtin_ctz(opaque);
+          int x = sprite->x + px;
+
+          opaque &= opaque - 1;
+
+          if (x < 0 || x >= GB_LCD_WIDTH) {
+               /* Off screen */
+               continue;
+          }
+
+          if (bg->priority[x]) {
+               /* If the background priority is set it means that the BG has
+                * the priority over any sprite at this location */
+               continue;
+          }
+
+          if (sprite->background && (bg->col[x] & 3) != GB_COL_WHITE) {
+               /* Sprite is behind the background layer and the background
+                * pixel is opaque */
+               continue;
+          }
+
+          if (gbc) {
+               line[x].gbc_color = colors[row[px]];
+          } else {
+               line[x].dmg_color = colors[row[px]];
+          }
+     }
+}
+
+#ifdef GB_GPU_PER_PIXEL
+
+/* Reference implementation sampling the background and window layers one
+ * pixel at a time. Much slower than the tile span renderer below but simpler,
+ * so it can be used to validate it. */
+
+struct gb_gpu_pixel {
+     union gb_gpu_color color;
+     /* Color index before palette lookup, see struct gb_gpu_bg_line */
+     uint8_t col;
+     /* GBC only: true if the background pixel has priority */
+     bool priority;
+};
+
+static GB_ALWAYS_INLINE struct gb_gpu_pixel
+gb_gpu_get_bg_win_pixel(struct gb *gb, bool gbc,
+                        uint8_t x, uint8_t y, bool use_high_tm) {
+     struct gb_gpu *gpu = &gb->gpu;
+
+     /* Coordinates of the tile in the tile map (each tile is 8x8 pixels) */
+     unsigned tile_map_x = x / 8;
+     unsigned tile_map_y = y / 8;
+     /* Coordinates of the pixel within the tile */
+     unsigned tile_x = x % 8;
+     unsigned tile_y = y % 8;
+     /* Offset of the tile map entry in the VRAM */
+     unsigned tm_addr;
+     /* Index of the tile entry in the tile set */
+     uint8_t tile_index;
+     struct gb_gpu_pixel pix;
+     bool use_sprite_ts = gpu->bg_window_use_sprite_ts;
+
+     /* There are two independent tile maps the game can use */
+     if (use_high_tm) {
+          tm_addr = 0x1c00;
+     } else {
+          tm_addr = 0x1800;
+     }
+
+     /* The tile map is a square map of 32*32 tiles. For each tile it contains
+      * one byte (8bits) which is an index in the tile set. */
+     tm_addr += tile_map_y * 32 + tile_map_x;
+
+     /* Look up the tile map entry in VRAM */
+     tile_index = gb->vram[tm_addr];
+
+     if (gbc) {
+          /* On the GBC we have additional attributes in the 2nd VRAM bank */
+          uint8_t attrs = gb->vram[tm_addr + 0x2000];
+          bool priority = attrs & 0x80;
+          bool y_flip = attrs & 0x40;
+          bool x_flip = attrs & 0x20;
+          bool high_bank = attrs & 0x08;
+          uint8_t palette = attrs & 0x07;
+          enum gb_color col;
+
+          pix.priority = priority;
+
+          if (y_flip) {
+               tile_y = 7 - tile_y;
+          }
+
+          col = gb_gpu_get_tile_row(gb, tile_index, tile_y,
+                                    use_sprite_ts, high_bank,
+                                    x_flip)[tile_x];
+
+          pix.col = (palette << 2) | col;
+
+          pix.color.gbc_color = gpu->bg_palettes.colors[palette][col];
+     } else {
+          pix.priority = false;
+
+          pix.col = gb_gpu_get_tile_row(gb, tile_index, tile_y,
+                                        use_sprite_ts, false, false)[tile_x];
+
+          pix.color.dmg_color = gb_gpu_palette_transform(pix.col, gpu->bgp);
+     }
+
+     return pix;
+}
+
+static GB_ALWAYS_INLINE struct gb_gpu_pixel
+gb_gpu_get_bg_pixel(struct gb *gb, bool gbc, unsigned x, unsigned y) {
+     struct gb_gpu *gpu = &gb->gpu;
+     uint8_t bgx = (x + gpu->scx) & 0xff;
+     uint8_t bgy = (y + gpu->scy) & 0xff;
+
+     return gb_gpu_get_bg_win_pixel(gb, gbc, bgx, bgy, gpu->bg_use_high_tm);
+}
+
+static GB_ALWAYS_INLINE struct gb_gpu_pixel
+gb_gpu_get_win_pixel(struct gb *gb, bool gbc, unsigned x, unsigned y) {
+     struct gb_gpu *gpu = &gb->gpu;
+     uint8_t wx = x + 7 - gpu->wx;
+     uint8_t wy = y - gpu->wy;
+
+     return gb_gpu_get_bg_win_pixel(gb, gbc, wx, wy,
+                                    gpu->window_use_high_tm);
 }
 
 /* Returns true if the given screen coordinates lie within the window */
@@ -460,88 +673,213 @@ static bool gb_gpu_pix_in_window(struct gb *gb, unsigned x, unsigned y) {
      return (int)x >= wx && y >= gpu->wy;
 }
 
-static void gb_gpu_draw_cur_line(struct gb *gb) {
+/* Render the background and window layers of the current line to `bg` and
+ * their colors to `line` */
+static GB_ALWAYS_INLINE void gb_gpu_draw_bg_win(struct gb *gb, bool gbc,
+                                                struct gb_gpu_bg_line *bg,
+                                                union gb_gpu_color *line) {
      struct gb_gpu *gpu = &gb->gpu;
-     union gb_gpu_color line[GB_LCD_WIDTH];
-     /* We force a "dummy" out-of-frame sprite at the end to avoid checking for
-      * bounds while we draw the line */
-     struct gb_sprite line_sprites[GB_GPU_LINE_SPRITES + 1];
      unsigned x;
-     unsigned next_sprite = 0;
-
-     gb_gpu_get_line_sprites(gb, gpu->ly, line_sprites);
 
      for (x = 0; x < GB_LCD_WIDTH; x++) {
           struct gb_gpu_pixel p = {
                .color.dmg_color = GB_COL_WHITE,
-               .opaque = false,
+               .col = GB_COL_WHITE,
                .priority = false,
           };
-          struct gb_sprite s;
-          unsigned i;
 
           if (gpu->window_enable && gb_gpu_pix_in_window(gb, x, gpu->ly)) {
                /* Pixel lies within the window */
-               p = gb_gpu_get_win_pixel(gb, x, gpu->ly);
+               p = gb_gpu_get_win_pixel(gb, gbc, x, gpu->ly);
           } else if (gpu->bg_enable) {
-               p = gb_gpu_get_bg_pixel(gb, x, gpu->ly);
+               p = gb_gpu_get_bg_pixel(gb, gbc, x, gpu->ly);
           }
 
-          /* If the background priority is set it means that the BG has the
-           * priority over any sprite at this location */
-          if (!p.priority) {
-               if (gb->gbc) {
-                    /* In GBC the sprites aren't ordered by x-coordinate because
-                     * the location in OAM has priority, so we have to iterate
-                     * through the entire list until we find a visible sprite or
-                     * we reach the end (signaled by a x value of
-                     * GB_LCD_WIDTH * 2, see gb_gb_get_line_sprites) */
-                    for (i = 0; line_sprites[i].x < GB_LCD_WIDTH * 2; i++) {
-                         s = line_sprites[i];
-
-                         if ((int)x < s.x || (int)x >= s.x + 8) {
-                              /* Sprite is not visible at this location */
-                              continue;
-                         }
-
-                         if (gb_gpu_get_sprite_col(gb, &s, x, gpu->ly, &p)) {
-                              break;
-                         }
-                    }
-               } else {
-                    /* Figure out what is the next sprite we must display */
-                    while (next_sprite < GB_GPU_LINE_SPRITES) {
-                         if (line_sprites[next_sprite].x + 8 <= x ) {
-                              /* We're done displaying this sprite */
-                              next_sprite++;
-                         } else {
-                              /* We have not passed this sprite yet */
-                              break;
-                         }
-                    }
+          line[x] = p.color;
+          bg->col[x] = p.col;
+          bg->priority[x] = p.priority;
+     }
+}
 
-                    /* Iterate on all sprites at this position until we find one
-                     * that's visible or we run out */
-                    for (i = next_sprite; line_sprites[i].x <= (int)x; i++) {
-                         s = line_sprites[i];
+#else /* GB_GPU_PER_PIXEL */
+
+/* Render the screen pixels in [`x`, `end`) from the background or window
+ * tile map, starting at coordinates (`map_x`, `map_y`) in the map. The tile
+ * map entry and GBC attributes are looked up once per tile and the pixels are
+ * then copied from the decoded tile row. The first and last tiles can be
+ * partial. The palettes are applied later on the whole line. */
+static GB_ALWAYS_INLINE void gb_gpu_draw_span(struct gb *gb, bool gbc,
+                                              struct gb_gpu_bg_line *bg,
+                                              unsigned x, unsigned end,
+                                              uint8_t map_x, uint8_t map_y,
+                                              bool use_high_tm) {
+     struct gb_gpu *gpu = &gb->gpu;
+     bool use_sprite_ts = gpu->bg_window_use_sprite_ts;
+     /* Offset of the current line of the tile map in VRAM */
+     unsigned tm_line;
+     unsigned i;
 
-                         if (gb_gpu_get_sprite_col(gb, &s, x, gpu->ly, &p)) {
-                              break;
-                         }
-                    }
+     /* There are two independent tile maps the game can use */
+     if (use_high_tm) {
+          tm_line = 0x1c00;
+     } else {
+          tm_line = 0x1800;
+     }
+
+     /* The tile map is a square map of 32*32 tiles */
+     tm_line += (map_y / 8) * 32;
+
+     while (x < end) {
+          unsigned tm_addr = tm_line + map_x / 8;
+          /* Index of the tile entry in the tile set */
+          uint8_t tile_index = gb->vram[tm_addr];
+          unsigned tile_x = map_x % 8;
+          unsigned tile_y = map_y % 8;
+          /* Number of pixels of this tile on screen */
+          unsigned n = 8 - tile_x;
+          const uint8_t *row;
+          /* GBC palette number, in the position used by bg->col */
+          uint8_t palette;
+          bool priority;
+
+          if (n > end - x) {
+               n = end - x;
+          }
+
+          if (gbc) {
+               /* On the GBC we have additional attributes in the 2nd VRAM
+                * bank */
+               uint8_t attrs = gb->vram[tm_addr + 0x2000];
+               bool y_flip = attrs & 0x40;
+               bool x_flip = attrs & 0x20;
+               bool high_bank = attrs & 0x08;
+
+               priority = attrs & 0x80;
+               palette = (attrs & 0x07) << 2;
+
+               if (y_flip) {
+                    tile_y = 7 - tile_y;
                }
+
+               row = gb_gpu_get_tile_row(gb, tile_index, tile_y,
+                                         use_sprite_ts, high_bank, x_flip);
+          } else {
+               priority = false;
+               palette = 0;
+               row = gb_gpu_get_tile_row(gb, tile_index, tile_y,
+                                         use_sprite_ts, false, false);
           }
 
-          line[x] = p.color;
+          for (i = 0; i < n; i++) {
+               bg->col[x + i] = row[tile_x + i] | palette;
+               bg->priority[x + i] = priority;
+          }
+
+          x += n;
+          map_x += n;
      }
+}
 
-     if (gb->gbc) {
+/* Render the background and window layers of the current line to `bg` and
+ * their colors to `line` */
+static GB_ALWAYS_INLINE void gb_gpu_draw_bg_win(struct gb *gb, bool gbc,
+                                                struct gb_gpu_bg_line *bg,
+                                                union gb_gpu_color *line) {
+     struct gb_gpu *gpu = &gb->gpu;
+     /* First screen pixel covered by the window */
+     unsigned win_start = GB_LCD_WIDTH;
+     /* First screen pixel covered by either layer */
+     unsigned start = 0;
+     unsigned x;
+
+     if (gpu->window_enable && gpu->ly >= gpu->wy) {
+          int wx = (int)gpu->wx - 7;
+
+          if (wx < 0) {
+               win_start = 0;
+          } else if (wx < GB_LCD_WIDTH) {
+               win_start = wx;
+          }
+     }
+
+     if (gpu->bg_enable) {
+          gb_gpu_draw_span(gb, gbc, bg, 0, win_start,
+                           gpu->scx, gpu->ly + gpu->scy,
+                           gpu->bg_use_high_tm);
+     } else {
+          /* Nothing drawn left of the window, the pixels are left white
+           * without going through the palettes */
+          for (x = 0; x < win_start; x++) {
+               line[x].dmg_color = GB_COL_WHITE;
+               bg->col[x] = GB_COL_WHITE;
+               bg->priority[x] = false;
+          }
+
+          start = win_start;
+     }
+
+     if (win_start < GB_LCD_WIDTH) {
+          gb_gpu_draw_span(gb, gbc, bg, win_start, GB_LCD_WIDTH,
+                           win_start + 7 - gpu->wx, gpu->ly - gpu->wy,
+                           gpu->window_use_high_tm);
+     }
+
+     /* Apply the palettes to the whole line at once */
+     if (gbc) {
+          gpu->kernels->map_gbc(&line[start], &bg->col[start],
+                                GB_LCD_WIDTH - start,
+                                &gpu->bg_palettes);
+     } else {
+          gpu->kernels->map_dmg(&line[start], &bg->col[start],
+                                GB_LCD_WIDTH - start, gpu->bgp);
+     }
+}
+
+#endif /* GB_GPU_PER_PIXEL */
+
+static GB_ALWAYS_INLINE void gb_gpu_draw_cur_line(struct gb *gb, bool gbc) {
+     struct gb_gpu *gpu = &gb->gpu;
+     union gb_gpu_color line[GB_LCD_WIDTH];
+     /* Background and window layers */
+     struct gb_gpu_bg_line bg;
+     struct gb_sprite line_sprites[GB_GPU_LINE_SPRITES];
+     unsigned n_sprites;
+
+     if (gpu->frameskip.skip) {
+          /* We're running late, the frame isn't displayed */
+          return;
+     }
+
+     n_sprites = gb_gpu_get_line_sprites(gb, gbc, gpu->ly, line_sprites);
+
+     gb_gpu_draw_bg_win(gb, gbc, &bg, line);
+
+     /* Draw the sprites from lowest to highest priority. Only the opaque
+      * pixels of each sprite are visited, so the pixels without sprites
+      * aren't touched at all. A sprite hidden by the background at a given
+      * location lets a lower priority one show through, which the drawing
+      * order takes care of as well. */
+     while (n_sprites--) {
+          gb_gpu_draw_sprite(gb, gbc, &line_sprites[n_sprites], gpu->ly,
+                             &bg, line);
+     }
+
+     if (gbc) {
           gb->frontend.draw_line_gbc(gb, gpu->ly, line);
      } else {
           gb->frontend.draw_line_dmg(gb, gpu->ly, line);
      }
 }
 
+/* Line renderers specialized for each model, selected by gb_gpu_reset */
+static void gb_gpu_draw_line_dmg(struct gb *gb) {
+     gb_gpu_draw_cur_line(gb, false);
+}
+
+static void gb_gpu_draw_line_gbc(struct gb *gb) {
+     gb_gpu_draw_cur_line(gb, true);
+}
+
 void gb_gpu_sync(struct gb *gb) {
      struct gb_gpu *gpu = &gb->gpu;
      struct gb_hdma *hdma = &gb->hdma;
@@ -568,7 +906,7 @@ void gb_gpu_sync(struct gb *gb) {
                if (prev_mode != 0 && gb_gpu_get_mode(gb) == 0) {
                     /* We didn't finish the line but we did cross the Mode 3 ->
                      * Mode 0 boundary, draw the current line */
-                    gb_gpu_draw_cur_line(gb);
+                    gpu->draw_line(gb);
 
                     if (gpu->iten_mode0) {
                          gb_irq_trigger(gb, GB_IRQ_LCD_STAT);
@@ -586,7 +924,7 @@ void gb_gpu_sync(struct gb *gb) {
                     /* We're about to finish the current line but we hadn't
                      * reached the Mode 0 boundary yet, which means that we
                      * still have to draw it */
-                    gb_gpu_draw_cur_line(gb);
+                    gpu->draw_line(gb);
 
                     if (gpu->iten_mode0) {
                          gb_irq_trigger(gb, GB_IRQ_LCD_STAT);
@@ -603,8 +941,14 @@ void gb_gpu_sync(struct gb *gb) {
                line_remaining = HTOTAL;
 
                if (gpu->ly == VSYNC_START) {
-                    /* We're done drawing the current frame */
-                    gb->frontend.flip(gb);
+                    /* We're done drawing the current frame. There's
+                     * nothing new to display if it was skipped. */
+                    if (gpu->frameskip.skip) {
+                         gpu->frameskip.skipped++;
+                    } else {
+                         gpu->frameskip.drawn++;
+                         gb->frontend.flip(gb);
+                    }
                     gb_irq_trigger(gb, GB_IRQ_VSYNC);
 
                     if (gpu->iten_mode1) {
@@ -616,6 +960,7 @@ void gb_gpu_sync(struct gb *gb) {
                if (gpu->ly >= VTOTAL) {
                     /* Move on to the next frame */
                     gpu->ly = 0;
+                    gb_gpu_frameskip_update(gb);
                }
 
                if (gpu->iten_lyc && gpu->ly == gpu->lyc) {
@@ -669,15 +1014,16 @@ void gb_gpu_set_lcd_stat(struct gb *gb, uint8_t stat) {
 uint8_t gb_gpu_get_lcd_stat(struct gb *gb) {
      struct gb_gpu *gpu = &gb->gpu;
      uint8_t r = 0;
+     unsigned ly, line_pos;
 
      if (!gpu->master_enable) {
           return 0;
      }
 
-     gb_gpu_sync(gb);
+     gb_gpu_peek_position(gb, &ly, &line_pos);
 
-     r |= gb_gpu_get_mode(gb);
-     r |= (gpu->ly == gpu->lyc) << 2;
+     r |= gb_gpu_mode_at(ly, line_pos);
+     r |= (ly == gpu->lyc) << 2;
      r |= gpu->iten_mode0 << 3;
      r |= gpu->iten_mode1 << 4;
      r |= gpu->iten_mode2 << 5;
@@ -694,7 +1040,11 @@ void gb_gpu_set_lcdc(struct gb *gb, uint8_t lcdc) {
 
      gpu->bg_enable = lcdc & 0x01;
      gpu->sprite_enable = lcdc & 0x02;
-     gpu->tall_sprites = lcdc & 0x04;
+     if (gpu->tall_sprites != (bool)(lcdc & 0x04)) {
+          /* The sprites now cover a different set of lines */
+          gpu->tall_sprites = lcdc & 0x04;
+          gb_gpu_sprite_rebuild_masks(gb);
+     }
      gpu->bg_use_high_tm = lcdc & 0x08;
      gpu->bg_window_use_sprite_ts = lcdc & 0x10;
      gpu->window_enable = lcdc & 0x20;
@@ -742,10 +1092,34 @@ uint8_t gb_gpu_get_lcdc(struct gb *gb) {
      return lcdc;
 }
 
+/* Return the date of the next change of the mode reported in STAT. Mode 0 ->
+ * 2 and Mode 1 -> 2 transitions happen at the end of a line, which is always
+ * a GPU event. Mode 2 -> 3 and Mode 3 -> 0 transitions can happen without
+ * one. */
+int64_t gb_gpu_next_mode_change(struct gb *gb) {
+     unsigned ly, line_pos;
+
+     if (!gb->gpu.master_enable) {
+          /* STAT reads as 0 */
+          return gb->timestamp + GB_SYNC_NEVER;
+     }
+
+     gb_gpu_peek_position(gb, &ly, &line_pos);
+
+     switch (gb_gpu_mode_at(ly, line_pos)) {
+     case 2:
+          return gb->timestamp + (MODE_2_CYCLES - line_pos);
+     case 3:
+          return gb->timestamp + (MODE_3_END - line_pos);
+     default:
+          return gb->timestamp + (HTOTAL - line_pos);
+     }
+}
+
 uint8_t gb_gpu_get_ly(struct gb *gb) {
-     struct gb_gpu *gpu = &gb->gpu;
+     unsigned ly, line_pos;
 
-     gb_gpu_sync(gb);
+     gb_gpu_peek_position(gb, &ly, &line_pos);
 
-     return gpu->ly;
+     return ly;
 }
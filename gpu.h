@@ -3,6 +3,8 @@
 
 /* The GPU supports up to 40 sprites concurrently */
 #define GB_GPU_MAX_SPRITES 40
+/* Max number of sprites per line */
+#define GB_GPU_LINE_SPRITES 10
 
 enum gb_color {
      GB_COL_WHITE,
@@ -14,6 +16,37 @@ enum gb_color {
 #define GB_LCD_WIDTH  160
 #define GB_LCD_HEIGHT 144
 
+/* Number of tiles in a VRAM bank. The tile data area is 0x8000-0x97ff, 16
+ * bytes per tile */
+#define GB_GPU_BANK_TILES 384
+
+/* One row of a tile, decoded to one color index per pixel */
+struct gb_gpu_tile_row {
+     /* Pixels from left to right in pix[0], horizontally flipped in
+      * pix[1] */
+     uint8_t pix[2][8];
+};
+
+/* Maximum number of frames skipped in a row by the automatic frameskip, so
+ * that the display keeps being refreshed even if we're very late */
+#define GB_GPU_FRAMESKIP_MAX 4
+
+/* Automatic frameskip state. When enabled, frames that start while the
+ * emulation is behind real time aren't drawn. Only the line rendering is
+ * skipped, the GPU timings and interrupts are unaffected. */
+struct gb_gpu_frameskip {
+     /* True if frames can be skipped */
+     bool enabled;
+     /* True if the current frame isn't drawn */
+     bool skip;
+     /* Number of frames skipped in a row */
+     unsigned consecutive;
+     /* Number of frames drawn and skipped. Reset by the frontend when it
+      * displays the skip ratio. */
+     unsigned drawn;
+     unsigned skipped;
+};
+
 union gb_gpu_color {
      /* DMG color: 4 shades */
      enum gb_color dmg_color;
@@ -25,6 +58,10 @@ union gb_gpu_color {
 struct gb_color_palette {
      /* 8 palettes of 4 colors. Each color is stored as xBGR 1555 */
      uint16_t colors[8][4];
+     /* Low and high bytes of `colors` as two 32-entry tables, for the byte
+      * shuffle lookups of the pixel kernels. Updated along with `colors` so
+      * that the kernels don't have to split them for every line. */
+     uint8_t color_bytes[2][32];
      /* Index of the next write in this palette */
      uint8_t write_index;
      /* If true `write_index` auto-increments after a write */
@@ -76,6 +113,12 @@ struct gb_gpu {
      uint8_t wy;
      /* Current position within the current line */
      uint16_t line_pos;
+     /* Line renderer specialized for the emulated model */
+     void (*draw_line)(struct gb *gb);
+     /* Pixel processing kernels for the host CPU */
+     const struct gb_pixel_kernels *kernels;
+     /* Automatic frameskip */
+     struct gb_gpu_frameskip frameskip;
      /* Object Attribute Memory (sprite configuration). Each sprite uses 4 bytes
       * for attributes. */
      uint8_t oam[GB_GPU_MAX_SPRITES * 4];
@@ -83,14 +126,34 @@ struct gb_gpu {
      struct gb_color_palette bg_palettes;
      /* GBC-only: sprite color palettes */
      struct gb_color_palette sprite_palettes;
+     /* Sprites covering each visible line, bit n is set if OAM entry n
+      * does. Kept up to date on every OAM write. */
+     uint64_t line_sprite_mask[GB_LCD_HEIGHT];
+     /* Sprites displayed on each visible line, as OAM indices sorted from
+      * highest to lowest priority. Rebuilt from `line_sprite_mask` when the
+      * line is drawn if the corresponding `line_sprites_valid` is false. */
+     uint8_t line_sprites[GB_LCD_HEIGHT][GB_GPU_LINE_SPRITES];
+     uint8_t line_sprite_count[GB_LCD_HEIGHT];
+     bool line_sprites_valid[GB_LCD_HEIGHT];
+     /* True if the rows of the tile in `tile_rows` are up to date. Indexed by
+      * bank * GB_GPU_BANK_TILES + tile. Cleared on VRAM writes. */
+     bool tile_valid[2 * GB_GPU_BANK_TILES];
+     /* Pre-decoded tile rows for both VRAM banks, built lazily when the tile
+      * is first drawn. Indexed by (bank * GB_GPU_BANK_TILES + tile) * 8 +
+      * row */
+     struct gb_gpu_tile_row tile_rows[2 * GB_GPU_BANK_TILES * 8];
 };
 
 void gb_gpu_reset(struct gb *gb);
 void gb_gpu_sync(struct gb *gb);
+void gb_gpu_set_frameskip(struct gb *gb, bool enable);
 void gb_gpu_set_lcd_stat(struct gb *gb, uint8_t stat);
 void gb_gpu_set_lcdc(struct gb *gb, uint8_t stat);
 uint8_t gb_gpu_get_lcdc(struct gb *gb);
 uint8_t gb_gpu_get_ly(struct gb *gb);
 uint8_t gb_gpu_get_lcd_stat(struct gb *gb);
+int64_t gb_gpu_next_mode_change(struct gb *gb);
+void gb_gpu_vram_written(struct gb *gb, uint16_t off);
+void gb_gpu_write_oam(struct gb *gb, unsigned off, uint8_t val);
 
 #endif /* _GB_GPU_H_ */
@@ -5,10 +5,24 @@ void gb_irq_reset(struct gb *gb) {
 
      irq->irq_flags = 0xE0;
      irq->irq_enable = 0;
+     irq->pending = false;
 }
 
 void gb_irq_trigger(struct gb *gb, enum gb_irq_token which) {
      struct gb_irq *irq = &gb->irq;
 
      irq->irq_flags |= (1U << which);
+
+     gb_irq_update_pending(gb);
+}
+
+void gb_irq_update_pending(struct gb *gb) {
+     struct gb_irq *irq = &gb->irq;
+     struct gb_cpu *cpu = &gb->cpu;
+     bool active = irq->irq_enable & irq->irq_flags & 0x1f;
+
+     /* An active IRQ only matters if we can service it or if it gets us out
+      * of halted mode */
+     irq->pending = (active && (cpu->irq_enable || cpu->halted)) ||
+          cpu->irq_enable != cpu->irq_enable_next;
 }
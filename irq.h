@@ -17,9 +17,15 @@ enum gb_irq_token {
 struct gb_irq {
      uint8_t irq_flags;
      uint8_t irq_enable;
+     /* True if the CPU has something to do about interrupts at the next
+      * instruction boundary: service an IRQ, leave halted mode or update the
+      * IME after EI. Must be refreshed with gb_irq_update_pending whenever
+      * IF, IE, the IME or the halted state changes. */
+     bool pending;
 };
 
 void gb_irq_reset(struct gb *gb);
 void gb_irq_trigger(struct gb *gb, enum gb_irq_token which);
+void gb_irq_update_pending(struct gb *gb);
 
 #endif /* _GB_IRQ_H_ */
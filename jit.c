@@ -0,0 +1,1672 @@
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "gb.h"
+
+/*
+ * x86-64 recompiler
+ *
+ * Straight-line runs of instructions executing from ROM are translated into
+ * native code implementing the SM83 semantics directly: the registers and the
+ * lazy flags are loaded from and stored to `struct gb` (addressed through
+ * %rbx) and the ALU operations are done inline. The generated code only
+ * calls back into C for the bus accesses that can't be served from the page
+ * tables, the device events and a few rare instructions that need the IRQ
+ * state updated.
+ *
+ * The timing is the same as the interpreter's: the cycles are accumulated at
+ * compile time and added to the timestamp before every bus access and at the
+ * end of every instruction. Since the duration of a machine cycle is baked
+ * into the code, a block is recompiled after a speed switch.
+ *
+ * After every instruction the block checks whether it can keep going and
+ * returns to the main loop if the interpreter would have done anything else
+ * than run the next instruction: device events came due and raised an IRQ,
+ * end of the time slice, IRQ to service or IME change pending, or ROM bank
+ * switched under our feet. The instructions that stop or halt the CPU, DAA
+ * and the undefined opcodes are left to the interpreter.
+ */
+
+static void gb_jit_free_block(struct gb_jit_block *b) {
+     b->code = NULL;
+     b->hits = 0;
+     b->rom_off = GB_JIT_BLOCK_INVALID;
+}
+
+/* Drop all the compiled code */
+static void gb_jit_flush(struct gb *gb) {
+     struct gb_jit *jit = &gb->jit;
+     unsigned i;
+
+     for (i = 0; i < GB_JIT_BLOCK_MAP_SIZE; i++) {
+          gb_jit_free_block(&jit->blocks[i]);
+     }
+
+     jit->code_len = 0;
+}
+
+void gb_jit_init(struct gb *gb, bool enable) {
+     struct gb_jit *jit = &gb->jit;
+     unsigned i;
+
+     jit->enabled = false;
+     jit->code = NULL;
+     jit->code_len = 0;
+     jit->blocks = NULL;
+
+#ifndef __x86_64__
+     /* We only know how to generate x86-64 code */
+     enable = false;
+#endif
+
+     if (!enable) {
+          return;
+     }
+
+     jit->page_size = sysconf(_SC_PAGESIZE);
+
+     /* The buffer is never writable and executable at the same time: pages
+      * are made executable once the block they hold has been generated */
+     jit->code = mmap(NULL, GB_JIT_CODE_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+     if (jit->code == MAP_FAILED) {
+          /* Not fatal, we can still use the interpreter */
+          perror("Can't allocate JIT buffer");
+          jit->code = NULL;
+          return;
+     }
+
+     jit->blocks = calloc(GB_JIT_BLOCK_MAP_SIZE, sizeof(*jit->blocks));
+     if (jit->blocks == NULL) {
+          perror("Can't allocate JIT block map");
+          die();
+     }
+
+     for (i = 0; i < GB_JIT_BLOCK_MAP_SIZE; i++) {
+          jit->blocks[i].rom_off = GB_JIT_BLOCK_INVALID;
+     }
+
+     jit->enabled = true;
+}
+
+void gb_jit_destroy(struct gb *gb) {
+     struct gb_jit *jit = &gb->jit;
+
+     if (jit->blocks) {
+          gb_jit_flush(gb);
+          free(jit->blocks);
+          jit->blocks = NULL;
+     }
+
+     if (jit->code) {
+          munmap(jit->code, GB_JIT_CODE_SIZE);
+          jit->code = NULL;
+     }
+
+     jit->enabled = false;
+}
+
+#ifdef __x86_64__
+
+/* Offset of a field of `struct gb`, the generated code addresses everything
+ * relative to %rbx which holds the `gb` pointer */
+#define GB_JIT_OFF(_f) ((int32_t)offsetof(struct gb, _f))
+
+/* The flags are set with a single 32-bit store at `f_res` */
+_Static_assert(offsetof(struct gb, cpu.f_op_a) ==
+               offsetof(struct gb, cpu.f_res) + 2,
+               "f_op_a must follow f_res");
+_Static_assert(offsetof(struct gb, cpu.f_op_b) ==
+               offsetof(struct gb, cpu.f_res) + 3,
+               "f_op_b must follow f_op_a");
+
+/* x86 registers. We only use the ones that are caller-saved in the SysV ABI,
+ * except %rbx which holds `gb` and is saved by the prologue. Only %eax, %ecx
+ * and %edx can be stored as bytes. */
+#define GB_JIT_EAX 0
+#define GB_JIT_ECX 1
+#define GB_JIT_EDX 2
+#define GB_JIT_ESI 6
+
+/* x86 condition codes */
+#define GB_JIT_CC_B  0x2
+#define GB_JIT_CC_AE 0x3
+#define GB_JIT_CC_E  0x4
+#define GB_JIT_CC_NE 0x5
+#define GB_JIT_CC_GE 0xd
+
+/* Opcode extensions of the group 1 ALU instructions (0x81/0x83) */
+#define GB_JIT_ALU_ADD 0
+#define GB_JIT_ALU_OR  1
+#define GB_JIT_ALU_AND 4
+#define GB_JIT_ALU_SUB 5
+#define GB_JIT_ALU_XOR 6
+#define GB_JIT_ALU_CMP 7
+
+/* Opcode extensions of the group 2 shift instructions (0xc1) */
+#define GB_JIT_SHL 4
+#define GB_JIT_SHR 5
+
+/* Upper bound of the size of the code generated for an instruction,
+ * including its share of the exit stubs */
+#define GB_JIT_MAX_INSN_CODE 640
+
+/* Upper bound of the size of the code generated for a block */
+#define GB_JIT_MAX_BLOCK_CODE (64 + GB_JIT_MAX_BLOCK_LEN * GB_JIT_MAX_INSN_CODE)
+
+/* Maximum number of exit stubs in a block: up to three checks at every
+ * instruction boundary, one more for the sync stubs */
+#define GB_JIT_MAX_EXITS ((GB_JIT_MAX_BLOCK_LEN + 1) * 4)
+
+/* Instruction to recompile */
+struct gb_jit_insn {
+     uint16_t pc;
+     uint8_t opcode;
+     uint8_t operands[2];
+};
+
+/* Jump to an exit stub, patched once we know where the stub is */
+struct gb_jit_exit {
+     uint8_t *patch;
+     /* PC to return to the main loop with */
+     uint16_t pc;
+};
+
+/* Jump to a stub running the device events at an instruction boundary */
+struct gb_jit_sync {
+     uint8_t *patch;
+     /* Where to go back once the events have run */
+     uint8_t *resume;
+     /* PC to return to the main loop with if an IRQ has been raised */
+     uint16_t pc;
+};
+
+struct gb_jit_asm {
+     /* Where the next byte of code goes */
+     uint8_t *p;
+     /* Start of the code of the first instruction, target of the jumps back
+      * to the start of the block */
+     uint8_t *body;
+     /* Machine cycles run since the timestamp was last updated */
+     int32_t pending;
+     /* Duration of a machine cycle when the block was compiled */
+     int32_t mcycle_duration;
+     /* Address of the first instruction */
+     uint16_t start_pc;
+     /* True if the block runs from the switchable ROM bank */
+     bool banked;
+     /* ROM bank offset the block was compiled for if `banked` is true */
+     uint32_t bank_off;
+     /* True if the current instruction may have written to the cartridge
+      * mapper */
+     bool rom_write;
+     struct gb_jit_exit exits[GB_JIT_MAX_EXITS];
+     unsigned nexits;
+     struct gb_jit_sync syncs[GB_JIT_MAX_BLOCK_LEN + 1];
+     unsigned nsyncs;
+};
+
+/* SM83 8-bit register operands in opcode order. 6 is (HL), handled
+ * separately. */
+static const int32_t gb_jit_reg8[8] = {
+     GB_JIT_OFF(cpu.b),
+     GB_JIT_OFF(cpu.c),
+     GB_JIT_OFF(cpu.d),
+     GB_JIT_OFF(cpu.e),
+     GB_JIT_OFF(cpu.h),
+     GB_JIT_OFF(cpu.l),
+     -1,
+     GB_JIT_OFF(cpu.a),
+};
+
+/* SM83 16-bit register operands in opcode order */
+static const int32_t gb_jit_reg16[4] = {
+     GB_JIT_OFF(cpu.bc),
+     GB_JIT_OFF(cpu.de),
+     GB_JIT_OFF(cpu.hl),
+     GB_JIT_OFF(cpu.sp),
+};
+
+/*
+ * Instruction encoding
+ */
+
+static void gb_jit_b(struct gb_jit_asm *a, uint8_t b) {
+     *a->p++ = b;
+}
+
+static void gb_jit_u16(struct gb_jit_asm *a, uint16_t v) {
+     memcpy(a->p, &v, sizeof(v));
+     a->p += sizeof(v);
+}
+
+static void gb_jit_u32(struct gb_jit_asm *a, uint32_t v) {
+     memcpy(a->p, &v, sizeof(v));
+     a->p += sizeof(v);
+}
+
+static void gb_jit_u64(struct gb_jit_asm *a, uint64_t v) {
+     memcpy(a->p, &v, sizeof(v));
+     a->p += sizeof(v);
+}
+
+/* ModRM byte (and displacement) for a `off(%rbx)` operand, `reg` goes in the
+ * reg field */
+static void gb_jit_mem(struct gb_jit_asm *a, unsigned reg, int32_t off) {
+     if (off >= -128 && off < 128) {
+          gb_jit_b(a, 0x43 | (reg << 3));
+          gb_jit_b(a, off);
+     } else {
+          gb_jit_b(a, 0x83 | (reg << 3));
+          gb_jit_u32(a, off);
+     }
+}
+
+/* movzbl off(%rbx), %reg */
+static void gb_jit_load8(struct gb_jit_asm *a, unsigned reg, int32_t off) {
+     gb_jit_b(a, 0x0f);
+     gb_jit_b(a, 0xb6);
+     gb_jit_mem(a, reg, off);
+}
+
+/* movzwl off(%rbx), %reg */
+static void gb_jit_load16(struct gb_jit_asm *a, unsigned reg, int32_t off) {
+     gb_jit_b(a, 0x0f);
+     gb_jit_b(a, 0xb7);
+     gb_jit_mem(a, reg, off);
+}
+
+/* mov %reg8, off(%rbx) */
+static void gb_jit_store8(struct gb_jit_asm *a, int32_t off, unsigned reg) {
+     gb_jit_b(a, 0x88);
+     gb_jit_mem(a, reg, off);
+}
+
+/* mov %reg16, off(%rbx) */
+static void gb_jit_store16(struct gb_jit_asm *a, int32_t off, unsigned reg) {
+     gb_jit_b(a, 0x66);
+     gb_jit_b(a, 0x89);
+     gb_jit_mem(a, reg, off);
+}
+
+/* mov %reg32, off(%rbx) */
+static void gb_jit_store32(struct gb_jit_asm *a, int32_t off, unsigned reg) {
+     gb_jit_b(a, 0x89);
+     gb_jit_mem(a, reg, off);
+}
+
+/* movb $v, off(%rbx) */
+static void gb_jit_store8_imm(struct gb_jit_asm *a, int32_t off, uint8_t v) {
+     gb_jit_b(a, 0xc6);
+     gb_jit_mem(a, 0, off);
+     gb_jit_b(a, v);
+}
+
+/* movw $v, off(%rbx) */
+static void gb_jit_store16_imm(struct gb_jit_asm *a,
+                               int32_t off, uint16_t v) {
+     gb_jit_b(a, 0x66);
+     gb_jit_b(a, 0xc7);
+     gb_jit_mem(a, 0, off);
+     gb_jit_u16(a, v);
+}
+
+/* incw off(%rbx) if `dec` is false, decw off(%rbx) otherwise */
+static void gb_jit_incdec16(struct gb_jit_asm *a, int32_t off, bool dec) {
+     gb_jit_b(a, 0x66);
+     gb_jit_b(a, 0xff);
+     gb_jit_mem(a, dec, off);
+}
+
+/* cmpb $v, off(%rbx) */
+static void gb_jit_cmp8_imm(struct gb_jit_asm *a, int32_t off, uint8_t v) {
+     gb_jit_b(a, 0x80);
+     gb_jit_mem(a, GB_JIT_ALU_CMP, off);
+     gb_jit_b(a, v);
+}
+
+/* testb $v, off(%rbx) */
+static void gb_jit_test8_imm(struct gb_jit_asm *a, int32_t off, uint8_t v) {
+     gb_jit_b(a, 0xf6);
+     gb_jit_mem(a, 0, off);
+     gb_jit_b(a, v);
+}
+
+/* cmpl $v, off(%rbx) */
+static void gb_jit_cmp32_imm(struct gb_jit_asm *a,
+                             int32_t off, uint32_t v) {
+     gb_jit_b(a, 0x81);
+     gb_jit_mem(a, GB_JIT_ALU_CMP, off);
+     gb_jit_u32(a, v);
+}
+
+/* mov %src, %dst */
+static void gb_jit_mov(struct gb_jit_asm *a, unsigned dst, unsigned src) {
+     gb_jit_b(a, 0x89);
+     gb_jit_b(a, 0xc0 | (src << 3) | dst);
+}
+
+/* mov $v, %reg */
+static void gb_jit_mov_imm(struct gb_jit_asm *a, unsigned reg, uint32_t v) {
+     gb_jit_b(a, 0xb8 + reg);
+     gb_jit_u32(a, v);
+}
+
+/* Two register ALU operation, `op` is the opcode of the `op %src, %dst`
+ * form: 0x01 add, 0x09 or, 0x21 and, 0x29 sub, 0x31 xor */
+static void gb_jit_alu(struct gb_jit_asm *a,
+                       uint8_t op, unsigned dst, unsigned src) {
+     gb_jit_b(a, op);
+     gb_jit_b(a, 0xc0 | (src << 3) | dst);
+}
+
+#define GB_JIT_ADD 0x01
+#define GB_JIT_OR  0x09
+#define GB_JIT_AND 0x21
+#define GB_JIT_SUB 0x29
+#define GB_JIT_XOR 0x31
+
+/* ALU operation with an immediate, `ext` is one of GB_JIT_ALU_* */
+static void gb_jit_alu_imm(struct gb_jit_asm *a,
+                           unsigned ext, unsigned reg, int32_t v) {
+     if (v >= -128 && v < 128) {
+          gb_jit_b(a, 0x83);
+          gb_jit_b(a, 0xc0 | (ext << 3) | reg);
+          gb_jit_b(a, v);
+     } else {
+          gb_jit_b(a, 0x81);
+          gb_jit_b(a, 0xc0 | (ext << 3) | reg);
+          gb_jit_u32(a, v);
+     }
+}
+
+/* Shift by an immediate, `ext` is GB_JIT_SHL or GB_JIT_SHR */
+static void gb_jit_shift(struct gb_jit_asm *a,
+                         unsigned ext, unsigned reg, uint8_t n) {
+     gb_jit_b(a, 0xc1);
+     gb_jit_b(a, 0xc0 | (ext << 3) | reg);
+     gb_jit_b(a, n);
+}
+
+/* movzbl %src8, %dst */
+static void gb_jit_movzx8(struct gb_jit_asm *a, unsigned dst, unsigned src) {
+     gb_jit_b(a, 0x0f);
+     gb_jit_b(a, 0xb6);
+     gb_jit_b(a, 0xc0 | (dst << 3) | src);
+}
+
+/* Set %reg to 1 if the condition `cc` is true, 0 otherwise */
+static void gb_jit_setcc(struct gb_jit_asm *a, unsigned cc, unsigned reg) {
+     /* setcc %reg8 */
+     gb_jit_b(a, 0x0f);
+     gb_jit_b(a, 0x90 + cc);
+     gb_jit_b(a, 0xc0 | reg);
+     gb_jit_movzx8(a, reg, reg);
+}
+
+/* Conditional jump with a 32-bit displacement. Returns the location of the
+ * displacement, to be fixed with gb_jit_patch. */
+static uint8_t *gb_jit_jcc(struct gb_jit_asm *a, unsigned cc) {
+     uint8_t *patch;
+
+     gb_jit_b(a, 0x0f);
+     gb_jit_b(a, 0x80 + cc);
+     patch = a->p;
+     gb_jit_u32(a, 0);
+
+     return patch;
+}
+
+/* Unconditional jump, same as gb_jit_jcc */
+static uint8_t *gb_jit_jmp(struct gb_jit_asm *a) {
+     uint8_t *patch;
+
+     gb_jit_b(a, 0xe9);
+     patch = a->p;
+     gb_jit_u32(a, 0);
+
+     return patch;
+}
+
+/* Point the jump whose displacement is at `patch` to `target` */
+static void gb_jit_patch(uint8_t *patch, const uint8_t *target) {
+     int32_t rel = target - (patch + 4);
+
+     memcpy(patch, &rel, sizeof(rel));
+}
+
+/* Return to the main loop */
+static void gb_jit_ret(struct gb_jit_asm *a) {
+     /* pop %rbx ; ret */
+     gb_jit_b(a, 0x5b);
+     gb_jit_b(a, 0xc3);
+}
+
+/*
+ * Timing
+ */
+
+/* Add the pending cycles to the timestamp */
+static void gb_jit_flush_cycles(struct gb_jit_asm *a) {
+     int32_t ticks = a->pending * a->mcycle_duration;
+
+     if (ticks == 0) {
+          return;
+     }
+
+     /* addq $ticks, timestamp(%rbx) */
+     gb_jit_b(a, 0x48);
+     if (ticks < 128) {
+          gb_jit_b(a, 0x83);
+          gb_jit_mem(a, GB_JIT_ALU_ADD, GB_JIT_OFF(timestamp));
+          gb_jit_b(a, ticks);
+     } else {
+          gb_jit_b(a, 0x81);
+          gb_jit_mem(a, GB_JIT_ALU_ADD, GB_JIT_OFF(timestamp));
+          gb_jit_u32(a, ticks);
+     }
+
+     a->pending = 0;
+}
+
+/* Call `fn` with `gb` as first argument. The other arguments must already be
+ * in %esi and %edx. */
+static void gb_jit_call(struct gb_jit_asm *a, const void *fn) {
+     /* The callee may look at the timestamp */
+     gb_jit_flush_cycles(a);
+
+     /* mov %rbx, %rdi */
+     gb_jit_b(a, 0x48);
+     gb_jit_b(a, 0x89);
+     gb_jit_b(a, 0xdf);
+     /* movabs $fn, %rax */
+     gb_jit_b(a, 0x48);
+     gb_jit_b(a, 0xb8);
+     gb_jit_u64(a, (uintptr_t)fn);
+     /* call *%rax */
+     gb_jit_b(a, 0xff);
+     gb_jit_b(a, 0xd0);
+}
+
+/* Return to the main loop with PC set to `pc` if the condition `cc` is
+ * true */
+static void gb_jit_exit_if(struct gb_jit_asm *a, unsigned cc, uint16_t pc) {
+     struct gb_jit_exit *e = &a->exits[a->nexits++];
+
+     assert(a->nexits <= GB_JIT_MAX_EXITS);
+
+     e->patch = gb_jit_jcc(a, cc);
+     e->pc = pc;
+}
+
+/* Instruction boundary before the instruction at `pc`. Does what the
+ * interpreter's block loop does between two instructions: run the events
+ * that came due and bail out to the main loop if it has anything else to
+ * do. */
+static void gb_jit_boundary(struct gb_jit_asm *a, uint16_t pc) {
+     struct gb_jit_sync *s = &a->syncs[a->nsyncs++];
+
+     assert(a->nsyncs <= GB_JIT_MAX_BLOCK_LEN + 1);
+
+     gb_jit_flush_cycles(a);
+
+     /* mov timestamp(%rbx), %rax */
+     gb_jit_b(a, 0x48);
+     gb_jit_b(a, 0x8b);
+     gb_jit_mem(a, GB_JIT_EAX, GB_JIT_OFF(timestamp));
+     /* cmp sync.first_event(%rbx), %rax */
+     gb_jit_b(a, 0x48);
+     gb_jit_b(a, 0x3b);
+     gb_jit_mem(a, GB_JIT_EAX, GB_JIT_OFF(sync.first_event));
+     s->patch = gb_jit_jcc(a, GB_JIT_CC_GE);
+     s->resume = a->p;
+     s->pc = pc;
+
+     /* cmp cpu.limit(%rbx), %rax */
+     gb_jit_b(a, 0x48);
+     gb_jit_b(a, 0x3b);
+     gb_jit_mem(a, GB_JIT_EAX, GB_JIT_OFF(cpu.limit));
+     gb_jit_exit_if(a, GB_JIT_CC_GE, pc);
+
+     gb_jit_cmp8_imm(a, GB_JIT_OFF(irq.pending), 0);
+     gb_jit_exit_if(a, GB_JIT_CC_NE, pc);
+
+     if (a->banked && a->rom_write) {
+          /* The instruction may have switched the ROM bank we're running
+           * from */
+          gb_jit_cmp32_imm(a, GB_JIT_OFF(cart.rom_bank_off), a->bank_off);
+          gb_jit_exit_if(a, GB_JIT_CC_NE, pc);
+     }
+}
+
+/* Continue at `pc`. Loops back to the start of the block if that's where
+ * we're going, otherwise returns to the main loop. */
+static void gb_jit_goto(struct gb_jit_asm *a, uint16_t pc) {
+     if (pc == a->start_pc) {
+          gb_jit_boundary(a, pc);
+          gb_jit_patch(gb_jit_jmp(a), a->body);
+     } else {
+          gb_jit_flush_cycles(a);
+          gb_jit_store16_imm(a, GB_JIT_OFF(cpu.pc), pc);
+          gb_jit_ret(a);
+     }
+}
+
+/* Generate the stubs the boundary checks jump to */
+static void gb_jit_emit_stubs(struct gb_jit_asm *a) {
+     unsigned i;
+
+     /* The sync stubs add exits, they must come first */
+     for (i = 0; i < a->nsyncs; i++) {
+          struct gb_jit_sync *s = &a->syncs[i];
+
+          gb_jit_patch(s->patch, a->p);
+          gb_jit_call(a, gb_sync_check_events);
+          gb_jit_cmp8_imm(a, GB_JIT_OFF(irq.pending), 0);
+          gb_jit_exit_if(a, GB_JIT_CC_NE, s->pc);
+          /* mov timestamp(%rbx), %rax */
+          gb_jit_b(a, 0x48);
+          gb_jit_b(a, 0x8b);
+          gb_jit_mem(a, GB_JIT_EAX, GB_JIT_OFF(timestamp));
+          gb_jit_patch(gb_jit_jmp(a), s->resume);
+     }
+
+     for (i = 0; i < a->nexits; i++) {
+          struct gb_jit_exit *e = &a->exits[i];
+
+          gb_jit_patch(e->patch, a->p);
+          gb_jit_store16_imm(a, GB_JIT_OFF(cpu.pc), e->pc);
+          gb_jit_ret(a);
+     }
+}
+
+/*
+ * Bus accesses
+ */
+
+/* Compare the address in %esi against internal RAM and its mirror, the only
+ * region besides the ROM that can be accessed without syncing the devices,
+ * and emit a conditional jump. `cc` picks the direction: GB_JIT_CC_B jumps
+ * if the address is in internal RAM, GB_JIT_CC_AE if it isn't. */
+static uint8_t *gb_jit_jump_iram_cc(struct gb_jit_asm *a, unsigned cc) {
+     gb_jit_mov(a, GB_JIT_ECX, GB_JIT_ESI);
+     gb_jit_alu_imm(a, GB_JIT_ALU_SUB, GB_JIT_ECX, 0xc000);
+     gb_jit_alu_imm(a, GB_JIT_ALU_CMP, GB_JIT_ECX, 0xfe00 - 0xc000);
+
+     return gb_jit_jcc(a, cc);
+}
+
+/* Load the page table entry for the address in %esi into %rax and jump if
+ * it's NULL */
+static uint8_t *gb_jit_page_lookup(struct gb_jit_asm *a, int32_t map) {
+     gb_jit_mov(a, GB_JIT_EAX, GB_JIT_ESI);
+     gb_jit_shift(a, GB_JIT_SHR, GB_JIT_EAX, 8);
+     /* mov map(%rbx, %rax, 8), %rax */
+     gb_jit_b(a, 0x48);
+     gb_jit_b(a, 0x8b);
+     gb_jit_b(a, 0x84);
+     gb_jit_b(a, 0xc3);
+     gb_jit_u32(a, map);
+     /* test %rax, %rax */
+     gb_jit_b(a, 0x48);
+     gb_jit_b(a, 0x85);
+     gb_jit_b(a, 0xc0);
+
+     /* movzbl %sil, %ecx */
+     gb_jit_b(a, 0x40);
+     gb_jit_b(a, 0x0f);
+     gb_jit_b(a, 0xb6);
+     gb_jit_b(a, 0xce);
+
+     return gb_jit_jcc(a, GB_JIT_CC_E);
+}
+
+/* Read the byte at the address in %esi into %eax. Plain memory is read
+ * through the page tables, everything else goes through
+ * gb_cpu_bus_readb. */
+static void gb_jit_read(struct gb_jit_asm *a) {
+     uint8_t *iram;
+     uint8_t *slow[2];
+     uint8_t *done;
+
+     gb_jit_flush_cycles(a);
+
+     iram = gb_jit_jump_iram_cc(a, GB_JIT_CC_B);
+     gb_jit_alu_imm(a, GB_JIT_ALU_CMP, GB_JIT_ESI, 0x8000);
+     slow[0] = gb_jit_jcc(a, GB_JIT_CC_AE);
+     gb_jit_patch(iram, a->p);
+     slow[1] = gb_jit_page_lookup(a, GB_JIT_OFF(memory.read_map));
+     /* movzbl (%rax, %rcx), %eax */
+     gb_jit_b(a, 0x0f);
+     gb_jit_b(a, 0xb6);
+     gb_jit_b(a, 0x04);
+     gb_jit_b(a, 0x08);
+     done = gb_jit_jmp(a);
+
+     gb_jit_patch(slow[0], a->p);
+     gb_jit_patch(slow[1], a->p);
+     gb_jit_call(a, gb_cpu_bus_readb);
+     gb_jit_movzx8(a, GB_JIT_EAX, GB_JIT_EAX);
+
+     gb_jit_patch(done, a->p);
+
+     a->pending++;
+}
+
+/* Write %dl to the address in %esi. Only internal RAM is written directly
+ * (when no DMA can see it), everything else goes through gb_cpu_bus_writeb.
+ * `rom` must be true if the address can be in the ROM area, where writes
+ * configure the cartridge mapper. */
+static void gb_jit_write(struct gb_jit_asm *a, bool rom) {
+     uint8_t *slow[4];
+     uint8_t *done;
+     unsigned i;
+
+     gb_jit_flush_cycles(a);
+
+     slow[0] = gb_jit_jump_iram_cc(a, GB_JIT_CC_AE);
+     gb_jit_cmp8_imm(a, GB_JIT_OFF(dma.running), 0);
+     slow[1] = gb_jit_jcc(a, GB_JIT_CC_NE);
+     gb_jit_cmp8_imm(a, GB_JIT_OFF(hdma.run_on_hblank), 0);
+     slow[2] = gb_jit_jcc(a, GB_JIT_CC_NE);
+     slow[3] = gb_jit_page_lookup(a, GB_JIT_OFF(memory.write_map));
+     /* mov %dl, (%rax, %rcx) */
+     gb_jit_b(a, 0x88);
+     gb_jit_b(a, 0x14);
+     gb_jit_b(a, 0x08);
+     done = gb_jit_jmp(a);
+
+     for (i = 0; i < 4; i++) {
+          gb_jit_patch(slow[i], a->p);
+     }
+     gb_jit_call(a, gb_cpu_bus_writeb);
+
+     gb_jit_patch(done, a->p);
+
+     a->pending++;
+     a->rom_write |= rom;
+}
+
+/* Read the byte at `addr` into %eax */
+static void gb_jit_read_const(struct gb_jit_asm *a, uint16_t addr) {
+     if (addr >= 0xff80 && addr < 0xffff) {
+          /* Zero page RAM */
+          gb_jit_load8(a, GB_JIT_EAX, GB_JIT_OFF(zram) + (addr - 0xff80));
+          a->pending++;
+          return;
+     }
+
+     gb_jit_mov_imm(a, GB_JIT_ESI, addr);
+     gb_jit_read(a);
+}
+
+/* Write %dl to `addr` */
+static void gb_jit_write_const(struct gb_jit_asm *a, uint16_t addr) {
+     if (addr >= 0xff80 && addr < 0xffff) {
+          /* Zero page RAM */
+          gb_jit_store8(a, GB_JIT_OFF(zram) + (addr - 0xff80), GB_JIT_EDX);
+          a->pending++;
+          return;
+     }
+
+     gb_jit_mov_imm(a, GB_JIT_ESI, addr);
+     gb_jit_write(a, addr < 0x8000);
+}
+
+/* Read the byte pointed to by the 16-bit register at `off` into %eax */
+static void gb_jit_read_reg16(struct gb_jit_asm *a, int32_t off) {
+     gb_jit_load16(a, GB_JIT_ESI, off);
+     gb_jit_read(a);
+}
+
+/* Write %dl to the address in the 16-bit register at `off` */
+static void gb_jit_write_reg16(struct gb_jit_asm *a, int32_t off) {
+     gb_jit_load16(a, GB_JIT_ESI, off);
+     gb_jit_write(a, true);
+}
+
+/* Push %dl on the stack */
+static void gb_jit_pushb(struct gb_jit_asm *a) {
+     gb_jit_incdec16(a, GB_JIT_OFF(cpu.sp), true);
+     gb_jit_write_reg16(a, GB_JIT_OFF(cpu.sp));
+}
+
+/* Pop a byte from the stack into %eax */
+static void gb_jit_popb(struct gb_jit_asm *a) {
+     gb_jit_read_reg16(a, GB_JIT_OFF(cpu.sp));
+     gb_jit_incdec16(a, GB_JIT_OFF(cpu.sp), false);
+}
+
+/* Push a constant return address */
+static void gb_jit_push_pc(struct gb_jit_asm *a, uint16_t pc) {
+     gb_jit_mov_imm(a, GB_JIT_EDX, pc >> 8);
+     gb_jit_pushb(a);
+     gb_jit_mov_imm(a, GB_JIT_EDX, pc & 0xff);
+     gb_jit_pushb(a);
+}
+
+/* Pop the return address into PC */
+static void gb_jit_pop_pc(struct gb_jit_asm *a) {
+     gb_jit_popb(a);
+     gb_jit_store8(a, GB_JIT_OFF(cpu.pc), GB_JIT_EAX);
+     gb_jit_popb(a);
+     gb_jit_store8(a, GB_JIT_OFF(cpu.pc) + 1, GB_JIT_EAX);
+}
+
+/*
+ * Flags
+ */
+
+/* Set the lazy flags from the result in %eax (16 bits) and the operands in
+ * %ecx and %edx (zero-extended bytes), see gb_cpu_set_alu_flags */
+static void gb_jit_set_alu_flags(struct gb_jit_asm *a, bool n) {
+     /* movzwl %ax, %eax */
+     gb_jit_b(a, 0x0f);
+     gb_jit_b(a, 0xb7);
+     gb_jit_b(a, 0xc0);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_ECX, 16);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 24);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_ECX);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_EDX);
+     gb_jit_store32(a, GB_JIT_OFF(cpu.f_res), GB_JIT_EAX);
+     gb_jit_store8_imm(a, GB_JIT_OFF(cpu.f_n), n);
+}
+
+/* Load the carry flag into %reg */
+static void gb_jit_get_carry(struct gb_jit_asm *a, unsigned reg) {
+     gb_jit_load8(a, reg, GB_JIT_OFF(cpu.f_res) + 1);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, reg, 1);
+}
+
+/* Load the value of the low byte of `f_res` when Z is unchanged (0 if Z is
+ * set, 1 otherwise, see gb_cpu_set_flags) into %reg */
+static void gb_jit_get_not_z(struct gb_jit_asm *a, unsigned reg) {
+     gb_jit_cmp8_imm(a, GB_JIT_OFF(cpu.f_res), 0);
+     gb_jit_setcc(a, GB_JIT_CC_NE, reg);
+}
+
+/* Jump if the condition `cc` of a conditional SM83 instruction (NZ, Z, NC,
+ * C) is false */
+static uint8_t *gb_jit_jump_unless(struct gb_jit_asm *a, unsigned cc) {
+     if (cc < 2) {
+          gb_jit_cmp8_imm(a, GB_JIT_OFF(cpu.f_res), 0);
+     } else {
+          gb_jit_test8_imm(a, GB_JIT_OFF(cpu.f_res) + 1, 1);
+     }
+
+     /* NZ and C are taken when the x86 ZF is clear, Z and NC when it's set */
+     return gb_jit_jcc(a, (cc == 0 || cc == 3) ? GB_JIT_CC_E : GB_JIT_CC_NE);
+}
+
+/*
+ * Instructions
+ */
+
+/* Load the 8-bit operand `r` into %edx */
+static void gb_jit_get_r8(struct gb_jit_asm *a, unsigned r) {
+     if (r == 6) {
+          gb_jit_read_reg16(a, GB_JIT_OFF(cpu.hl));
+          gb_jit_mov(a, GB_JIT_EDX, GB_JIT_EAX);
+     } else {
+          gb_jit_load8(a, GB_JIT_EDX, gb_jit_reg8[r]);
+     }
+}
+
+/* 8-bit ALU operation `op` (ADD, ADC, SUB, SBC, AND, XOR, OR, CP) between A
+ * and %edx */
+static void gb_jit_alu8(struct gb_jit_asm *a, unsigned op) {
+     gb_jit_load8(a, GB_JIT_EAX, GB_JIT_OFF(cpu.a));
+     gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+
+     switch (op) {
+     case 0:
+          gb_jit_alu(a, GB_JIT_ADD, GB_JIT_EAX, GB_JIT_EDX);
+          break;
+     case 1:
+          gb_jit_get_carry(a, GB_JIT_ESI);
+          gb_jit_alu(a, GB_JIT_ADD, GB_JIT_EAX, GB_JIT_EDX);
+          gb_jit_alu(a, GB_JIT_ADD, GB_JIT_EAX, GB_JIT_ESI);
+          break;
+     case 2:
+     case 7:
+          gb_jit_alu(a, GB_JIT_SUB, GB_JIT_EAX, GB_JIT_EDX);
+          break;
+     case 3:
+          gb_jit_get_carry(a, GB_JIT_ESI);
+          gb_jit_alu(a, GB_JIT_SUB, GB_JIT_EAX, GB_JIT_EDX);
+          gb_jit_alu(a, GB_JIT_SUB, GB_JIT_EAX, GB_JIT_ESI);
+          break;
+     case 4:
+          /* Half-carry is always set */
+          gb_jit_alu(a, GB_JIT_AND, GB_JIT_EAX, GB_JIT_EDX);
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_alu_imm(a, GB_JIT_ALU_XOR, GB_JIT_ECX, 0x10);
+          gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EDX, GB_JIT_EDX);
+          break;
+     case 5:
+          gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EAX, GB_JIT_EDX);
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EDX, GB_JIT_EDX);
+          break;
+     case 6:
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_EDX);
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EDX, GB_JIT_EDX);
+          break;
+     }
+
+     if (op != 7) {
+          gb_jit_store8(a, GB_JIT_OFF(cpu.a), GB_JIT_EAX);
+     }
+
+     gb_jit_set_alu_flags(a, op == 2 || op == 3 || op == 7);
+}
+
+/* Write the result of a read-modify-write (HL) instruction, found in the low
+ * byte of `f_res` */
+static void gb_jit_write_back_mhl(struct gb_jit_asm *a) {
+     gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.f_res));
+     gb_jit_write_reg16(a, GB_JIT_OFF(cpu.hl));
+}
+
+/* INC r or DEC r */
+static void gb_jit_incdec8(struct gb_jit_asm *a, unsigned r, bool dec) {
+     if (r == 6) {
+          gb_jit_read_reg16(a, GB_JIT_OFF(cpu.hl));
+     } else {
+          gb_jit_load8(a, GB_JIT_EAX, gb_jit_reg8[r]);
+     }
+
+     /* Carry is not modified */
+     gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+     gb_jit_alu_imm(a, dec ? GB_JIT_ALU_SUB : GB_JIT_ALU_ADD, GB_JIT_EAX, 1);
+     gb_jit_movzx8(a, GB_JIT_EAX, GB_JIT_EAX);
+     if (r != 6) {
+          gb_jit_store8(a, gb_jit_reg8[r], GB_JIT_EAX);
+     }
+     gb_jit_load16(a, GB_JIT_EDX, GB_JIT_OFF(cpu.f_res));
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EDX, 0x100);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_EDX);
+     gb_jit_mov_imm(a, GB_JIT_EDX, 1);
+     gb_jit_set_alu_flags(a, dec);
+
+     if (r == 6) {
+          gb_jit_write_back_mhl(a);
+     }
+}
+
+/* Rotate or shift `op` (RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL) of %eax. The
+ * result is left in %eax and the carry out in %ecx. */
+static void gb_jit_rotate(struct gb_jit_asm *a, unsigned op) {
+     switch (op) {
+     case 0:
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_ECX, 7);
+          gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EAX, 1);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_ECX);
+          gb_jit_movzx8(a, GB_JIT_EAX, GB_JIT_EAX);
+          break;
+     case 1:
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 1);
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_EAX, 1);
+          gb_jit_mov(a, GB_JIT_EDX, GB_JIT_ECX);
+          gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 7);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_EDX);
+          break;
+     case 2:
+          gb_jit_get_carry(a, GB_JIT_EDX);
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_ECX, 7);
+          gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EAX, 1);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_EDX);
+          gb_jit_movzx8(a, GB_JIT_EAX, GB_JIT_EAX);
+          break;
+     case 3:
+          gb_jit_get_carry(a, GB_JIT_EDX);
+          gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 7);
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 1);
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_EAX, 1);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_EDX);
+          break;
+     case 4:
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_ECX, 7);
+          gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EAX, 1);
+          gb_jit_movzx8(a, GB_JIT_EAX, GB_JIT_EAX);
+          break;
+     case 5:
+          /* Sign-extend */
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 1);
+          gb_jit_mov(a, GB_JIT_EDX, GB_JIT_EAX);
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EDX, 0x80);
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_EAX, 1);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_EDX);
+          break;
+     case 6:
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EAX, 4);
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_ECX, 4);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_ECX);
+          gb_jit_movzx8(a, GB_JIT_EAX, GB_JIT_EAX);
+          gb_jit_alu(a, GB_JIT_XOR, GB_JIT_ECX, GB_JIT_ECX);
+          break;
+     case 7:
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 1);
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_EAX, 1);
+          break;
+     }
+}
+
+/* RLCA, RRCA, RLA and RRA: same as their CB counterparts except that the
+ * flags are set as with gb_cpu_set_flags(0, 0, 0, c) */
+static void gb_jit_rotate_a(struct gb_jit_asm *a, unsigned op) {
+     gb_jit_load8(a, GB_JIT_EAX, GB_JIT_OFF(cpu.a));
+     gb_jit_rotate(a, op);
+     gb_jit_store8(a, GB_JIT_OFF(cpu.a), GB_JIT_EAX);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_ECX, 8);
+     gb_jit_alu_imm(a, GB_JIT_ALU_OR, GB_JIT_ECX, 1);
+     gb_jit_store32(a, GB_JIT_OFF(cpu.f_res), GB_JIT_ECX);
+     gb_jit_store8_imm(a, GB_JIT_OFF(cpu.f_n), 0);
+}
+
+/* 0xCB-prefixed instruction */
+static void gb_jit_cb(struct gb_jit_asm *a, uint8_t cb) {
+     unsigned r = cb & 7;
+     unsigned y = (cb >> 3) & 7;
+
+     if (r == 6) {
+          gb_jit_read_reg16(a, GB_JIT_OFF(cpu.hl));
+     } else {
+          gb_jit_load8(a, GB_JIT_EAX, gb_jit_reg8[r]);
+     }
+
+     switch (cb >> 6) {
+     case 0:
+          gb_jit_rotate(a, y);
+          if (r != 6) {
+               gb_jit_store8(a, gb_jit_reg8[r], GB_JIT_EAX);
+          }
+          /* f_res = c << 8 | v, f_op_a = v, f_op_b = 0 */
+          gb_jit_mov(a, GB_JIT_EDX, GB_JIT_EAX);
+          gb_jit_shift(a, GB_JIT_SHL, GB_JIT_ECX, 8);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_ECX);
+          gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EDX);
+          gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EDX, GB_JIT_EDX);
+          gb_jit_set_alu_flags(a, false);
+          if (r == 6) {
+               gb_jit_write_back_mhl(a);
+          }
+          return;
+     case 1:
+          /* BIT: Z is the complement of the bit, H set, C unchanged */
+          gb_jit_shift(a, GB_JIT_SHR, GB_JIT_EAX, y);
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EAX, 1);
+          gb_jit_load16(a, GB_JIT_ECX, GB_JIT_OFF(cpu.f_res));
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 0x100);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_ECX);
+          gb_jit_alu_imm(a, GB_JIT_ALU_OR, GB_JIT_EAX, 0x10 << 16);
+          gb_jit_store32(a, GB_JIT_OFF(cpu.f_res), GB_JIT_EAX);
+          gb_jit_store8_imm(a, GB_JIT_OFF(cpu.f_n), 0);
+          return;
+     case 2:
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EAX, ~(1U << y));
+          break;
+     case 3:
+          gb_jit_alu_imm(a, GB_JIT_ALU_OR, GB_JIT_EAX, 1U << y);
+          break;
+     }
+
+     /* RES and SET don't touch the flags */
+     if (r == 6) {
+          gb_jit_mov(a, GB_JIT_EDX, GB_JIT_EAX);
+          gb_jit_write_reg16(a, GB_JIT_OFF(cpu.hl));
+     } else {
+          gb_jit_store8(a, gb_jit_reg8[r], GB_JIT_EAX);
+     }
+}
+
+/* ADD SP, e and LD HL, SP + e: store SP + `e` in the register at `dst` */
+static void gb_jit_add_sp(struct gb_jit_asm *a, int32_t dst, int8_t e) {
+     gb_jit_load16(a, GB_JIT_EAX, GB_JIT_OFF(cpu.sp));
+     gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+     gb_jit_alu_imm(a, GB_JIT_ALU_ADD, GB_JIT_EAX, e);
+     gb_jit_store16(a, dst, GB_JIT_EAX);
+     /* Carry and half-carry are for the low byte, Z is cleared */
+     gb_jit_alu_imm(a, GB_JIT_ALU_XOR, GB_JIT_ECX, e);
+     gb_jit_alu(a, GB_JIT_XOR, GB_JIT_ECX, GB_JIT_EAX);
+     gb_jit_mov(a, GB_JIT_EDX, GB_JIT_ECX);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 0x100);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EDX, 0x10);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 16);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_ECX, GB_JIT_EDX);
+     gb_jit_alu_imm(a, GB_JIT_ALU_OR, GB_JIT_ECX, 1);
+     gb_jit_store32(a, GB_JIT_OFF(cpu.f_res), GB_JIT_ECX);
+     gb_jit_store8_imm(a, GB_JIT_OFF(cpu.f_n), 0);
+}
+
+/* ADD HL, rr */
+static void gb_jit_add_hl(struct gb_jit_asm *a, int32_t src) {
+     gb_jit_load16(a, GB_JIT_EAX, GB_JIT_OFF(cpu.hl));
+     gb_jit_load16(a, GB_JIT_ECX, src);
+     gb_jit_mov(a, GB_JIT_EDX, GB_JIT_EAX);
+     gb_jit_alu(a, GB_JIT_ADD, GB_JIT_EAX, GB_JIT_ECX);
+     gb_jit_store16(a, GB_JIT_OFF(cpu.hl), GB_JIT_EAX);
+     /* H from bit 12, C from bit 16, Z unchanged */
+     gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EDX, GB_JIT_ECX);
+     gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EDX, GB_JIT_EAX);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EDX, 0x1000);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 8);
+     gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+     gb_jit_shift(a, GB_JIT_SHR, GB_JIT_ECX, 8);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 0x100);
+     gb_jit_get_not_z(a, GB_JIT_EAX);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_ECX);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_EDX);
+     gb_jit_store32(a, GB_JIT_OFF(cpu.f_res), GB_JIT_EAX);
+     gb_jit_store8_imm(a, GB_JIT_OFF(cpu.f_n), 0);
+     a->pending++;
+}
+
+/* Compute the F register into %edx */
+static void gb_jit_get_f(struct gb_jit_asm *a) {
+     gb_jit_load16(a, GB_JIT_EAX, GB_JIT_OFF(cpu.f_res));
+     /* C */
+     gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 0x100);
+     gb_jit_shift(a, GB_JIT_SHR, GB_JIT_ECX, 4);
+     /* Z */
+     gb_jit_b(a, 0x84);                    /* test %al, %al */
+     gb_jit_b(a, 0xc0);
+     gb_jit_setcc(a, GB_JIT_CC_E, GB_JIT_EDX);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 7);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_ECX, GB_JIT_EDX);
+     /* N */
+     gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.f_n));
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 6);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_ECX, GB_JIT_EDX);
+     /* H */
+     gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.f_op_a));
+     gb_jit_load8(a, GB_JIT_ESI, GB_JIT_OFF(cpu.f_op_b));
+     gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EDX, GB_JIT_ESI);
+     gb_jit_alu(a, GB_JIT_XOR, GB_JIT_EDX, GB_JIT_EAX);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EDX, 0x10);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 1);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_EDX, GB_JIT_ECX);
+}
+
+/* Restore the flags from the F register value in %eax */
+static void gb_jit_set_f(struct gb_jit_asm *a) {
+     /* C */
+     gb_jit_mov(a, GB_JIT_ECX, GB_JIT_EAX);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 0x10);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_ECX, 4);
+     /* Z */
+     gb_jit_mov(a, GB_JIT_EDX, GB_JIT_EAX);
+     gb_jit_shift(a, GB_JIT_SHR, GB_JIT_EDX, 7);
+     gb_jit_alu_imm(a, GB_JIT_ALU_XOR, GB_JIT_EDX, 1);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_ECX, GB_JIT_EDX);
+     /* H */
+     gb_jit_mov(a, GB_JIT_EDX, GB_JIT_EAX);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EDX, 0x20);
+     gb_jit_shift(a, GB_JIT_SHL, GB_JIT_EDX, 15);
+     gb_jit_alu(a, GB_JIT_OR, GB_JIT_ECX, GB_JIT_EDX);
+     gb_jit_store32(a, GB_JIT_OFF(cpu.f_res), GB_JIT_ECX);
+     /* N */
+     gb_jit_shift(a, GB_JIT_SHR, GB_JIT_EAX, 6);
+     gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_EAX, 1);
+     gb_jit_store8(a, GB_JIT_OFF(cpu.f_n), GB_JIT_EAX);
+}
+
+/* Set IME to `enable` right away or, if `delayed` is true, after the next
+ * instruction */
+static void gb_jit_set_ime(struct gb_jit_asm *a, bool enable, bool delayed) {
+     if (!delayed) {
+          gb_jit_store8_imm(a, GB_JIT_OFF(cpu.irq_enable), enable);
+     }
+     gb_jit_store8_imm(a, GB_JIT_OFF(cpu.irq_enable_next), enable);
+     gb_jit_call(a, gb_irq_update_pending);
+}
+
+/* Taken JR at `pc` with offset `e` */
+static void gb_jit_jr(struct gb_jit_asm *a, uint16_t pc, int8_t e) {
+     uint16_t target = pc + 2 + e;
+
+     a->pending++;
+
+     if (e < 0) {
+          /* Backward jump, we may be spinning in a polling loop */
+          gb_jit_flush_cycles(a);
+          gb_jit_store16_imm(a, GB_JIT_OFF(cpu.pc), target);
+          gb_jit_mov_imm(a, GB_JIT_ESI, pc);
+          gb_jit_call(a, gb_cpu_idle_loop);
+     }
+
+     gb_jit_goto(a, target);
+}
+
+/* Returns false if `opcode` must be left to the interpreter */
+static bool gb_jit_supported(uint8_t opcode) {
+     switch (opcode) {
+     /* STOP, DAA, HALT */
+     case 0x10:
+     case 0x27:
+     case 0x76:
+     /* Undefined */
+     case 0xd3:
+     case 0xdb:
+     case 0xdd:
+     case 0xe3:
+     case 0xe4:
+     case 0xeb:
+     case 0xec:
+     case 0xed:
+     case 0xf4:
+     case 0xfc:
+     case 0xfd:
+          return false;
+     default:
+          return true;
+     }
+}
+
+/* Generate the code for the instruction `insn`. Returns true if the code
+ * falls through to the next instruction, false if it transfers control: it
+ * then returns to the main loop or loops back to the start of the block. */
+static bool gb_jit_insn(struct gb_jit_asm *a, const struct gb_jit_insn *insn) {
+     uint8_t op = insn->opcode;
+     uint8_t i8 = insn->operands[0];
+     uint16_t i16 = insn->operands[0] | (insn->operands[1] << 8);
+     uint16_t next_pc = insn->pc + gb_opcode_len[op];
+     unsigned r = op & 7;
+     unsigned y = (op >> 3) & 7;
+     unsigned rp = (op >> 4) & 3;
+     int32_t pending;
+     uint8_t *skip;
+
+     /* Opcode and operand fetches */
+     a->pending += gb_opcode_len[op];
+     a->rom_write = false;
+
+     if (op >= 0x40 && op < 0x80) {
+          /* LD r, r' */
+          if (r == 6) {
+               gb_jit_read_reg16(a, GB_JIT_OFF(cpu.hl));
+          } else {
+               gb_jit_load8(a, GB_JIT_EAX, gb_jit_reg8[r]);
+          }
+          if (y == 6) {
+               gb_jit_mov(a, GB_JIT_EDX, GB_JIT_EAX);
+               gb_jit_write_reg16(a, GB_JIT_OFF(cpu.hl));
+          } else {
+               gb_jit_store8(a, gb_jit_reg8[y], GB_JIT_EAX);
+          }
+          return true;
+     }
+
+     if (op >= 0x80 && op < 0xc0) {
+          /* ALU A, r */
+          gb_jit_get_r8(a, r);
+          gb_jit_alu8(a, y);
+          return true;
+     }
+
+     switch (op & 0xcf) {
+     case 0x01:
+          /* LD rr, i16 */
+          gb_jit_store16_imm(a, gb_jit_reg16[rp], i16);
+          return true;
+     case 0x03:
+     case 0x0b:
+          /* INC rr, DEC rr */
+          gb_jit_incdec16(a, gb_jit_reg16[rp], op & 0x08);
+          a->pending++;
+          return true;
+     case 0x09:
+          gb_jit_add_hl(a, gb_jit_reg16[rp]);
+          return true;
+     case 0xc1:
+          /* POP rr */
+          gb_jit_popb(a);
+          if (rp == 3) {
+               gb_jit_set_f(a);
+          } else {
+               gb_jit_store8(a, gb_jit_reg8[rp * 2 + 1], GB_JIT_EAX);
+          }
+          gb_jit_popb(a);
+          gb_jit_store8(a, rp == 3 ? GB_JIT_OFF(cpu.a) : gb_jit_reg8[rp * 2],
+                        GB_JIT_EAX);
+          return true;
+     case 0xc5:
+          /* PUSH rr */
+          gb_jit_load8(a, GB_JIT_EDX,
+                       rp == 3 ? GB_JIT_OFF(cpu.a) : gb_jit_reg8[rp * 2]);
+          gb_jit_pushb(a);
+          if (rp == 3) {
+               gb_jit_get_f(a);
+          } else {
+               gb_jit_load8(a, GB_JIT_EDX, gb_jit_reg8[rp * 2 + 1]);
+          }
+          gb_jit_pushb(a);
+          a->pending++;
+          return true;
+     }
+
+     switch (op & 0xc7) {
+     case 0x04:
+     case 0x05:
+          /* INC r, DEC r */
+          gb_jit_incdec8(a, y, op & 1);
+          return true;
+     case 0x06:
+          /* LD r, i8 */
+          if (y == 6) {
+               gb_jit_mov_imm(a, GB_JIT_EDX, i8);
+               gb_jit_write_reg16(a, GB_JIT_OFF(cpu.hl));
+          } else {
+               gb_jit_store8_imm(a, gb_jit_reg8[y], i8);
+          }
+          return true;
+     case 0xc6:
+          /* ALU A, i8 */
+          gb_jit_mov_imm(a, GB_JIT_EDX, i8);
+          gb_jit_alu8(a, y);
+          return true;
+     case 0xc7:
+          /* RST */
+          gb_jit_push_pc(a, next_pc);
+          a->pending++;
+          gb_jit_goto(a, op & 0x38);
+          return false;
+     }
+
+     switch (op & 0xe7) {
+     case 0x20:
+     case 0xc0:
+     case 0xc2:
+     case 0xc4:
+          /* Conditional JR, RET, JP and CALL */
+          skip = gb_jit_jump_unless(a, (op >> 3) & 3);
+          pending = a->pending;
+
+          switch (op & 0xe7) {
+          case 0x20:
+               gb_jit_jr(a, insn->pc, i8);
+               break;
+          case 0xc0:
+               gb_jit_pop_pc(a);
+               a->pending += 2;
+               gb_jit_flush_cycles(a);
+               gb_jit_ret(a);
+               break;
+          case 0xc2:
+               a->pending++;
+               gb_jit_goto(a, i16);
+               break;
+          case 0xc4:
+               gb_jit_push_pc(a, next_pc);
+               a->pending++;
+               gb_jit_goto(a, i16);
+               break;
+          }
+
+          /* Condition false */
+          gb_jit_patch(skip, a->p);
+          a->pending = pending;
+          if ((op & 0xe7) == 0xc0) {
+               a->pending++;
+          }
+          gb_jit_goto(a, next_pc);
+          return false;
+     }
+
+     switch (op) {
+     case 0x00:
+          /* NOP */
+          return true;
+     case 0x02:
+     case 0x12:
+          /* LD (BC), A and LD (DE), A */
+          gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.a));
+          gb_jit_write_reg16(a, gb_jit_reg16[rp]);
+          return true;
+     case 0x22:
+     case 0x32:
+          /* LDI (HL), A and LDD (HL), A */
+          gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.a));
+          gb_jit_write_reg16(a, GB_JIT_OFF(cpu.hl));
+          gb_jit_incdec16(a, GB_JIT_OFF(cpu.hl), op == 0x32);
+          return true;
+     case 0x0a:
+     case 0x1a:
+          /* LD A, (BC) and LD A, (DE) */
+          gb_jit_read_reg16(a, gb_jit_reg16[rp]);
+          gb_jit_store8(a, GB_JIT_OFF(cpu.a), GB_JIT_EAX);
+          return true;
+     case 0x2a:
+     case 0x3a:
+          /* LDI A, (HL) and LDD A, (HL) */
+          gb_jit_read_reg16(a, GB_JIT_OFF(cpu.hl));
+          gb_jit_store8(a, GB_JIT_OFF(cpu.a), GB_JIT_EAX);
+          gb_jit_incdec16(a, GB_JIT_OFF(cpu.hl), op == 0x3a);
+          return true;
+     case 0x07:
+     case 0x0f:
+     case 0x17:
+     case 0x1f:
+          /* RLCA, RRCA, RLA, RRA */
+          gb_jit_rotate_a(a, y);
+          return true;
+     case 0x08:
+          /* LD (i16), SP */
+          gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.sp));
+          gb_jit_write_const(a, i16);
+          gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.sp) + 1);
+          gb_jit_write_const(a, i16 + 1);
+          return true;
+     case 0x18:
+          gb_jit_jr(a, insn->pc, i8);
+          return false;
+     case 0x2f:
+          /* CPL: N and H set, Z and C unchanged */
+          gb_jit_load8(a, GB_JIT_EAX, GB_JIT_OFF(cpu.a));
+          gb_jit_alu_imm(a, GB_JIT_ALU_XOR, GB_JIT_EAX, 0xff);
+          gb_jit_store8(a, GB_JIT_OFF(cpu.a), GB_JIT_EAX);
+          gb_jit_load16(a, GB_JIT_ECX, GB_JIT_OFF(cpu.f_res));
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 0x100);
+          gb_jit_get_not_z(a, GB_JIT_EAX);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_ECX);
+          gb_jit_alu_imm(a, GB_JIT_ALU_OR, GB_JIT_EAX, 0x10 << 16);
+          gb_jit_store32(a, GB_JIT_OFF(cpu.f_res), GB_JIT_EAX);
+          gb_jit_store8_imm(a, GB_JIT_OFF(cpu.f_n), 1);
+          return true;
+     case 0x37:
+     case 0x3f:
+          /* SCF and CCF: Z unchanged */
+          gb_jit_load16(a, GB_JIT_ECX, GB_JIT_OFF(cpu.f_res));
+          gb_jit_alu_imm(a, GB_JIT_ALU_AND, GB_JIT_ECX, 0x100);
+          if (op == 0x37) {
+               gb_jit_alu_imm(a, GB_JIT_ALU_OR, GB_JIT_ECX, 0x100);
+          } else {
+               gb_jit_alu_imm(a, GB_JIT_ALU_XOR, GB_JIT_ECX, 0x100);
+          }
+          gb_jit_get_not_z(a, GB_JIT_EAX);
+          gb_jit_alu(a, GB_JIT_OR, GB_JIT_EAX, GB_JIT_ECX);
+          gb_jit_store32(a, GB_JIT_OFF(cpu.f_res), GB_JIT_EAX);
+          gb_jit_store8_imm(a, GB_JIT_OFF(cpu.f_n), 0);
+          return true;
+     case 0xc3:
+          /* JP i16 */
+          a->pending++;
+          gb_jit_goto(a, i16);
+          return false;
+     case 0xc9:
+     case 0xd9:
+          /* RET and RETI */
+          gb_jit_pop_pc(a);
+          a->pending++;
+          if (op == 0xd9) {
+               gb_jit_set_ime(a, true, false);
+          }
+          gb_jit_flush_cycles(a);
+          gb_jit_ret(a);
+          return false;
+     case 0xcb:
+          gb_jit_cb(a, i8);
+          return true;
+     case 0xcd:
+          /* CALL i16 */
+          gb_jit_push_pc(a, next_pc);
+          a->pending++;
+          gb_jit_goto(a, i16);
+          return false;
+     case 0xe0:
+          /* LDH (i8), A */
+          gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.a));
+          gb_jit_write_const(a, 0xff00 | i8);
+          return true;
+     case 0xf0:
+          /* LDH A, (i8) */
+          gb_jit_read_const(a, 0xff00 | i8);
+          gb_jit_store8(a, GB_JIT_OFF(cpu.a), GB_JIT_EAX);
+          return true;
+     case 0xe2:
+     case 0xf2:
+          /* LD (C), A and LD A, (C) */
+          gb_jit_load8(a, GB_JIT_ESI, GB_JIT_OFF(cpu.c));
+          gb_jit_alu_imm(a, GB_JIT_ALU_OR, GB_JIT_ESI, 0xff00);
+          if (op == 0xe2) {
+               gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.a));
+               gb_jit_write(a, false);
+          } else {
+               gb_jit_read(a);
+               gb_jit_store8(a, GB_JIT_OFF(cpu.a), GB_JIT_EAX);
+          }
+          return true;
+     case 0xea:
+          /* LD (i16), A */
+          gb_jit_load8(a, GB_JIT_EDX, GB_JIT_OFF(cpu.a));
+          gb_jit_write_const(a, i16);
+          return true;
+     case 0xfa:
+          /* LD A, (i16) */
+          gb_jit_read_const(a, i16);
+          gb_jit_store8(a, GB_JIT_OFF(cpu.a), GB_JIT_EAX);
+          return true;
+     case 0xe8:
+          /* ADD SP, e */
+          gb_jit_add_sp(a, GB_JIT_OFF(cpu.sp), i8);
+          a->pending += 2;
+          return true;
+     case 0xf8:
+          /* LD HL, SP + e */
+          gb_jit_add_sp(a, GB_JIT_OFF(cpu.hl), i8);
+          a->pending++;
+          return true;
+     case 0xe9:
+          /* JP HL, no additional delay */
+          gb_jit_flush_cycles(a);
+          gb_jit_load16(a, GB_JIT_EAX, GB_JIT_OFF(cpu.hl));
+          gb_jit_store16(a, GB_JIT_OFF(cpu.pc), GB_JIT_EAX);
+          gb_jit_ret(a);
+          return false;
+     case 0xf9:
+          /* LD SP, HL */
+          gb_jit_load16(a, GB_JIT_EAX, GB_JIT_OFF(cpu.hl));
+          gb_jit_store16(a, GB_JIT_OFF(cpu.sp), GB_JIT_EAX);
+          a->pending++;
+          return true;
+     case 0xf3:
+          /* DI */
+          gb_jit_set_ime(a, false, false);
+          return true;
+     case 0xfb:
+          /* EI, interrupts are re-enabled after the *next* instruction */
+          gb_jit_set_ime(a, true, true);
+          return true;
+     }
+
+     /* gb_jit_supported let through something we don't know about */
+     assert(0);
+     return false;
+}
+
+/* Make the part of the code buffer spanning `len` bytes at `off` writable or
+ * executable */
+static void gb_jit_protect(struct gb_jit *jit,
+                           size_t off, size_t len, int prot) {
+     size_t start = off & ~(jit->page_size - 1);
+     size_t end = (off + len + jit->page_size - 1) & ~(jit->page_size - 1);
+
+     if (end > GB_JIT_CODE_SIZE) {
+          end = GB_JIT_CODE_SIZE;
+     }
+
+     if (mprotect(jit->code + start, end - start, prot) != 0) {
+          perror("Can't change the protection of the JIT buffer");
+          die();
+     }
+}
+
+/* Decode and compile the block starting at the current PC. Returns false if
+ * nothing could be compiled. */
+static bool gb_jit_compile(struct gb *gb, struct gb_jit_block *b) {
+     struct gb_jit *jit = &gb->jit;
+     struct gb_jit_insn insns[GB_JIT_MAX_BLOCK_LEN];
+     struct gb_jit_asm asm_state;
+     struct gb_jit_asm *a = &asm_state;
+     uint32_t rom_off = b->rom_off;
+     uint16_t pc = gb->cpu.pc;
+     uint16_t window = pc & ~(GB_ROM_BANK_SIZE - 1);
+     bool fall_through = true;
+     size_t len;
+     unsigned n;
+     unsigned i;
+
+     for (n = 0; n < GB_JIT_MAX_BLOCK_LEN; n++) {
+          const struct gb_cpu_decoded *d;
+
+          if ((pc & ~(GB_ROM_BANK_SIZE - 1)) != window) {
+               break;
+          }
+
+          d = gb_cpu_decode(gb, pc);
+          if (d == NULL || !gb_jit_supported(d->opcode)) {
+               /* End of the ROM bank or instruction we leave to the
+                * interpreter */
+               break;
+          }
+
+          insns[n].pc = pc;
+          insns[n].opcode = d->opcode;
+          insns[n].operands[0] = d->operands[0];
+          insns[n].operands[1] = d->operands[1];
+
+          pc = (pc + gb_opcode_len[d->opcode]) & 0xffff;
+
+          if (gb_opcode_ends_block(d->opcode)) {
+               n++;
+               break;
+          }
+     }
+
+     if (n == 0) {
+          return false;
+     }
+
+     if (jit->code_len + GB_JIT_MAX_BLOCK_CODE > GB_JIT_CODE_SIZE) {
+          /* We're out of space, start over */
+          gb_jit_flush(gb);
+          b->rom_off = rom_off;
+     }
+
+     gb_jit_protect(jit, jit->code_len, GB_JIT_MAX_BLOCK_CODE,
+                    PROT_READ | PROT_WRITE);
+
+     a->p = jit->code + jit->code_len;
+     a->pending = 0;
+     a->mcycle_duration = gb->mcycle_duration;
+     a->start_pc = gb->cpu.pc;
+     a->banked = (window != 0);
+     a->bank_off = gb->cart.rom_bank_off;
+     a->rom_write = false;
+     a->nexits = 0;
+     a->nsyncs = 0;
+
+     /* push %rbx ; mov %rdi, %rbx */
+     gb_jit_b(a, 0x53);
+     gb_jit_b(a, 0x48);
+     gb_jit_b(a, 0x89);
+     gb_jit_b(a, 0xfb);
+
+     a->body = a->p;
+
+     for (i = 0; i < n; i++) {
+          fall_through = gb_jit_insn(a, &insns[i]);
+
+          if (i + 1 < n) {
+               gb_jit_boundary(a, insns[i + 1].pc);
+          }
+     }
+
+     if (fall_through) {
+          /* Let the main loop run the next instruction */
+          gb_jit_flush_cycles(a);
+          gb_jit_store16_imm(a, GB_JIT_OFF(cpu.pc), pc);
+          gb_jit_ret(a);
+     }
+
+     gb_jit_emit_stubs(a);
+
+     len = a->p - (jit->code + jit->code_len);
+     assert(len <= GB_JIT_MAX_BLOCK_CODE);
+
+     gb_jit_protect(jit, jit->code_len, len, PROT_READ | PROT_EXEC);
+
+     b->code = (void (*)(struct gb *))(jit->code + jit->code_len);
+     b->mcycle_duration = gb->mcycle_duration;
+
+     /* Keep the blocks 16-byte aligned */
+     jit->code_len += (len + 15) & ~(size_t)15;
+
+     return true;
+}
+
+#else /* __x86_64__ */
+
+static bool gb_jit_compile(struct gb *gb, struct gb_jit_block *b) {
+     /* Unsupported architecture, we never get here since the JIT can't be
+      * enabled */
+     return false;
+}
+
+#endif /* __x86_64__ */
+
+bool gb_jit_run(struct gb *gb) {
+     struct gb_jit *jit = &gb->jit;
+     const struct gb_cpu_decoded *d;
+     struct gb_jit_block *b;
+
+     if (!jit->enabled) {
+          return false;
+     }
+
+     d = gb_cpu_decode(gb, gb->cpu.pc);
+     if (d == NULL) {
+          /* Not running from ROM */
+          return false;
+     }
+
+     b = &jit->blocks[gb->cpu.pc & (GB_JIT_BLOCK_MAP_SIZE - 1)];
+
+     if (b->rom_off != d->rom_off ||
+         (b->code != NULL && b->mcycle_duration != gb->mcycle_duration)) {
+          /* Evict the previous occupant or the code compiled before a speed
+           * switch */
+          gb_jit_free_block(b);
+          b->rom_off = d->rom_off;
+     }
+
+     if (b->code == NULL) {
+          b->hits++;
+          if (b->hits < GB_JIT_HOT_THRESHOLD) {
+               return false;
+          }
+
+          b->hits = 0;
+
+          if (!gb_jit_compile(gb, b)) {
+               return false;
+          }
+     }
+
+     b->code(gb);
+
+     return true;
+}
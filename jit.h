@@ -0,0 +1,53 @@
+#ifndef _GB_JIT_H_
+#define _GB_JIT_H_
+
+/* Number of entries in the block map. Blocks are looked up by CPU address,
+ * like the decode cache, and tagged with their ROM offset. */
+#define GB_JIT_BLOCK_MAP_SIZE 0x8000
+
+/* Size of the buffer holding the generated code. When it's full we flush
+ * everything and start over. */
+#define GB_JIT_CODE_SIZE (8U * 1024 * 1024)
+
+/* Number of times the interpreter must reach the start of a block before we
+ * bother recompiling it */
+#define GB_JIT_HOT_THRESHOLD 16
+
+/* Maximum number of instructions in a single block */
+#define GB_JIT_MAX_BLOCK_LEN 32
+
+/* Value of `rom_off` for unused blocks */
+#define GB_JIT_BLOCK_INVALID 0xffffffffU
+
+struct gb_jit_block {
+     /* ROM offset of the first instruction of the block */
+     uint32_t rom_off;
+     /* How many times the block has been reached while not compiled */
+     unsigned hits;
+     /* Machine cycle duration baked into `code`. The block must be
+      * recompiled after a speed switch. */
+     int32_t mcycle_duration;
+     /* Native code for the block or NULL if it hasn't been compiled yet */
+     void (*code)(struct gb *gb);
+};
+
+struct gb_jit {
+     /* True if the recompiler is used, false if we only run the
+      * interpreter */
+     bool enabled;
+     /* Buffer holding the generated code. It's only writable while we
+      * generate a block, executable the rest of the time. */
+     uint8_t *code;
+     /* Number of bytes used in `code` */
+     size_t code_len;
+     /* Host page size, the granularity of the protection changes */
+     size_t page_size;
+     /* Block map, GB_JIT_BLOCK_MAP_SIZE entries */
+     struct gb_jit_block *blocks;
+};
+
+void gb_jit_init(struct gb *gb, bool enable);
+void gb_jit_destroy(struct gb *gb);
+bool gb_jit_run(struct gb *gb);
+
+#endif /* _GB_JIT_H_ */
@@ -5,21 +5,46 @@
 
 int main(int argc, char **argv) {
      struct gb *gb;
-     const char *rom_file;
+     const char *rom_file = NULL;
+     const char *aot_file = NULL;
+     bool use_jit = false;
+     bool frameskip = false;
      unsigned i;
 
-     if (argc < 2) {
-          fprintf(stderr, "Usage: %s <rom>\n", argv[0]);
+     for (i = 1; i < (unsigned)argc; i++) {
+          if (strcmp(argv[i], "--jit") == 0) {
+               /* Recompile the hot code running from ROM to native code */
+               use_jit = true;
+          } else if (strcmp(argv[i], "--frameskip") == 0) {
+               /* Skip frames when we can't keep up with real time to avoid
+                * audio dropouts on slow hosts */
+               frameskip = true;
+          } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < (unsigned)argc) {
+               /* Object generated by gaembuoy-recomp */
+               aot_file = argv[++i];
+          } else {
+               rom_file = argv[i];
+          }
+     }
+
+     if (rom_file == NULL) {
+          fprintf(stderr,
+                  "Usage: %s [--jit] [--frameskip] [--aot <image.so>] "
+                  "<rom>\n",
+                  argv[0]);
           return EXIT_FAILURE;
      }
 
      /* Our context contains semaphores, so we allocate it on the heap so that
-      * it remains visible to all threads no matter what. */
-     gb = calloc(1, sizeof(*gb));
+      * it remains visible to all threads no matter what. It's aligned on a
+      * cache line boundary so that its hot part spans as few lines as
+      * possible. */
+     gb = aligned_alloc(GB_CACHE_LINE, sizeof(*gb));
      if (gb == NULL) {
-          perror("calloc failed");
+          perror("aligned_alloc failed");
           return EXIT_FAILURE;
      }
+     memset(gb, 0, sizeof(*gb));
 
      /* Initialize the semaphores before we start the frontend */
      for (i = 0; i < GB_SPU_SAMPLE_BUFFER_COUNT; i++) {
@@ -36,22 +61,25 @@ int main(int argc, char **argv) {
 
      gb_sdl_frontend_init(gb);
 
-     rom_file = argv[1];
-
      gb_cart_load(gb, rom_file);
      gb_sync_reset(gb);
      gb_irq_reset(gb);
      gb_cpu_reset(gb);
+     gb_jit_init(gb, use_jit);
+     if (aot_file) {
+          gb_aot_load(gb, aot_file);
+     }
      gb_gpu_reset(gb);
+     gb_gpu_set_frameskip(gb, frameskip);
      gb_input_reset(gb);
      gb_dma_reset(gb);
      gb_timer_reset(gb);
      gb_spu_reset(gb);
+     gb_memory_reset(gb);
 
-     gb->iram_high_bank = 1;
-     gb->vram_high_bank = false;
      gb->quit = false;
      gb->double_speed = false;
+     gb->mcycle_duration = 4;
      gb->speed_switch_pending = false;
 
      while (!gb->quit) {
@@ -63,6 +91,9 @@ int main(int argc, char **argv) {
      }
 
      gb->frontend.destroy(gb);
+     gb_aot_unload(gb);
+     gb_jit_destroy(gb);
+     gb_cpu_destroy(gb);
      gb_cart_unload(gb);
 
      free(gb);
@@ -19,6 +19,8 @@
 /* Object Attribute Memory (sprite configuration) */
 #define OAM_BASE        0xfe00U
 #define OAM_END         (OAM_BASE + 0xa0U)
+/* I/O registers, zero page RAM and IE */
+#define IO_BASE         0xff00U
 /* Zero page RAM */
 #define ZRAM_BASE       0xff80U
 #define ZRAM_END        (ZRAM_BASE + 0x7fU)
@@ -136,859 +138,1016 @@ static uint16_t gb_memory_iram_off(struct gb *gb, uint16_t off) {
      return off;
 }
 
-/* Read one byte from memory at `addr` */
-uint8_t gb_memory_readb(struct gb *gb, uint16_t addr) {
-     if (addr >= ROM_BASE && addr < ROM_END) {
-          return gb_cart_rom_readb(gb, addr - ROM_BASE);
-     }
+/* Map the VRAM bank currently selected through VBK. VRAM writes have to go
+ * through the slow path in order to sync the GPU first. */
+static void gb_memory_map_vram(struct gb *gb) {
+     struct gb_memory *mem = &gb->memory;
+     unsigned p;
+
+     for (p = VRAM_BASE >> 8; p < VRAM_END >> 8; p++) {
+          unsigned off = p * GB_MEMORY_PAGE_SIZE - VRAM_BASE;
+
+          off += 0x2000 * gb->vram_high_bank;
 
-     if (addr >= ZRAM_BASE && addr < ZRAM_END) {
-          return gb->zram[addr - ZRAM_BASE];
+          mem->read_map[p] = &gb->vram[off];
      }
+}
 
-     if (addr >= IRAM_BASE && addr < IRAM_END) {
-          uint16_t off = gb_memory_iram_off(gb, addr - IRAM_BASE);
+/* Map the internal RAM, using the high bank currently selected through
+ * SVBK */
+static void gb_memory_map_iram(struct gb *gb) {
+     struct gb_memory *mem = &gb->memory;
+     unsigned p;
 
-          return gb->iram[off];
+     for (p = IRAM_BASE >> 8; p < IRAM_END >> 8; p++) {
+          uint16_t off = gb_memory_iram_off(gb, p * GB_MEMORY_PAGE_SIZE -
+                                            IRAM_BASE);
+
+          mem->read_map[p] = &gb->iram[off];
+          mem->write_map[p] = &gb->iram[off];
      }
 
-     if (addr >= IRAM_ECHO_BASE && addr < IRAM_ECHO_END) {
-          uint16_t off = gb_memory_iram_off(gb, addr - IRAM_ECHO_BASE);
+     for (p = IRAM_ECHO_BASE >> 8; p < IRAM_ECHO_END >> 8; p++) {
+          uint16_t off = gb_memory_iram_off(gb, p * GB_MEMORY_PAGE_SIZE -
+                                            IRAM_ECHO_BASE);
 
-          return gb->iram[off];
+          mem->read_map[p] = &gb->iram[off];
+          mem->write_map[p] = &gb->iram[off];
      }
 
-     if (addr >= VRAM_BASE && addr < VRAM_END) {
-          uint16_t off = addr - VRAM_BASE;
+     /* The CPU may be fetching from the previous bank */
+     gb->cpu.fetch_ptr = NULL;
+}
 
-          off += 0x2000 * gb->vram_high_bank;
+/* Map the switchable ROM bank and the cartridge RAM. Must be called every time
+ * the mapper configuration changes. Writes to both regions have to go through
+ * the slow path since they're handled by the mapper. */
+void gb_memory_map_cart(struct gb *gb) {
+     struct gb_memory *mem = &gb->memory;
+     struct gb_cart *cart = &gb->cart;
+     unsigned p;
 
-          return gb->vram[off];
-     }
+     for (p = GB_ROM_BANK_SIZE >> 8; p < ROM_END >> 8; p++) {
+          unsigned off = p * GB_MEMORY_PAGE_SIZE - GB_ROM_BANK_SIZE;
 
-     if (addr >= CRAM_BASE && addr < CRAM_END) {
-          return gb_cart_ram_readb(gb, addr - CRAM_BASE);
+          mem->read_map[p] = &cart->rom[cart->rom_bank_off + off];
      }
 
-     if (addr >= OAM_BASE && addr < OAM_END) {
-          return gb->gpu.oam[addr - OAM_BASE];
+     for (p = CRAM_BASE >> 8; p < CRAM_END >> 8; p++) {
+          mem->read_map[p] = gb_cart_ram_map(gb, p * GB_MEMORY_PAGE_SIZE -
+                                             CRAM_BASE);
      }
 
-     if (addr == REG_INPUT) {
-          return gb_input_get_state(gb);
-     }
+     /* The CPU may be fetching from the previous bank */
+     gb->cpu.fetch_ptr = NULL;
+}
 
-     if (addr == REG_SB) {
-          /* XXX TODO */
-          return 0xff;
-     }
+/*
+ * I/O registers
+ *
+ * Accesses to 0xff00-0xffff are dispatched through per-register tables built
+ * at reset, with a different set of registers on DMG and GBC. Registers that
+ * can be accessed without any side effect point directly to their storage.
+ */
 
-     if (addr == REG_SC) {
-          /* XXX TODO */
-          return 0;
-     }
+static uint8_t gb_memory_read_input(struct gb *gb, uint16_t addr) {
+     return gb_input_get_state(gb);
+}
 
-     if (addr == REG_DIV) {
-          gb_timer_sync(gb);
-          /* Return the high 8 bits of the divider counter */
-          return gb->timer.divider_counter >> 8;
-     }
+static uint8_t gb_memory_read_sb(struct gb *gb, uint16_t addr) {
+     /* XXX TODO */
+     return 0xff;
+}
 
-     if (addr == REG_TIMA) {
-          gb_timer_sync(gb);
-          return gb->timer.counter;
-     }
+static uint8_t gb_memory_read_sc(struct gb *gb, uint16_t addr) {
+     /* XXX TODO */
+     return 0;
+}
 
-     if (addr == REG_TMA) {
-          return gb->timer.modulo;
-     }
+static uint8_t gb_memory_read_div(struct gb *gb, uint16_t addr) {
+     return gb_timer_get_div(gb);
+}
 
-     if (addr == REG_TAC) {
-          return gb_timer_get_config(gb);
-     }
+static uint8_t gb_memory_read_tima(struct gb *gb, uint16_t addr) {
+     gb_timer_sync(gb);
+     return gb->timer.counter;
+}
 
-     if (addr == REG_IF) {
-          return gb->irq.irq_flags;
-     }
+static uint8_t gb_memory_read_tac(struct gb *gb, uint16_t addr) {
+     return gb_timer_get_config(gb);
+}
 
-     if (addr == REG_NR10) {
-          uint8_t r = 0x80;
+static uint8_t gb_memory_read_nr10(struct gb *gb, uint16_t addr) {
+     uint8_t r = 0x80;
 
-          r |= gb->spu.nr1.sweep.shift;
-          r |= gb->spu.nr1.sweep.subtract << 3;
-          r |= gb->spu.nr1.sweep.time << 4;
+     r |= gb->spu.nr1.sweep.shift;
+     r |= gb->spu.nr1.sweep.subtract << 3;
+     r |= gb->spu.nr1.sweep.time << 4;
 
-          return r;
-     }
+     return r;
+}
 
-     if (addr == REG_NR11) {
-          return (gb->spu.nr1.wave.duty_cycle << 6) | 0x3f;
-     }
+static uint8_t gb_memory_read_nr11(struct gb *gb, uint16_t addr) {
+     return (gb->spu.nr1.wave.duty_cycle << 6) | 0x3f;
+}
 
-     if (addr == REG_NR12) {
-          return gb->spu.nr1.envelope_config;
-     }
+static uint8_t gb_memory_read_nr13(struct gb *gb, uint16_t addr) {
+     /* Write-only */
+     return 0xff;
+}
 
-     if (addr == REG_NR13) {
-          /* Write-only */
-          return 0xff;
-     }
+static uint8_t gb_memory_read_nr14(struct gb *gb, uint16_t addr) {
+     return (gb->spu.nr1.duration.enable << 6) | 0xbf;
+}
 
-     if (addr == REG_NR14) {
-          return (gb->spu.nr1.duration.enable << 6) | 0xbf;
-     }
+static uint8_t gb_memory_read_nr21(struct gb *gb, uint16_t addr) {
+     return (gb->spu.nr2.wave.duty_cycle << 6) | 0x3f;
+}
 
-     if (addr == REG_NR21) {
-          return (gb->spu.nr2.wave.duty_cycle << 6) | 0x3f;
-     }
+static uint8_t gb_memory_read_nr23(struct gb *gb, uint16_t addr) {
+     /* Write-only */
+     return 0xff;
+}
 
-     if (addr == REG_NR22) {
-          return gb->spu.nr2.envelope_config;
-     }
+static uint8_t gb_memory_read_nr24(struct gb *gb, uint16_t addr) {
+     return (gb->spu.nr2.duration.enable << 6) | 0xbf;
+}
 
-     if (addr == REG_NR23) {
-          /* Write-only */
-          return 0xff;
-     }
+static uint8_t gb_memory_read_nr30(struct gb *gb, uint16_t addr) {
+     gb_spu_sync(gb);
+     return (gb->spu.nr3.enable << 7) | 0x7f;
+}
 
-     if (addr == REG_NR24) {
-          return (gb->spu.nr2.duration.enable << 6) | 0xbf;
-     }
+static uint8_t gb_memory_read_nr32(struct gb *gb, uint16_t addr) {
+     return (gb->spu.nr3.volume_shift << 5) | 0x9f;
+}
 
-     if (addr == REG_NR30) {
-          gb_spu_sync(gb);
-          return (gb->spu.nr3.enable << 7) | 0x7f;
-     }
+static uint8_t gb_memory_read_nr33(struct gb *gb, uint16_t addr) {
+     /* Write-only */
+     return 0xff;
+}
 
-     if (addr == REG_NR31) {
-          return gb->spu.nr3.t1;
-     }
+static uint8_t gb_memory_read_nr34(struct gb *gb, uint16_t addr) {
+     return (gb->spu.nr3.duration.enable << 6) | 0xbf;
+}
 
-     if (addr == REG_NR32) {
-          return (gb->spu.nr3.volume_shift << 5) | 0x9f;
-     }
+static uint8_t gb_memory_read_nr41(struct gb *gb, uint16_t addr) {
+     /* Read-only */
+     return 0xff;
+}
 
-     if (addr == REG_NR33) {
-          /* Write-only */
-          return 0xff;
-     }
+static uint8_t gb_memory_read_nr44(struct gb *gb, uint16_t addr) {
+     return (gb->spu.nr4.duration.enable << 6) | 0xbf;
+}
 
-     if (addr == REG_NR34) {
-          return (gb->spu.nr3.duration.enable << 6) | 0xbf;
-     }
+static uint8_t gb_memory_read_nr52(struct gb *gb, uint16_t addr) {
+     uint8_t r = 0;
 
-     if (addr == REG_NR41) {
-          /* Read-only */
-          return 0xff;
-     }
+     r |= gb->spu.nr2.running << 1;
+     r |= gb->spu.nr3.running << 2;
+     r |= gb->spu.enable << 7;
 
-     if (addr == REG_NR42) {
-          return gb->spu.nr4.envelope_config;
-     }
+     return r;
+}
 
-     if (addr == REG_NR43) {
-          return gb->spu.nr4.lfsr_config;
-     }
+static uint8_t gb_memory_read_lcdc(struct gb *gb, uint16_t addr) {
+     return gb_gpu_get_lcdc(gb);
+}
 
-     if (addr == REG_NR44) {
-          return (gb->spu.nr4.duration.enable << 6) | 0xbf;
-     }
+static uint8_t gb_memory_read_lcd_stat(struct gb *gb, uint16_t addr) {
+     return gb_gpu_get_lcd_stat(gb);
+}
 
-     if (addr == REG_NR50) {
-          return gb->spu.output_level;
-     }
+static uint8_t gb_memory_read_ly(struct gb *gb, uint16_t addr) {
+     return gb_gpu_get_ly(gb);
+}
 
-     if (addr == REG_NR51) {
-          return gb->spu.sound_mux;
-     }
+static uint8_t gb_memory_read_dma(struct gb *gb, uint16_t addr) {
+     return gb->dma.source >> 8;
+}
 
-     if (addr == REG_NR52) {
-          uint8_t r = 0;
+static uint8_t gb_memory_read_key1(struct gb *gb, uint16_t addr) {
+     uint8_t r = 0;
 
-          r |= gb->spu.nr2.running << 1;
-          r |= gb->spu.nr3.running << 2;
-          r |= gb->spu.enable << 7;
+     r |= gb->double_speed << 7;
+     r |= gb->speed_switch_pending;
 
-          return r;
-     }
+     return r | 0x7e;
+}
 
-     if (addr >= NR3_RAM_BASE && addr < NR3_RAM_END) {
-          return gb->spu.nr3.ram[addr - NR3_RAM_BASE];
-     }
+static uint8_t gb_memory_read_vbk(struct gb *gb, uint16_t addr) {
+     return gb->vram_high_bank | 0xfe;
+}
 
-     if (addr == REG_LCDC) {
-          return gb_gpu_get_lcdc(gb);
-     }
+static uint8_t gb_memory_read_hdma1(struct gb *gb, uint16_t addr) {
+     return gb->hdma.source >> 8;
+}
 
-     if (addr == REG_LCD_STAT) {
-          return gb_gpu_get_lcd_stat(gb);
-     }
+static uint8_t gb_memory_read_hdma2(struct gb *gb, uint16_t addr) {
+     return gb->hdma.source & 0xff;
+}
 
-     if (addr == REG_SCY) {
-          return gb->gpu.scy;
-     }
+static uint8_t gb_memory_read_hdma3(struct gb *gb, uint16_t addr) {
+     return gb->hdma.destination >> 8;
+}
 
-     if (addr == REG_SCX) {
-          return gb->gpu.scx;
-     }
+static uint8_t gb_memory_read_hdma4(struct gb *gb, uint16_t addr) {
+     return gb->hdma.destination & 0xff;
+}
 
-     if (addr == REG_LY) {
-          return gb_gpu_get_ly(gb);
-     }
+static uint8_t gb_memory_read_hdma5(struct gb *gb, uint16_t addr) {
+     /* The only way the CPU can read this register and see that the HDMA
+      * is active is if it's configured to run on HBLANKs. If the HDMA is
+      * configured to run without HBLANK it copies everything at once,
+      * stopping the CPU until it's finished (and then obviously the CPU
+      * can't read this register) */
+     bool active = gb->hdma.run_on_hblank;
+     uint8_t r = 0;
 
-     if (addr == REG_LYC) {
-          return gb->gpu.lyc;
-     }
+     r |= (!active) << 7;
+     r |= gb->hdma.length & 0x7f;
 
-     if (addr == REG_DMA) {
-          return gb->dma.source >> 8;
-     }
+     return r;
+}
 
-     if (addr == REG_BGP) {
-          return gb->gpu.bgp;
-     }
+static uint8_t gb_memory_read_bcps(struct gb *gb, uint16_t addr) {
+     uint8_t r = 0;
 
-     if (addr == REG_OBP0) {
-          return gb->gpu.obp0;
-     }
+     r |= gb->gpu.bg_palettes.auto_increment << 7;
+     r |= gb->gpu.bg_palettes.write_index;
 
-     if (addr == REG_OBP1) {
-          return gb->gpu.obp1;
-     }
+     return r;
+}
 
-     if (addr == REG_WY) {
-          return gb->gpu.wy;
-     }
+static uint8_t gb_memory_read_bcpd(struct gb *gb, uint16_t addr) {
+     struct gb_color_palette *p = &gb->gpu.bg_palettes;
+     uint16_t index = p->write_index;
+     unsigned palette = index >> 3;
+     unsigned color_index = (index >> 1) & 3;
+     bool high = index & 1;
+     uint16_t col;
 
-     if (addr == REG_WX) {
-          return gb->gpu.wx;
-     }
+     col = p->colors[palette][color_index];
 
-     if (addr == REG_IE) {
-          return gb->irq.irq_enable;
+     if (high) {
+          return col >> 8;
+     } else {
+          return col & 0xff;
      }
+}
 
-     if (gb->gbc && addr == REG_KEY1) {
-          uint8_t r = 0;
+static uint8_t gb_memory_read_ocps(struct gb *gb, uint16_t addr) {
+     uint8_t r = 0;
 
-          r |= gb->double_speed << 7;
-          r |= gb->speed_switch_pending;
+     r |= gb->gpu.sprite_palettes.auto_increment << 7;
+     r |= gb->gpu.sprite_palettes.write_index;
 
-          return r | 0x7e;
-     }
+     return r;
+}
 
-     if (gb->gbc && addr == REG_VBK) {
-          return gb->vram_high_bank | 0xfe;
-     }
+static uint8_t gb_memory_read_ocpd(struct gb *gb, uint16_t addr) {
+     struct gb_color_palette *p = &gb->gpu.sprite_palettes;
+     uint16_t index = p->write_index;
+     unsigned palette = index >> 3;
+     unsigned color_index = (index >> 1) & 3;
+     bool high = index & 1;
+     uint16_t col;
 
-     if (gb->gbc && addr == REG_HDMA1) {
-          return gb->hdma.source >> 8;
-     }
+     col = p->colors[palette][color_index];
 
-     if (gb->gbc && addr == REG_HDMA2) {
-          return gb->hdma.source & 0xff;
+     if (high) {
+          return col >> 8;
+     } else {
+          return col & 0xff;
      }
+}
 
-     if (gb->gbc && addr == REG_HDMA3) {
-          return gb->hdma.destination >> 8;
-     }
+static uint8_t gb_memory_read_svbk(struct gb *gb, uint16_t addr) {
+     return gb->iram_high_bank | 0xf8;
+}
 
-     if (gb->gbc && addr == REG_HDMA4) {
-          return gb->hdma.destination & 0xff;
-     }
+static void gb_memory_write_input(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_input_select(gb, val);
+}
 
-     if (gb->gbc && addr == REG_HDMA5) {
-          /* The only way the CPU can read this register and see that the HDMA
-           * is active is if it's configured to run on HBLANKs. If the HDMA is
-           * configured to run without HBLANK it copies everything at once,
-           * stopping the CPU until it's finished (and then obviously the CPU
-           * can't read this register) */
-          bool active = gb->hdma.run_on_hblank;
-          uint8_t r = 0;
+static void gb_memory_write_sb(struct gb *gb, uint16_t addr, uint8_t val) {
+     /* XXX TODO */
+}
 
-          r |= (!active) << 7;
-          r |= gb->hdma.length & 0x7f;
+static void gb_memory_write_sc(struct gb *gb, uint16_t addr, uint8_t val) {
+     /* XXX TODO */
+}
 
-          return r;
-     }
+static void gb_memory_write_div(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_timer_sync(gb);
+     /* Writing to the divider sets it to 0 (regardless of the value being
+      * written) */
+     gb->timer.divider_counter = 0;
+}
 
-     if (gb->gbc && addr == REG_BCPS) {
-          uint8_t r = 0;
+static void gb_memory_write_tima(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_timer_sync(gb);
+     gb->timer.counter = val;
+     gb_timer_sync(gb);
+}
 
-          r |= gb->gpu.bg_palettes.auto_increment << 7;
-          r |= gb->gpu.bg_palettes.write_index;
+static void gb_memory_write_tma(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_timer_sync(gb);
+     gb->timer.modulo = val;
+     gb_timer_sync(gb);
+}
 
-          return r;
-     }
+static void gb_memory_write_tac(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_timer_set_config(gb, val);
+}
 
-     if (gb->gbc && addr == REG_BCPD) {
-          struct gb_color_palette *p = &gb->gpu.bg_palettes;
-          uint16_t index = p->write_index;
-          unsigned palette = index >> 3;
-          unsigned color_index = (index >> 1) & 3;
-          bool high = index & 1;
-          uint16_t col;
+static void gb_memory_write_if(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->irq.irq_flags = val | 0xE0;
+     gb_irq_update_pending(gb);
+}
 
-          col = p->colors[palette][color_index];
+static void gb_memory_write_ie(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->irq.irq_enable = val;
+     gb_irq_update_pending(gb);
+}
 
-          if (high) {
-               return col >> 8;
-          } else {
-               return col & 0xff;
-          }
+static void gb_memory_write_nr10(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb_spu_sweep_reload(&gb->spu.nr1.sweep, val);
      }
+}
 
-     if (gb->gbc && addr == REG_OCPS) {
-          uint8_t r = 0;
+static void gb_memory_write_nr11(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr1.wave.duty_cycle = val >> 6;
+          gb_spu_duration_reload(&gb->spu.nr1.duration,
+                                 GB_SPU_NR1_T1_MAX,
+                                 val & 0x3f);
+     }
+}
 
-          r |= gb->gpu.sprite_palettes.auto_increment << 7;
-          r |= gb->gpu.sprite_palettes.write_index;
+static void gb_memory_write_nr12(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          /* Envelope config takes effect on sound start */
+          gb->spu.nr1.envelope_config = val;
+     }
+}
 
-          return r;
+static void gb_memory_write_nr13(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr1.sweep.divider.offset &= 0x700;
+          gb->spu.nr1.sweep.divider.offset |= val;
      }
+}
 
-     if (gb->gbc && addr == REG_OCPD) {
-          struct gb_color_palette *p = &gb->gpu.sprite_palettes;
-          uint16_t index = p->write_index;
-          unsigned palette = index >> 3;
-          unsigned color_index = (index >> 1) & 3;
-          bool high = index & 1;
-          uint16_t col;
+static void gb_memory_write_nr14(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr1.sweep.divider.offset &= 0xff;
+          gb->spu.nr1.sweep.divider.offset |= ((uint16_t)val & 7) << 8;
 
-          col = p->colors[palette][color_index];
+          gb->spu.nr1.duration.enable = val & 0x40;
 
-          if (high) {
-               return col >> 8;
-          } else {
-               return col & 0xff;
+          if (val & 0x80) {
+               gb_spu_nr1_start(gb);
           }
      }
+}
 
-     if (gb->gbc && addr == REG_SVBK) {
-          return gb->iram_high_bank | 0xf8;
+static void gb_memory_write_nr21(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr2.wave.duty_cycle = val >> 6;
+          gb_spu_duration_reload(&gb->spu.nr2.duration,
+                                 GB_SPU_NR2_T1_MAX,
+                                 val & 0x3f);
      }
+}
 
-     printf("Unsupported read at address 0x%04x\n", addr);
+static void gb_memory_write_nr22(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          /* Envelope config takes effect on sound start */
+          gb->spu.nr2.envelope_config = val;
+     }
+}
 
-     return 0xff;
+static void gb_memory_write_nr23(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr2.divider.offset &= 0x700;
+          gb->spu.nr2.divider.offset |= val;
+     }
 }
 
-void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
+static void gb_memory_write_nr24(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr2.divider.offset &= 0xff;
+          gb->spu.nr2.divider.offset |= ((uint16_t)val & 7) << 8;
 
-     if (addr >= ROM_BASE && addr < ROM_END) {
-          gb_cart_rom_writeb(gb, addr - ROM_BASE, val);
-          return;
-     }
+          gb->spu.nr2.duration.enable = val & 0x40;
 
-     if (addr >= ZRAM_BASE && addr < ZRAM_END) {
-          gb->zram[addr - ZRAM_BASE] = val;
-          return;
+          if (val & 0x80) {
+               gb_spu_nr2_start(gb);
+          }
      }
+}
 
-     if (addr >= IRAM_BASE && addr < IRAM_END) {
-          uint16_t off = gb_memory_iram_off(gb, addr - IRAM_BASE);
+static void gb_memory_write_nr30(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          /* Disabling sound 3 stops it. However enabling it doesn't start
+           * it until 0x80 is written in NR34. */
+          bool enable = (val & 0x80);
 
-          gb->iram[off] = val;
-          return;
+          gb_spu_sync(gb);
+          gb->spu.nr3.enable = enable;
+          if (!enable) {
+               gb->spu.nr3.running = false;
+          }
      }
+}
 
-     if (addr >= IRAM_ECHO_BASE && addr < IRAM_ECHO_END) {
-          uint16_t off = gb_memory_iram_off(gb, addr - IRAM_ECHO_BASE);
+static void gb_memory_write_nr31(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr3.t1 = val;
+          gb_spu_duration_reload(&gb->spu.nr3.duration,
+                                 GB_SPU_NR3_T1_MAX,
+                                 val);
+     }
+}
 
-          gb->iram[off] = val;
-          return;
+static void gb_memory_write_nr32(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr3.volume_shift = (val >> 5) & 3;
      }
+}
 
-     if (addr >= VRAM_BASE && addr < VRAM_END) {
-          uint16_t off = addr - VRAM_BASE;
+static void gb_memory_write_nr33(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr3.divider.offset &= 0x700;
+          gb->spu.nr3.divider.offset |= val;
+     }
+}
 
-          off += 0x2000 * gb->vram_high_bank;
+static void gb_memory_write_nr34(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr3.divider.offset &= 0xff;
+          gb->spu.nr3.divider.offset |= ((uint16_t)val & 7) << 8;
 
-          gb_gpu_sync(gb);
-          gb->vram[off] = val;
-          return;
-     }
+          gb->spu.nr3.duration.enable = val & 0x40;
 
-     if (addr >= CRAM_BASE && addr < CRAM_END) {
-          gb_cart_ram_writeb(gb, addr - CRAM_BASE, val);
-          return;
+          if (val & 0x80) {
+               gb_spu_nr3_start(gb);
+          }
      }
+}
 
-     if (addr >= OAM_BASE && addr < OAM_END) {
-          gb_gpu_sync(gb);
-          gb->gpu.oam[addr - OAM_BASE] = val;
-          return;
+static void gb_memory_write_nr41(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb_spu_duration_reload(&gb->spu.nr4.duration,
+                                 GB_SPU_NR4_T1_MAX,
+                                 val & 0x3f);
      }
+}
 
-     if (addr == REG_INPUT) {
-          gb_input_select(gb, val);
-          return;
+static void gb_memory_write_nr42(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          /* Envelope config takes effect on sound start */
+          gb->spu.nr4.envelope_config = val;
      }
+}
 
-     if (addr == REG_SB) {
-          /* XXX TODO */
-          return;
+static void gb_memory_write_nr43(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.nr4.lfsr_config = val;
      }
+}
 
-     if (addr == REG_SC) {
-          /* XXX TODO */
-          return;
-     }
+static void gb_memory_write_nr44(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
 
-     if (addr == REG_DIV) {
-          gb_timer_sync(gb);
-          /* Writing to the divider sets it to 0 (regardless of the value being
-           * written) */
-          gb->timer.divider_counter = 0;
-          return;
-     }
+          gb->spu.nr4.duration.enable = val & 0x40;
 
-     if (addr == REG_TIMA) {
-          gb_timer_sync(gb);
-          gb->timer.counter = val;
-          gb_timer_sync(gb);
-          return;
+          if (val & 0x80) {
+               gb_spu_nr4_start(gb);
+          }
      }
+}
 
-     if (addr == REG_TMA) {
-          gb_timer_sync(gb);
-          gb->timer.modulo = val;
-          gb_timer_sync(gb);
-          return;
+static void gb_memory_write_nr50(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.output_level = val;
+          gb_spu_update_sound_amp(gb);
      }
+}
 
-     if (addr == REG_TAC) {
-          gb_timer_set_config(gb, val);
-          return;
+static void gb_memory_write_nr51(struct gb *gb, uint16_t addr, uint8_t val) {
+     if (gb->spu.enable) {
+          gb_spu_sync(gb);
+          gb->spu.sound_mux = val;
+          gb_spu_update_sound_amp(gb);
      }
+}
 
-     if (addr == REG_IF) {
-          gb->irq.irq_flags = val | 0xE0;
-          return;
-     }
+static void gb_memory_write_nr52(struct gb *gb, uint16_t addr, uint8_t val) {
+     bool enable = val & 0x80;
 
-     if (addr == REG_IE) {
-          gb->irq.irq_enable = val;
+     if (gb->spu.enable == enable) {
+          /* No change */
           return;
      }
 
-     if (addr == REG_NR10) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb_spu_sweep_reload(&gb->spu.nr1.sweep, val);
-          }
-          return;
-     }
+     gb_spu_sync(gb);
 
-     if (addr == REG_NR11) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr1.wave.duty_cycle = val >> 6;
-               gb_spu_duration_reload(&gb->spu.nr1.duration,
-                                      GB_SPU_NR1_T1_MAX,
-                                      val & 0x3f);
-          }
-          return;
+     if (!enable) {
+          gb_spu_reset(gb);
      }
 
-     if (addr == REG_NR12) {
-          if (gb->spu.enable) {
-               /* Envelope config takes effect on sound start */
-               gb->spu.nr1.envelope_config = val;
-          }
-          return;
-     }
+     gb->spu.enable = enable;
+}
 
-     if (addr == REG_NR13) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr1.sweep.divider.offset &= 0x700;
-               gb->spu.nr1.sweep.divider.offset |= val;
-          }
-          return;
-     }
+static void gb_memory_write_lcdc(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_gpu_set_lcdc(gb, val);
+}
 
-     if (addr == REG_NR14) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr1.sweep.divider.offset &= 0xff;
-               gb->spu.nr1.sweep.divider.offset |= ((uint16_t)val & 7) << 8;
+static void gb_memory_write_lcd_stat(struct gb *gb, uint16_t addr,
+                                     uint8_t val) {
+     gb_gpu_set_lcd_stat(gb, val);
+}
 
-               gb->spu.nr1.duration.enable = val & 0x40;
+static void gb_memory_write_scy(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_gpu_sync(gb);
+     gb->gpu.scy = val;
+}
 
-               if (val & 0x80) {
-                    gb_spu_nr1_start(gb);
-               }
-          }
-          return;
-     }
+static void gb_memory_write_scx(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_gpu_sync(gb);
+     gb->gpu.scx = val;
+}
 
-     if (addr == REG_NR21) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr2.wave.duty_cycle = val >> 6;
-               gb_spu_duration_reload(&gb->spu.nr2.duration,
-                                      GB_SPU_NR2_T1_MAX,
-                                      val & 0x3f);
-          }
-          return;
-     }
+static void gb_memory_write_dma(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_dma_start(gb, val);
+}
 
-     if (addr == REG_NR22) {
-          if (gb->spu.enable) {
-               /* Envelope config takes effect on sound start */
-               gb->spu.nr2.envelope_config = val;
-          }
-          return;
-     }
+static void gb_memory_write_bgp(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_gpu_sync(gb);
+     gb->gpu.bgp = val;
+}
 
-     if (addr == REG_NR23) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr2.divider.offset &= 0x700;
-               gb->spu.nr2.divider.offset |= val;
-          }
-          return;
-     }
+static void gb_memory_write_obp0(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_gpu_sync(gb);
+     gb->gpu.obp0 = val;
+}
 
-     if (addr == REG_NR24) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr2.divider.offset &= 0xff;
-               gb->spu.nr2.divider.offset |= ((uint16_t)val & 7) << 8;
+static void gb_memory_write_obp1(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_gpu_sync(gb);
+     gb->gpu.obp1 = val;
+}
 
-               gb->spu.nr2.duration.enable = val & 0x40;
+static void gb_memory_write_wy(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_gpu_sync(gb);
+     gb->gpu.wy = val;
+}
 
-               if (val & 0x80) {
-                    gb_spu_nr2_start(gb);
-               }
-          }
-          return;
-     }
+static void gb_memory_write_wx(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb_gpu_sync(gb);
+     gb->gpu.wx = val;
+}
 
-     if (addr == REG_NR30) {
-          if (gb->spu.enable) {
-               /* Disabling sound 3 stops it. However enabling it doesn't start
-                * it until 0x80 is written in NR34. */
-               bool enable = (val & 0x80);
+static void gb_memory_write_key1(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->speed_switch_pending = val & 1;
+}
 
-               gb_spu_sync(gb);
-               gb->spu.nr3.enable = enable;
-               if (!enable) {
-                    gb->spu.nr3.running = false;
-               }
-          }
-          return;
-     }
+static void gb_memory_write_vbk(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->vram_high_bank = val & 1;
+     gb_memory_map_vram(gb);
+}
 
-     if (addr == REG_NR31) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr3.t1 = val;
-               gb_spu_duration_reload(&gb->spu.nr3.duration,
-                                      GB_SPU_NR3_T1_MAX,
-                                      val);
-          }
-          return;
-     }
+static void gb_memory_write_hdma1(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->hdma.source &= 0xff;
+     gb->hdma.source |= (val << 8);
+}
 
-     if (addr == REG_NR32) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr3.volume_shift = (val >> 5) & 3;
-          }
-          return;
-     }
+static void gb_memory_write_hdma2(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->hdma.source &= 0xff00;
+     /* Low 4 bits are ignored */
+     gb->hdma.source |= val & 0xf0;
+}
 
-     if (addr == REG_NR33) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr3.divider.offset &= 0x700;
-               gb->spu.nr3.divider.offset |= val;
-          }
-          return;
-     }
+static void gb_memory_write_hdma3(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->hdma.destination &= 0xff;
+     gb->hdma.destination |= (val << 8);
+}
 
-     if (addr == REG_NR34) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr3.divider.offset &= 0xff;
-               gb->spu.nr3.divider.offset |= ((uint16_t)val & 7) << 8;
+static void gb_memory_write_hdma4(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->hdma.destination &= 0xff00;
+     /* Low 4 bits are ignored (causes glitches in Oracle of Ages
+      * otherwise) */
+     gb->hdma.destination |= val & 0xf0;
+}
 
-               gb->spu.nr3.duration.enable = val & 0x40;
+static void gb_memory_write_hdma5(struct gb *gb, uint16_t addr, uint8_t val) {
+     bool run_on_hblank = val & 0x80;
 
-               if (val & 0x80) {
-                    gb_spu_nr3_start(gb);
-               }
-          }
-          return;
-     }
+     gb->hdma.length = val & 0x7f;
 
-     if (addr == REG_NR41) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb_spu_duration_reload(&gb->spu.nr4.duration,
-                                      GB_SPU_NR4_T1_MAX,
-                                      val & 0x3f);
-          }
-          return;
+     if (!run_on_hblank && gb->hdma.run_on_hblank) {
+          /* This stops the current transfer */
+          gb_gpu_sync(gb);
+          gb->hdma.run_on_hblank = false;
+     } else {
+          gb_hdma_start(gb, run_on_hblank);
      }
+}
 
-     if (addr == REG_NR42) {
-          if (gb->spu.enable) {
-               /* Envelope config takes effect on sound start */
-               gb->spu.nr4.envelope_config = val;
-          }
-          return;
+static void gb_memory_write_bcps(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->gpu.bg_palettes.auto_increment = val & 0x80;
+     gb->gpu.bg_palettes.write_index = val & 0x3f;
+}
+
+static void gb_memory_write_bcpd(struct gb *gb, uint16_t addr, uint8_t val) {
+     struct gb_color_palette *p = &gb->gpu.bg_palettes;
+     uint16_t index = p->write_index;
+     unsigned palette = index >> 3;
+     unsigned color_index = (index >> 1) & 3;
+     bool high = index & 1;
+     uint16_t col;
+
+     col = p->colors[palette][color_index];
+
+     if (high) {
+          col &= 0xff;
+          col |= val << 8;
+     } else {
+          col &= 0xff00;
+          col |= val;
      }
 
-     if (addr == REG_NR43) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.nr4.lfsr_config = val;
-          }
-          return;
+     p->colors[palette][color_index] = col;
+     p->color_bytes[high][index >> 1] = val;
+
+     if (p->auto_increment) {
+          p->write_index = (p->write_index + 1) & 0x3f;
      }
+}
 
-     if (addr == REG_NR44) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
+static void gb_memory_write_ocps(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->gpu.sprite_palettes.auto_increment = val & 0x80;
+     gb->gpu.sprite_palettes.write_index = val & 0x3f;
+}
 
-               gb->spu.nr4.duration.enable = val & 0x40;
+static void gb_memory_write_ocpd(struct gb *gb, uint16_t addr, uint8_t val) {
+     struct gb_color_palette *p = &gb->gpu.sprite_palettes;
+     uint16_t index = p->write_index;
+     unsigned palette = index >> 3;
+     unsigned color_index = (index >> 1) & 3;
+     bool high = index & 1;
+     uint16_t col;
 
-               if (val & 0x80) {
-                    gb_spu_nr4_start(gb);
-               }
-          }
-          return;
-     }
+     col = p->colors[palette][color_index];
 
-     if (addr == REG_NR50) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.output_level = val;
-               gb_spu_update_sound_amp(gb);
-          }
-          return;
+     if (high) {
+          col &= 0xff;
+          col |= val << 8;
+     } else {
+          col &= 0xff00;
+          col |= val;
      }
 
-     if (addr == REG_NR51) {
-          if (gb->spu.enable) {
-               gb_spu_sync(gb);
-               gb->spu.sound_mux = val;
-               gb_spu_update_sound_amp(gb);
-          }
-          return;
+     p->colors[palette][color_index] = col;
+     p->color_bytes[high][index >> 1] = val;
+
+     if (p->auto_increment) {
+          p->write_index = (p->write_index + 1) & 0x3f;
      }
+}
 
-     if (addr == REG_NR52) {
-          bool enable = val & 0x80;
+static void gb_memory_write_svbk(struct gb *gb, uint16_t addr, uint8_t val) {
+     gb->iram_high_bank = val & 7;
+     gb_memory_map_iram(gb);
+}
 
-          if (gb->spu.enable == enable) {
-               /* No change */
-               return;
-          }
+static uint8_t gb_memory_read_unsupported(struct gb *gb, uint16_t addr) {
+     printf("Unsupported read at address 0x%04x\n", addr);
 
-          gb_spu_sync(gb);
+     return 0xff;
+}
 
-          if (!enable) {
-               gb_spu_reset(gb);
-          }
+static void gb_memory_write_unsupported(struct gb *gb, uint16_t addr,
+                                        uint8_t val) {
+     printf("Unsupported write at address 0x%04x [val=0x%02x]\n", addr, val);
+}
 
-          gb->spu.enable = enable;
-          return;
-     }
+/* Install the handlers for I/O register `reg`. A NULL handler leaves the
+ * default one. */
+static void gb_memory_io_map(struct gb *gb, uint16_t reg,
+                             gb_memory_io_read_f read,
+                             gb_memory_io_write_f write) {
+     struct gb_memory *mem = &gb->memory;
+     uint8_t r = reg & 0xff;
 
-     if (addr >= NR3_RAM_BASE && addr < NR3_RAM_END) {
-          gb->spu.nr3.ram[addr - NR3_RAM_BASE] = val;
-          return;
+     if (read != NULL) {
+          mem->io_read[r] = read;
      }
 
-     if (addr == REG_LCDC) {
-          gb_gpu_set_lcdc(gb, val);
-          return;
+     if (write != NULL) {
+          mem->io_write[r] = write;
      }
+}
 
-     if (addr == REG_LCD_STAT) {
-          gb_gpu_set_lcd_stat(gb, val);
-          return;
-     }
+/* Make `reg` directly accessible at `read` and/or `write`. NULL means that the
+ * corresponding access goes through the handler. */
+static void gb_memory_io_map_direct(struct gb *gb, uint16_t reg,
+                                    const uint8_t *read, uint8_t *write) {
+     struct gb_memory *mem = &gb->memory;
+     uint8_t r = reg & 0xff;
 
-     if (addr == REG_SCY) {
-          gb_gpu_sync(gb);
-          gb->gpu.scy = val;
-          return;
-     }
+     mem->io_read_direct[r] = read;
+     mem->io_write_direct[r] = write;
+}
 
-     if (addr == REG_SCX) {
-          gb_gpu_sync(gb);
-          gb->gpu.scx = val;
-          return;
+static void gb_memory_io_reset(struct gb *gb) {
+     struct gb_memory *mem = &gb->memory;
+     unsigned addr;
+
+     for (addr = 0; addr < 0x100; addr++) {
+          mem->io_read_direct[addr] = NULL;
+          mem->io_write_direct[addr] = NULL;
+          mem->io_read[addr] = gb_memory_read_unsupported;
+          mem->io_write[addr] = gb_memory_write_unsupported;
+     }
+
+     gb_memory_io_map(gb, REG_INPUT, gb_memory_read_input,
+                      gb_memory_write_input);
+     gb_memory_io_map(gb, REG_SB, gb_memory_read_sb, gb_memory_write_sb);
+     gb_memory_io_map(gb, REG_SC, gb_memory_read_sc, gb_memory_write_sc);
+     gb_memory_io_map(gb, REG_DIV, gb_memory_read_div, gb_memory_write_div);
+     gb_memory_io_map(gb, REG_TIMA, gb_memory_read_tima, gb_memory_write_tima);
+     gb_memory_io_map(gb, REG_TMA, NULL, gb_memory_write_tma);
+     gb_memory_io_map(gb, REG_TAC, gb_memory_read_tac, gb_memory_write_tac);
+     gb_memory_io_map(gb, REG_IF, NULL, gb_memory_write_if);
+     gb_memory_io_map(gb, REG_NR10, gb_memory_read_nr10, gb_memory_write_nr10);
+     gb_memory_io_map(gb, REG_NR11, gb_memory_read_nr11, gb_memory_write_nr11);
+     gb_memory_io_map(gb, REG_NR12, NULL, gb_memory_write_nr12);
+     gb_memory_io_map(gb, REG_NR13, gb_memory_read_nr13, gb_memory_write_nr13);
+     gb_memory_io_map(gb, REG_NR14, gb_memory_read_nr14, gb_memory_write_nr14);
+     gb_memory_io_map(gb, REG_NR21, gb_memory_read_nr21, gb_memory_write_nr21);
+     gb_memory_io_map(gb, REG_NR22, NULL, gb_memory_write_nr22);
+     gb_memory_io_map(gb, REG_NR23, gb_memory_read_nr23, gb_memory_write_nr23);
+     gb_memory_io_map(gb, REG_NR24, gb_memory_read_nr24, gb_memory_write_nr24);
+     gb_memory_io_map(gb, REG_NR30, gb_memory_read_nr30, gb_memory_write_nr30);
+     gb_memory_io_map(gb, REG_NR31, NULL, gb_memory_write_nr31);
+     gb_memory_io_map(gb, REG_NR32, gb_memory_read_nr32, gb_memory_write_nr32);
+     gb_memory_io_map(gb, REG_NR33, gb_memory_read_nr33, gb_memory_write_nr33);
+     gb_memory_io_map(gb, REG_NR34, gb_memory_read_nr34, gb_memory_write_nr34);
+     gb_memory_io_map(gb, REG_NR41, gb_memory_read_nr41, gb_memory_write_nr41);
+     gb_memory_io_map(gb, REG_NR42, NULL, gb_memory_write_nr42);
+     gb_memory_io_map(gb, REG_NR43, NULL, gb_memory_write_nr43);
+     gb_memory_io_map(gb, REG_NR44, gb_memory_read_nr44, gb_memory_write_nr44);
+     gb_memory_io_map(gb, REG_NR50, NULL, gb_memory_write_nr50);
+     gb_memory_io_map(gb, REG_NR51, NULL, gb_memory_write_nr51);
+     gb_memory_io_map(gb, REG_NR52, gb_memory_read_nr52, gb_memory_write_nr52);
+     gb_memory_io_map(gb, REG_LCDC, gb_memory_read_lcdc, gb_memory_write_lcdc);
+     gb_memory_io_map(gb, REG_LCD_STAT, gb_memory_read_lcd_stat,
+                      gb_memory_write_lcd_stat);
+     gb_memory_io_map(gb, REG_SCY, NULL, gb_memory_write_scy);
+     gb_memory_io_map(gb, REG_SCX, NULL, gb_memory_write_scx);
+     gb_memory_io_map(gb, REG_LY, gb_memory_read_ly, NULL);
+     gb_memory_io_map(gb, REG_DMA, gb_memory_read_dma, gb_memory_write_dma);
+     gb_memory_io_map(gb, REG_BGP, NULL, gb_memory_write_bgp);
+     gb_memory_io_map(gb, REG_OBP0, NULL, gb_memory_write_obp0);
+     gb_memory_io_map(gb, REG_OBP1, NULL, gb_memory_write_obp1);
+     gb_memory_io_map(gb, REG_WY, NULL, gb_memory_write_wy);
+     gb_memory_io_map(gb, REG_WX, NULL, gb_memory_write_wx);
+     gb_memory_io_map(gb, REG_IE, NULL, gb_memory_write_ie);
+
+     if (gb->gbc) {
+          /* GBC-only registers */
+          gb_memory_io_map(gb, REG_KEY1, gb_memory_read_key1,
+                           gb_memory_write_key1);
+          gb_memory_io_map(gb, REG_VBK, gb_memory_read_vbk,
+                           gb_memory_write_vbk);
+          gb_memory_io_map(gb, REG_HDMA1, gb_memory_read_hdma1,
+                           gb_memory_write_hdma1);
+          gb_memory_io_map(gb, REG_HDMA2, gb_memory_read_hdma2,
+                           gb_memory_write_hdma2);
+          gb_memory_io_map(gb, REG_HDMA3, gb_memory_read_hdma3,
+                           gb_memory_write_hdma3);
+          gb_memory_io_map(gb, REG_HDMA4, gb_memory_read_hdma4,
+                           gb_memory_write_hdma4);
+          gb_memory_io_map(gb, REG_HDMA5, gb_memory_read_hdma5,
+                           gb_memory_write_hdma5);
+          gb_memory_io_map(gb, REG_BCPS, gb_memory_read_bcps,
+                           gb_memory_write_bcps);
+          gb_memory_io_map(gb, REG_BCPD, gb_memory_read_bcpd,
+                           gb_memory_write_bcpd);
+          gb_memory_io_map(gb, REG_OCPS, gb_memory_read_ocps,
+                           gb_memory_write_ocps);
+          gb_memory_io_map(gb, REG_OCPD, gb_memory_read_ocpd,
+                           gb_memory_write_ocpd);
+          gb_memory_io_map(gb, REG_SVBK, gb_memory_read_svbk,
+                           gb_memory_write_svbk);
+     }
+
+     /* Registers we can access directly */
+     gb_memory_io_map_direct(gb, REG_TMA, &gb->timer.modulo, NULL);
+     gb_memory_io_map_direct(gb, REG_IF, &gb->irq.irq_flags, NULL);
+     gb_memory_io_map_direct(gb, REG_NR12, &gb->spu.nr1.envelope_config, NULL);
+     gb_memory_io_map_direct(gb, REG_NR22, &gb->spu.nr2.envelope_config, NULL);
+     gb_memory_io_map_direct(gb, REG_NR31, &gb->spu.nr3.t1, NULL);
+     gb_memory_io_map_direct(gb, REG_NR42, &gb->spu.nr4.envelope_config, NULL);
+     gb_memory_io_map_direct(gb, REG_NR43, &gb->spu.nr4.lfsr_config, NULL);
+     gb_memory_io_map_direct(gb, REG_NR50, &gb->spu.output_level, NULL);
+     gb_memory_io_map_direct(gb, REG_NR51, &gb->spu.sound_mux, NULL);
+     gb_memory_io_map_direct(gb, REG_SCY, &gb->gpu.scy, NULL);
+     gb_memory_io_map_direct(gb, REG_SCX, &gb->gpu.scx, NULL);
+     gb_memory_io_map_direct(gb, REG_LYC, &gb->gpu.lyc, &gb->gpu.lyc);
+     gb_memory_io_map_direct(gb, REG_BGP, &gb->gpu.bgp, NULL);
+     gb_memory_io_map_direct(gb, REG_OBP0, &gb->gpu.obp0, NULL);
+     gb_memory_io_map_direct(gb, REG_OBP1, &gb->gpu.obp1, NULL);
+     gb_memory_io_map_direct(gb, REG_WY, &gb->gpu.wy, NULL);
+     gb_memory_io_map_direct(gb, REG_WX, &gb->gpu.wx, NULL);
+     gb_memory_io_map_direct(gb, REG_IE, &gb->irq.irq_enable, NULL);
+
+     for (addr = NR3_RAM_BASE; addr < NR3_RAM_END; addr++) {
+          uint8_t *p = &gb->spu.nr3.ram[addr - NR3_RAM_BASE];
+
+          gb_memory_io_map_direct(gb, addr, p, p);
+     }
+
+     for (addr = ZRAM_BASE; addr < ZRAM_END; addr++) {
+          uint8_t *p = &gb->zram[addr - ZRAM_BASE];
+
+          gb_memory_io_map_direct(gb, addr, p, p);
      }
+}
 
-     if (addr == REG_LYC) {
-          gb->gpu.lyc = val;
-          return;
-     }
+void gb_memory_reset(struct gb *gb) {
+     struct gb_memory *mem = &gb->memory;
+     unsigned p;
 
-     if (addr == REG_DMA) {
-          gb_dma_start(gb, val);
-          return;
-     }
+     gb->iram_high_bank = 1;
+     gb->vram_high_bank = false;
 
-     if (addr == REG_BGP) {
-          gb_gpu_sync(gb);
-          gb->gpu.bgp = val;
-          return;
+     /* Everything goes through the slow path by default */
+     for (p = 0; p < GB_MEMORY_PAGES; p++) {
+          mem->read_map[p] = NULL;
+          mem->write_map[p] = NULL;
      }
 
-     if (addr == REG_OBP0) {
-          gb_gpu_sync(gb);
-          gb->gpu.obp0 = val;
-          return;
+     /* ROM bank 0 is always mapped */
+     for (p = ROM_BASE >> 8; p < GB_ROM_BANK_SIZE >> 8; p++) {
+          mem->read_map[p] = &gb->cart.rom[p * GB_MEMORY_PAGE_SIZE];
      }
 
-     if (addr == REG_OBP1) {
-          gb_gpu_sync(gb);
-          gb->gpu.obp1 = val;
-          return;
-     }
+     gb_memory_map_cart(gb);
+     gb_memory_map_vram(gb);
+     gb_memory_map_iram(gb);
 
-     if (addr == REG_WY) {
-          gb_gpu_sync(gb);
-          gb->gpu.wy = val;
-          return;
-     }
+     gb_memory_io_reset(gb);
+}
 
-     if (addr == REG_WX) {
-          gb_gpu_sync(gb);
-          gb->gpu.wx = val;
-          return;
+/* Slow path for the reads in pages that aren't in the memory map: OAM, I/O
+ * registers, zero page RAM and cartridge RAM when it can't be mapped directly
+ * (RTC registers or no RAM at all) */
+static uint8_t gb_memory_readb_slow(struct gb *gb, uint16_t addr) {
+     struct gb_memory *mem = &gb->memory;
+
+     if (addr >= IO_BASE) {
+          uint8_t r = addr & 0xff;
+
+          if (mem->io_read_direct[r] != NULL) {
+               return *mem->io_read_direct[r];
+          }
+
+          return mem->io_read[r](gb, addr);
      }
 
-     if (gb->gbc && addr == REG_KEY1) {
-          gb->speed_switch_pending = val & 1;
-          return;
+     if (addr >= ROM_BASE && addr < ROM_END) {
+          return gb_cart_rom_readb(gb, addr - ROM_BASE);
      }
 
-     if (gb->gbc && addr == REG_VBK) {
-          gb->vram_high_bank = val & 1;
-          return;
+     if (addr >= IRAM_BASE && addr < IRAM_END) {
+          uint16_t off = gb_memory_iram_off(gb, addr - IRAM_BASE);
+
+          return gb->iram[off];
      }
 
-     if (gb->gbc && addr == REG_HDMA1) {
-          gb->hdma.source &= 0xff;
-          gb->hdma.source |= (val << 8);
-          return;
+     if (addr >= IRAM_ECHO_BASE && addr < IRAM_ECHO_END) {
+          uint16_t off = gb_memory_iram_off(gb, addr - IRAM_ECHO_BASE);
+
+          return gb->iram[off];
      }
 
-     if (gb->gbc && addr == REG_HDMA2) {
-          gb->hdma.source &= 0xff00;
-          /* Low 4 bits are ignored */
-          gb->hdma.source |= val & 0xf0;
-          return;
+     if (addr >= VRAM_BASE && addr < VRAM_END) {
+          uint16_t off = addr - VRAM_BASE;
+
+          off += 0x2000 * gb->vram_high_bank;
+
+          return gb->vram[off];
      }
 
-     if (gb->gbc && addr == REG_HDMA3) {
-          gb->hdma.destination &= 0xff;
-          gb->hdma.destination |= (val << 8);
-          return;
+     if (addr >= CRAM_BASE && addr < CRAM_END) {
+          return gb_cart_ram_readb(gb, addr - CRAM_BASE);
      }
 
-     if (gb->gbc && addr == REG_HDMA4) {
-          gb->hdma.destination &= 0xff00;
-          /* Low 4 bits are ignored (causes glitches in Oracle of Ages
-           * otherwise) */
-          gb->hdma.destination |= val & 0xf0;
-          return;
+     if (addr >= OAM_BASE && addr < OAM_END) {
+          return gb->gpu.oam[addr - OAM_BASE];
      }
 
-     if (gb->gbc && addr == REG_HDMA5) {
-          bool run_on_hblank = val & 0x80;
+     printf("Unsupported read at address 0x%04x\n", addr);
 
-          gb->hdma.length = val & 0x7f;
+     return 0xff;
+}
 
-          if (!run_on_hblank && gb->hdma.run_on_hblank) {
-               /* This stops the current transfer */
-               gb_gpu_sync(gb);
-               gb->hdma.run_on_hblank = false;
-          } else {
-               gb_hdma_start(gb, run_on_hblank);
-          }
+/* Read one byte from memory at `addr` */
+uint8_t gb_memory_readb(struct gb *gb, uint16_t addr) {
+     const uint8_t *page = gb->memory.read_map[addr >> 8];
 
-          return;
+     if (page != NULL) {
+          return page[addr & 0xff];
      }
 
-     if (gb->gbc && addr == REG_BCPS) {
-          gb->gpu.bg_palettes.auto_increment = val & 0x80;
-          gb->gpu.bg_palettes.write_index = val & 0x3f;
-          return;
-     }
+     return gb_memory_readb_slow(gb, addr);
+}
 
-     if (gb->gbc && addr == REG_BCPD) {
-          struct gb_color_palette *p = &gb->gpu.bg_palettes;
-          uint16_t index = p->write_index;
-          unsigned palette = index >> 3;
-          unsigned color_index = (index >> 1) & 3;
-          bool high = index & 1;
-          uint16_t col;
+/* Slow path for the writes in pages that aren't in the memory map */
+static void gb_memory_writeb_slow(struct gb *gb, uint16_t addr, uint8_t val) {
+     struct gb_memory *mem = &gb->memory;
 
-          col = p->colors[palette][color_index];
+     if (addr >= IO_BASE) {
+          uint8_t r = addr & 0xff;
 
-          if (high) {
-               col &= 0xff;
-               col |= val << 8;
+          if (mem->io_write_direct[r] != NULL) {
+               *mem->io_write_direct[r] = val;
           } else {
-               col &= 0xff00;
-               col |= val;
-          }
-
-          p->colors[palette][color_index] = col;
-
-          if (p->auto_increment) {
-               p->write_index = (p->write_index + 1) & 0x3f;
+               mem->io_write[r](gb, addr, val);
           }
+          return;
+     }
 
+     if (addr >= ROM_BASE && addr < ROM_END) {
+          gb_cart_rom_writeb(gb, addr - ROM_BASE, val);
           return;
      }
 
-     if (gb->gbc && addr == REG_OCPS) {
-          gb->gpu.sprite_palettes.auto_increment = val & 0x80;
-          gb->gpu.sprite_palettes.write_index = val & 0x3f;
+     if (addr >= IRAM_BASE && addr < IRAM_END) {
+          uint16_t off = gb_memory_iram_off(gb, addr - IRAM_BASE);
+
+          gb->iram[off] = val;
           return;
      }
 
-     if (gb->gbc && addr == REG_OCPD) {
-          struct gb_color_palette *p = &gb->gpu.sprite_palettes;
-          uint16_t index = p->write_index;
-          unsigned palette = index >> 3;
-          unsigned color_index = (index >> 1) & 3;
-          bool high = index & 1;
-          uint16_t col;
+     if (addr >= IRAM_ECHO_BASE && addr < IRAM_ECHO_END) {
+          uint16_t off = gb_memory_iram_off(gb, addr - IRAM_ECHO_BASE);
 
-          col = p->colors[palette][color_index];
+          gb->iram[off] = val;
+          return;
+     }
 
-          if (high) {
-               col &= 0xff;
-               col |= val << 8;
-          } else {
-               col &= 0xff00;
-               col |= val;
-          }
+     if (addr >= VRAM_BASE && addr < VRAM_END) {
+          uint16_t off = addr - VRAM_BASE;
 
-          p->colors[palette][color_index] = col;
+          off += 0x2000 * gb->vram_high_bank;
 
-          if (p->auto_increment) {
-               p->write_index = (p->write_index + 1) & 0x3f;
-          }
+          gb_gpu_sync(gb);
+          gb->vram[off] = val;
+          gb_gpu_vram_written(gb, off);
+          return;
+     }
 
+     if (addr >= CRAM_BASE && addr < CRAM_END) {
+          gb_cart_ram_writeb(gb, addr - CRAM_BASE, val);
           return;
      }
 
-     if (gb->gbc && addr == REG_SVBK) {
-          gb->iram_high_bank = val & 7;
+     if (addr >= OAM_BASE && addr < OAM_END) {
+          gb_gpu_sync(gb);
+          gb_gpu_write_oam(gb, addr - OAM_BASE, val);
           return;
      }
 
      printf("Unsupported write at address 0x%04x [val=0x%02x]\n", addr, val);
 }
+
+void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
+     uint8_t *page = gb->memory.write_map[addr >> 8];
+
+     if (page != NULL) {
+          page[addr & 0xff] = val;
+          return;
+     }
+
+     gb_memory_writeb_slow(gb, addr, val);
+}
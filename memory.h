@@ -1,6 +1,31 @@
 #ifndef _GB_MEMORY_H_
 #define _GB_MEMORY_H_
 
+/* The address space is split in 256-byte pages for the memory map */
+#define GB_MEMORY_PAGE_SIZE 0x100U
+#define GB_MEMORY_PAGES     0x100U
+
+typedef uint8_t (*gb_memory_io_read_f)(struct gb *gb, uint16_t addr);
+typedef void (*gb_memory_io_write_f)(struct gb *gb, uint16_t addr, uint8_t val);
+
+struct gb_memory {
+     /* Host address of every page of the address space for reads, or NULL if
+      * the page isn't plain memory and must go through the slow path */
+     _Alignas(GB_CACHE_LINE) const uint8_t *read_map[GB_MEMORY_PAGES];
+     /* Same thing for writes */
+     uint8_t *write_map[GB_MEMORY_PAGES];
+     /* Registers in 0xff00-0xffff, indexed by the low byte of the address.
+      * Registers without side effects point directly to their storage,
+      * otherwise the pointer is NULL and the access goes through the
+      * handler. */
+     const uint8_t *io_read_direct[0x100];
+     uint8_t *io_write_direct[0x100];
+     gb_memory_io_read_f io_read[0x100];
+     gb_memory_io_write_f io_write[0x100];
+};
+
+void gb_memory_reset(struct gb *gb);
+void gb_memory_map_cart(struct gb *gb);
 uint8_t gb_memory_readb(struct gb *gb, uint16_t addr);
 void    gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val);
 
@@ -0,0 +1,104 @@
+#include "opcode.h"
+
+/* This file doesn't depend on the rest of the emulator so that it can be
+ * shared with the static recompiler */
+
+const uint8_t gb_opcode_len[0x100] = {
+     /* 0x00 */
+     1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,
+     /* 0x10 */
+     1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+     /* 0x20 */
+     2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+     /* 0x30 */
+     2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+     /* 0x40 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+     /* 0x50 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+     /* 0x60 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+     /* 0x70 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+     /* 0x80 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+     /* 0x90 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+     /* 0xa0 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+     /* 0xb0 */
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+     /* 0xc0 */
+     1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+     /* 0xd0 */
+     1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,
+     /* 0xe0 */
+     2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+     /* 0xf0 */
+     2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+};
+
+/* Returns true if `opcode` can change the control flow or the interrupt
+ * state of the CPU: jumps, calls, returns, HALT, STOP, EI and undefined
+ * opcodes. Straight-line blocks of code end with such an instruction. */
+bool gb_opcode_ends_block(uint8_t opcode) {
+     switch (opcode) {
+     /* STOP */
+     case 0x10:
+     /* JR */
+     case 0x18:
+     case 0x20:
+     case 0x28:
+     case 0x30:
+     case 0x38:
+     /* HALT */
+     case 0x76:
+     /* RET */
+     case 0xc0:
+     case 0xc8:
+     case 0xc9:
+     case 0xd0:
+     case 0xd8:
+     /* RETI */
+     case 0xd9:
+     /* JP */
+     case 0xc2:
+     case 0xc3:
+     case 0xca:
+     case 0xd2:
+     case 0xda:
+     case 0xe9:
+     /* CALL */
+     case 0xc4:
+     case 0xcc:
+     case 0xcd:
+     case 0xd4:
+     case 0xdc:
+     /* RST */
+     case 0xc7:
+     case 0xcf:
+     case 0xd7:
+     case 0xdf:
+     case 0xe7:
+     case 0xef:
+     case 0xf7:
+     case 0xff:
+     /* EI */
+     case 0xfb:
+     /* Undefined */
+     case 0xd3:
+     case 0xdb:
+     case 0xdd:
+     case 0xe3:
+     case 0xe4:
+     case 0xeb:
+     case 0xec:
+     case 0xed:
+     case 0xf4:
+     case 0xfc:
+     case 0xfd:
+          return true;
+     default:
+          return false;
+     }
+}
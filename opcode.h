@@ -0,0 +1,12 @@
+#ifndef _GB_OPCODE_H_
+#define _GB_OPCODE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Length in bytes of every instruction, including the opcode */
+extern const uint8_t gb_opcode_len[0x100];
+
+bool gb_opcode_ends_block(uint8_t opcode);
+
+#endif /* _GB_OPCODE_H_ */
@@ -0,0 +1,291 @@
+#include "gb.h"
+
+/*
+ * Pixel processing kernels
+ *
+ * The tile data is stored as two bitplanes: each row of 8 pixels is made of
+ * one byte holding the low bit of every pixel followed by one byte holding the
+ * high bits. Converting these to one color index per pixel and then the
+ * indices to palette colors is done for whole tiles and whole lines at once,
+ * which lends itself well to SIMD.
+ *
+ * We have a portable scalar version of every kernel, always built, and SSE2
+ * and AVX2 versions on x86-64 unless GB_PIXEL_NO_SIMD is defined. The best
+ * set supported by the host is picked at runtime by gb_pixel_get_kernels,
+ * falling back to the scalar kernels.
+ */
+
+static void gb_pixel_decode_tile_scalar(const uint8_t *data,
+                                        struct gb_gpu_tile_row *rows) {
+     unsigned y, x;
+
+     for (y = 0; y < 8; y++) {
+          /* The pixel value is two bits split across two contiguous bytes */
+          unsigned lsb = data[y * 2 + 0];
+          unsigned msb = data[y * 2 + 1];
+
+          for (x = 0; x < 8; x++) {
+               /* Pixel data is stored "backwards" in VRAM: the leftmost pixel
+                * (x = 0) is stored in the MSB (byte >> 7) */
+               unsigned shift = 7 - x;
+               uint8_t col = (((msb >> shift) & 1) << 1) | ((lsb >> shift) & 1);
+
+               rows[y].pix[0][x] = col;
+               rows[y].pix[1][7 - x] = col;
+          }
+     }
+}
+
+static void gb_pixel_map_dmg_scalar(union gb_gpu_color *out,
+                                    const uint8_t *col, unsigned n,
+                                    uint8_t palette) {
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          out[i].dmg_color = (palette >> (2 * col[i])) & 3;
+     }
+}
+
+static void gb_pixel_map_gbc_scalar(union gb_gpu_color *out,
+                                    const uint8_t *col, unsigned n,
+                                    const struct gb_color_palette *palette) {
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          out[i].gbc_color = palette->colors[col[i] >> 2][col[i] & 3];
+     }
+}
+
+/* Used when the host has no vector kernels. The vector kernels also handle
+ * the remainder of their loops with the scalar palette mappers. */
+static const struct gb_pixel_kernels gb_pixel_scalar = {
+     .name = "scalar",
+     .decode_tile = gb_pixel_decode_tile_scalar,
+     .map_dmg = gb_pixel_map_dmg_scalar,
+     .map_gbc = gb_pixel_map_gbc_scalar,
+};
+
+#if defined(__x86_64__) && !defined(GB_PIXEL_NO_SIMD)
+
+#include <immintrin.h>
+
+/* The vector kernels store whole rows and colors at once, they rely on the
+ * exact layout of these types. The color stores also assume a little-endian
+ * host, which x86 is. */
+_Static_assert(sizeof(struct gb_gpu_tile_row) == 16,
+               "Unexpected tile row layout");
+_Static_assert(sizeof(union gb_gpu_color) == 4,
+               "Unexpected color layout");
+
+/* Mask selecting the bit of each pixel in a bitplane byte. A tile row holds
+ * the 8 pixels from left to right followed by the same pixels flipped, the
+ * leftmost pixel being the MSB. */
+#define GB_PIXEL_ROW_BITS                                               \
+     0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,                    \
+     0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80
+
+static void gb_pixel_decode_tile_sse2(const uint8_t *data,
+                                      struct gb_gpu_tile_row *rows) {
+     const __m128i bits = _mm_setr_epi8(GB_PIXEL_ROW_BITS);
+     const __m128i one = _mm_set1_epi8(1);
+     const __m128i two = _mm_set1_epi8(2);
+     unsigned y;
+
+     for (y = 0; y < 8; y++) {
+          __m128i lsb = _mm_set1_epi8(data[y * 2 + 0]);
+          __m128i msb = _mm_set1_epi8(data[y * 2 + 1]);
+
+          /* 0xff in every lane where the pixel's bit is set */
+          lsb = _mm_cmpeq_epi8(_mm_and_si128(lsb, bits), bits);
+          msb = _mm_cmpeq_epi8(_mm_and_si128(msb, bits), bits);
+
+          _mm_storeu_si128((__m128i *)&rows[y],
+                           _mm_or_si128(_mm_and_si128(lsb, one),
+                                        _mm_and_si128(msb, two)));
+     }
+}
+
+/* Widen 16 8-bit colors to 32 bits and store them */
+static void gb_pixel_store_sse2(union gb_gpu_color *out, __m128i c) {
+     const __m128i zero = _mm_setzero_si128();
+     __m128i lo = _mm_unpacklo_epi8(c, zero);
+     __m128i hi = _mm_unpackhi_epi8(c, zero);
+
+     _mm_storeu_si128((__m128i *)&out[0], _mm_unpacklo_epi16(lo, zero));
+     _mm_storeu_si128((__m128i *)&out[4], _mm_unpackhi_epi16(lo, zero));
+     _mm_storeu_si128((__m128i *)&out[8], _mm_unpacklo_epi16(hi, zero));
+     _mm_storeu_si128((__m128i *)&out[12], _mm_unpackhi_epi16(hi, zero));
+}
+
+static void gb_pixel_map_dmg_sse2(union gb_gpu_color *out,
+                                  const uint8_t *col, unsigned n,
+                                  uint8_t palette) {
+     __m128i shades[4];
+     unsigned i, k;
+
+     for (k = 0; k < 4; k++) {
+          shades[k] = _mm_set1_epi8((palette >> (2 * k)) & 3);
+     }
+
+     /* There's no byte shuffle in SSE2 so we select the shade matching each
+      * of the 4 possible indices */
+     for (i = 0; i + 16 <= n; i += 16) {
+          __m128i c = _mm_loadu_si128((const __m128i *)&col[i]);
+          __m128i r = _mm_setzero_si128();
+
+          for (k = 0; k < 4; k++) {
+               __m128i m = _mm_cmpeq_epi8(c, _mm_set1_epi8(k));
+
+               r = _mm_or_si128(r, _mm_and_si128(m, shades[k]));
+          }
+
+          gb_pixel_store_sse2(&out[i], r);
+     }
+
+     gb_pixel_map_dmg_scalar(&out[i], &col[i], n - i, palette);
+}
+
+static const struct gb_pixel_kernels gb_pixel_sse2 = {
+     .name = "SSE2",
+     .decode_tile = gb_pixel_decode_tile_sse2,
+     .map_dmg = gb_pixel_map_dmg_sse2,
+     /* Not worth it without a byte shuffle */
+     .map_gbc = gb_pixel_map_gbc_scalar,
+};
+
+__attribute__((target("avx2")))
+static void gb_pixel_decode_tile_avx2(const uint8_t *data,
+                                      struct gb_gpu_tile_row *rows) {
+     const __m256i bits =
+          _mm256_broadcastsi128_si256(_mm_setr_epi8(GB_PIXEL_ROW_BITS));
+     const __m256i one = _mm256_set1_epi8(1);
+     const __m256i two = _mm256_set1_epi8(2);
+     /* The whole tile in both 128-bit lanes */
+     const __m256i tile =
+          _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)data));
+     /* Shuffle broadcasting the LSB byte of row y to the first lane and the
+      * one of row y + 1 to the second lane */
+     const __m256i lsb_sel = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 0, 0, 0, 0, 0, 0, 0,
+                                              2, 2, 2, 2, 2, 2, 2, 2,
+                                              2, 2, 2, 2, 2, 2, 2, 2);
+     unsigned y;
+
+     /* Two rows at a time */
+     for (y = 0; y < 8; y += 2) {
+          __m256i sel = _mm256_add_epi8(lsb_sel, _mm256_set1_epi8(y * 2));
+          __m256i lsb = _mm256_shuffle_epi8(tile, sel);
+          __m256i msb = _mm256_shuffle_epi8(tile,
+                                            _mm256_add_epi8(sel, one));
+
+          lsb = _mm256_cmpeq_epi8(_mm256_and_si256(lsb, bits), bits);
+          msb = _mm256_cmpeq_epi8(_mm256_and_si256(msb, bits), bits);
+
+          _mm256_storeu_si256((__m256i *)&rows[y],
+                              _mm256_or_si256(_mm256_and_si256(lsb, one),
+                                              _mm256_and_si256(msb, two)));
+     }
+}
+
+__attribute__((target("avx2")))
+static void gb_pixel_map_dmg_avx2(union gb_gpu_color *out,
+                                  const uint8_t *col, unsigned n,
+                                  uint8_t palette) {
+     /* Indices are 0-3 so a byte shuffle does the whole palette lookup */
+     const __m256i shades =
+          _mm256_broadcastsi128_si256(_mm_setr_epi8((palette >> 0) & 3,
+                                                    (palette >> 2) & 3,
+                                                    (palette >> 4) & 3,
+                                                    (palette >> 6) & 3,
+                                                    0, 0, 0, 0,
+                                                    0, 0, 0, 0,
+                                                    0, 0, 0, 0));
+     unsigned i;
+
+     for (i = 0; i + 32 <= n; i += 32) {
+          __m256i c = _mm256_loadu_si256((const __m256i *)&col[i]);
+          __m256i r = _mm256_shuffle_epi8(shades, c);
+          __m128i lo = _mm256_castsi256_si128(r);
+          __m128i hi = _mm256_extracti128_si256(r, 1);
+
+          _mm256_storeu_si256((__m256i *)&out[i + 0],
+                              _mm256_cvtepu8_epi32(lo));
+          _mm256_storeu_si256((__m256i *)&out[i + 8],
+                              _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+          _mm256_storeu_si256((__m256i *)&out[i + 16],
+                              _mm256_cvtepu8_epi32(hi));
+          _mm256_storeu_si256((__m256i *)&out[i + 24],
+                              _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+     }
+
+     gb_pixel_map_dmg_scalar(&out[i], &col[i], n - i, palette);
+}
+
+__attribute__((target("avx2")))
+static void gb_pixel_map_gbc_avx2(union gb_gpu_color *out,
+                                  const uint8_t *col, unsigned n,
+                                  const struct gb_color_palette *palette) {
+     /* A byte shuffle only looks up 16 bytes, so we use the low and high
+      * bytes of the colors, already split by the palette writes, in two
+      * halves */
+     const uint8_t *lo_bytes = palette->color_bytes[0];
+     const uint8_t *hi_bytes = palette->color_bytes[1];
+     const __m128i lo_tables[2] = {
+          _mm_loadu_si128((const __m128i *)&lo_bytes[0]),
+          _mm_loadu_si128((const __m128i *)&lo_bytes[16]),
+     };
+     const __m128i hi_tables[2] = {
+          _mm_loadu_si128((const __m128i *)&hi_bytes[0]),
+          _mm_loadu_si128((const __m128i *)&hi_bytes[16]),
+     };
+     const __m128i fifteen = _mm_set1_epi8(15);
+     unsigned i;
+
+     for (i = 0; i + 16 <= n; i += 16) {
+          __m128i c = _mm_loadu_si128((const __m128i *)&col[i]);
+          /* Set for indices in the second half of the table. The shuffle
+           * only looks at the 4 low bits of the index. */
+          __m128i high_half = _mm_cmpgt_epi8(c, fifteen);
+          __m128i lo = _mm_blendv_epi8(_mm_shuffle_epi8(lo_tables[0], c),
+                                       _mm_shuffle_epi8(lo_tables[1], c),
+                                       high_half);
+          __m128i hi = _mm_blendv_epi8(_mm_shuffle_epi8(hi_tables[0], c),
+                                       _mm_shuffle_epi8(hi_tables[1], c),
+                                       high_half);
+
+          _mm256_storeu_si256((__m256i *)&out[i + 0],
+                              _mm256_cvtepu16_epi32(_mm_unpacklo_epi8(lo, hi)));
+          _mm256_storeu_si256((__m256i *)&out[i + 8],
+                              _mm256_cvtepu16_epi32(_mm_unpackhi_epi8(lo, hi)));
+     }
+
+     gb_pixel_map_gbc_scalar(&out[i], &col[i], n - i, palette);
+}
+
+static const struct gb_pixel_kernels gb_pixel_avx2 = {
+     .name = "AVX2",
+     .decode_tile = gb_pixel_decode_tile_avx2,
+     .map_dmg = gb_pixel_map_dmg_avx2,
+     .map_gbc = gb_pixel_map_gbc_avx2,
+};
+
+#endif /* __x86_64__ && !GB_PIXEL_NO_SIMD */
+
+/* Return the fastest kernels supported by the host CPU */
+const struct gb_pixel_kernels *gb_pixel_get_kernels(void) {
+#if defined(__x86_64__) && !defined(GB_PIXEL_NO_SIMD)
+     __builtin_cpu_init();
+
+     if (__builtin_cpu_supports("avx2")) {
+          return &gb_pixel_avx2;
+     }
+
+     /* SSE2 is part of the base x86-64 instruction set, this never fails in
+      * practice */
+     if (__builtin_cpu_supports("sse2")) {
+          return &gb_pixel_sse2;
+     }
+#endif
+
+     return &gb_pixel_scalar;
+}
@@ -0,0 +1,35 @@
+#ifndef _GB_PIXEL_H_
+#define _GB_PIXEL_H_
+
+struct gb_gpu_tile_row;
+union gb_gpu_color;
+struct gb_color_palette;
+
+/* Decode the 16 bytes of a tile in VRAM into its 8 rows of color indices,
+ * both in normal and horizontally flipped order */
+typedef void (*gb_pixel_decode_tile_f)(const uint8_t *data,
+                                       struct gb_gpu_tile_row *rows);
+/* Convert `n` DMG color indices to shades through `palette` (BGP, OBP0 or
+ * OBP1) */
+typedef void (*gb_pixel_map_dmg_f)(union gb_gpu_color *out,
+                                   const uint8_t *col, unsigned n,
+                                   uint8_t palette);
+/* Convert `n` GBC color indices to colors through `palette`. Each index is
+ * the palette number times 4 plus the color within the palette. */
+typedef void (*gb_pixel_map_gbc_f)(union gb_gpu_color *out,
+                                   const uint8_t *col, unsigned n,
+                                   const struct gb_color_palette *palette);
+
+/* Pixel processing kernels, specialized for the instruction sets supported by
+ * the host */
+struct gb_pixel_kernels {
+     /* Instruction set used by the kernels, for display purposes */
+     const char *name;
+     gb_pixel_decode_tile_f decode_tile;
+     gb_pixel_map_dmg_f map_dmg;
+     gb_pixel_map_gbc_f map_gbc;
+};
+
+const struct gb_pixel_kernels *gb_pixel_get_kernels(void);
+
+#endif /* _GB_PIXEL_H_ */
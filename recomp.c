@@ -0,0 +1,1493 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "gb.h"
+
+/*
+ * Static recompiler
+ *
+ * Walks the code reachable from the entry points of the ROM and translates
+ * every block found along the way to C. Each instruction becomes a few lines
+ * of C working directly on the registers and lazy flags in `struct gb`, with
+ * the same bus accesses and clock ticks, in the same order, as its handler in
+ * cpu.c. The result can be compiled into a shared object and loaded by the
+ * emulator with --aot:
+ *
+ *   gaembuoy-recomp game.gb game.c
+ *   cc -shared -fPIC -O2 -I<gaembuoy source dir> -o game.so game.c
+ *   gaembuoy --aot game.so game.gb
+ *
+ * Blocks go on after a conditional branch that isn't taken, and branches to
+ * an instruction of the same block are plain gotos so that most loops run
+ * without leaving the block. Between two instructions the generated code
+ * does the same checks as the interpreter between two instructions of a
+ * block.
+ *
+ * We don't know which bank is mapped at 0x4000-0x7fff statically. Targets in
+ * the switchable area found in a switchable bank are explored in that same
+ * bank. Targets found in bank 0 are explored in bank 1, mapped at reset, and
+ * in every bank the code selects with an immediate value (`ld a, n` followed
+ * by `ld (2000h), a` and the like). Code in banks selected any other way
+ * isn't recompiled: the emulator won't find a block for it and falls back to
+ * the JIT or the interpreter. It also checks that the bank mapped at runtime
+ * matches the one the block has been compiled for.
+ */
+
+/* Maximum number of instructions in a single block */
+#define RECOMP_MAX_BLOCK_LEN 64
+
+/* Code analysis state */
+struct recomp {
+     /* Full ROM contents */
+     uint8_t *rom;
+     /* ROM length in bytes */
+     uint32_t rom_length;
+     /* Number of complete ROM banks */
+     unsigned rom_banks;
+     /* Block start flags, one per byte of ROM */
+     bool *is_block;
+     /* Stack of ROM offsets left to explore */
+     uint32_t *pending;
+     /* Number of entries in `pending` */
+     uint32_t npending;
+     /* Banks that can be mapped in the switchable area, one flag per bank */
+     bool *bank_seen;
+     /* Targets in the switchable area found in bank 0. They're explored again
+      * every time we find a new bank. */
+     uint16_t *bank0_targets;
+     /* Number of entries in `bank0_targets` */
+     uint32_t nbank0_targets;
+     /* Flags of the addresses in `bank0_targets`, indexed by address -
+      * GB_ROM_BANK_SIZE */
+     bool *is_bank0_target;
+};
+
+/* Instruction to recompile */
+struct recomp_insn {
+     /* Address of the instruction */
+     uint16_t pc;
+     uint8_t opcode;
+     /* The two bytes following the opcode */
+     uint8_t operands[2];
+};
+
+static void recomp_add_block(struct recomp *r, unsigned bank, uint16_t pc) {
+     uint32_t rom_off;
+
+     if (pc >= 0x8000 || bank >= r->rom_banks) {
+          /* Not in ROM, we can't do anything with this */
+          return;
+     }
+
+     if (pc < GB_ROM_BANK_SIZE) {
+          rom_off = pc;
+     } else {
+          rom_off = bank * GB_ROM_BANK_SIZE + (pc - GB_ROM_BANK_SIZE);
+     }
+
+     if (r->is_block[rom_off]) {
+          /* Already explored */
+          return;
+     }
+
+     r->is_block[rom_off] = true;
+     r->pending[r->npending++] = rom_off;
+}
+
+/* Add a jump target found in code running in `bank` */
+static void recomp_add_target(struct recomp *r, unsigned bank, uint16_t pc) {
+     unsigned b;
+
+     if (pc < GB_ROM_BANK_SIZE || pc >= 0x8000 || bank != 0) {
+          recomp_add_block(r, bank, pc);
+          return;
+     }
+
+     /* Jump from bank 0 into the switchable area, it could be any of the banks
+      * the code selects */
+     if (r->is_bank0_target[pc - GB_ROM_BANK_SIZE]) {
+          return;
+     }
+
+     r->is_bank0_target[pc - GB_ROM_BANK_SIZE] = true;
+     r->bank0_targets[r->nbank0_targets++] = pc;
+
+     for (b = 1; b < r->rom_banks; b++) {
+          if (r->bank_seen[b]) {
+               recomp_add_block(r, b, pc);
+          }
+     }
+}
+
+/* The code writes `v` to the ROM bank register of the mapper */
+static void recomp_add_bank(struct recomp *r, uint8_t v) {
+     unsigned bank = v % r->rom_banks;
+     uint32_t i;
+
+     if (bank == 0) {
+          /* Most mappers select bank 1 instead */
+          bank = 1;
+     }
+
+     if (r->bank_seen[bank]) {
+          return;
+     }
+
+     r->bank_seen[bank] = true;
+
+     for (i = 0; i < r->nbank0_targets; i++) {
+          recomp_add_block(r, bank, r->bank0_targets[i]);
+     }
+}
+
+/* Returns false if `opcode` must be left to the interpreter */
+static bool recomp_supported(uint8_t opcode) {
+     switch (opcode) {
+     /* STOP, HALT */
+     case 0x10:
+     case 0x76:
+     /* Undefined */
+     case 0xd3:
+     case 0xdb:
+     case 0xdd:
+     case 0xe3:
+     case 0xe4:
+     case 0xeb:
+     case 0xec:
+     case 0xed:
+     case 0xf4:
+     case 0xfc:
+     case 0xfd:
+          return false;
+     default:
+          return true;
+     }
+}
+
+/* Returns true if execution can continue with the next instruction after
+ * `opcode` */
+static bool recomp_falls_through(uint8_t opcode) {
+     switch (opcode) {
+     /* JR */
+     case 0x18:
+     /* RET */
+     case 0xc9:
+     /* RETI */
+     case 0xd9:
+     /* JP */
+     case 0xc3:
+     case 0xe9:
+     /* Undefined */
+     case 0xd3:
+     case 0xdb:
+     case 0xdd:
+     case 0xe3:
+     case 0xe4:
+     case 0xeb:
+     case 0xec:
+     case 0xed:
+     case 0xf4:
+     case 0xfc:
+     case 0xfd:
+          return false;
+     default:
+          return true;
+     }
+}
+
+/* Returns true if the block ends with `opcode`. Unlike the interpreter blocks
+ * we go on after a conditional branch, the branch not taken simply falls
+ * through to the next instruction. */
+static bool recomp_ends_block(uint8_t opcode) {
+     switch (opcode) {
+     /* JR cc */
+     case 0x20:
+     case 0x28:
+     case 0x30:
+     case 0x38:
+     /* RET cc */
+     case 0xc0:
+     case 0xc8:
+     case 0xd0:
+     case 0xd8:
+     /* JP cc */
+     case 0xc2:
+     case 0xca:
+     case 0xd2:
+     case 0xda:
+     /* CALL cc */
+     case 0xc4:
+     case 0xcc:
+     case 0xd4:
+     case 0xdc:
+          return false;
+     default:
+          return gb_opcode_ends_block(opcode);
+     }
+}
+
+/* Returns true if the instruction `insn` modifies A */
+static bool recomp_writes_a(const uint8_t *insn) {
+     uint8_t opcode = insn[0];
+
+     if (opcode >= 0x78 && opcode < 0x80) {
+          /* LD A, r */
+          return true;
+     }
+
+     if (opcode >= 0x80 && opcode < 0xb8) {
+          /* ALU A, r except CP */
+          return true;
+     }
+
+     if (opcode == 0xcb) {
+          /* Everything but BIT on A */
+          return (insn[1] & 7) == 7 && (insn[1] & 0xc0) != 0x40;
+     }
+
+     switch (opcode) {
+     /* LD A, (rr) */
+     case 0x0a:
+     case 0x1a:
+     case 0x2a:
+     case 0x3a:
+     /* INC A, DEC A, LD A, i8 */
+     case 0x3c:
+     case 0x3d:
+     case 0x3e:
+     /* RLCA, RRCA, RLA, RRA, DAA, CPL */
+     case 0x07:
+     case 0x0f:
+     case 0x17:
+     case 0x1f:
+     case 0x27:
+     case 0x2f:
+     /* ALU A, i8 except CP */
+     case 0xc6:
+     case 0xce:
+     case 0xd6:
+     case 0xde:
+     case 0xe6:
+     case 0xee:
+     case 0xf6:
+     /* LDH A, (i8), LD A, (C), LD A, (i16) */
+     case 0xf0:
+     case 0xf2:
+     case 0xfa:
+     /* POP AF */
+     case 0xf1:
+          return true;
+     default:
+          return false;
+     }
+}
+
+/* Get the static branch target of `insn`. Returns false if it doesn't have
+ * one. */
+static bool recomp_branch_target(const struct recomp_insn *insn,
+                                 uint16_t *target) {
+     uint8_t opcode = insn->opcode;
+
+     switch (opcode) {
+     /* JR */
+     case 0x18:
+     case 0x20:
+     case 0x28:
+     case 0x30:
+     case 0x38:
+          *target = (insn->pc + 2 + (int8_t)insn->operands[0]) & 0xffff;
+          return true;
+     /* JP */
+     case 0xc2:
+     case 0xc3:
+     case 0xca:
+     case 0xd2:
+     case 0xda:
+     /* CALL */
+     case 0xc4:
+     case 0xcc:
+     case 0xcd:
+     case 0xd4:
+     case 0xdc:
+          *target = insn->operands[0] | (insn->operands[1] << 8);
+          return true;
+     /* RST */
+     case 0xc7:
+     case 0xcf:
+     case 0xd7:
+     case 0xdf:
+     case 0xe7:
+     case 0xef:
+     case 0xf7:
+     case 0xff:
+          *target = opcode & 0x38;
+          return true;
+     default:
+          return false;
+     }
+}
+
+/* Decode the block starting at `rom_off`. Fills `insns` and returns the
+ * number of instructions in the block, or 0 if it can't be recompiled. Adds
+ * the successors of the block to the list of blocks to explore. */
+static unsigned recomp_decode_block(struct recomp *r, uint32_t rom_off,
+                                    struct recomp_insn *insns) {
+     unsigned bank = rom_off / GB_ROM_BANK_SIZE;
+     /* Value of A if an instruction of the block loaded it with an
+      * immediate, -1 otherwise */
+     int a_imm = -1;
+     uint16_t pc;
+     unsigned n;
+
+     if (bank == 0) {
+          pc = rom_off;
+     } else {
+          pc = GB_ROM_BANK_SIZE + (rom_off % GB_ROM_BANK_SIZE);
+     }
+
+     for (n = 0; n < RECOMP_MAX_BLOCK_LEN; n++) {
+          const uint8_t *insn;
+          uint8_t opcode;
+          uint16_t next_pc;
+          uint16_t target;
+
+          if ((pc & (GB_ROM_BANK_SIZE - 1)) > GB_ROM_BANK_SIZE - 3) {
+               /* The operands could be in a different bank, the emulator won't
+                * run recompiled code for such an instruction */
+               recomp_add_target(r, bank, pc);
+               return n;
+          }
+
+          insn = &r->rom[rom_off];
+          opcode = insn[0];
+          next_pc = (pc + gb_opcode_len[opcode]) & 0xffff;
+
+          if (!recomp_supported(opcode)) {
+               /* Left to the interpreter, the block stops right before it */
+               if (recomp_falls_through(opcode)) {
+                    recomp_add_target(r, bank, next_pc);
+               }
+               return n;
+          }
+
+          insns[n].pc = pc;
+          insns[n].opcode = opcode;
+          insns[n].operands[0] = insn[1];
+          insns[n].operands[1] = insn[2];
+
+          if (recomp_branch_target(&insns[n], &target)) {
+               recomp_add_target(r, bank, target);
+          }
+
+          if (opcode == 0xea && insn[2] >= 0x20 && insn[2] < 0x40 &&
+              a_imm >= 0) {
+               /* LD (i16), A to the ROM bank register */
+               recomp_add_bank(r, a_imm);
+          }
+
+          if (opcode == 0x3e) {
+               a_imm = insn[1];
+          } else if (recomp_writes_a(insn)) {
+               a_imm = -1;
+          }
+
+          if (recomp_ends_block(opcode)) {
+               if (recomp_falls_through(opcode)) {
+                    recomp_add_target(r, bank, next_pc);
+               }
+               return n + 1;
+          }
+
+          if (pc < GB_ROM_BANK_SIZE && next_pc >= GB_ROM_BANK_SIZE) {
+               /* We're leaving bank 0 for the switchable area */
+               recomp_add_target(r, bank, next_pc);
+               return n + 1;
+          }
+
+          rom_off += next_pc - pc;
+          pc = next_pc;
+     }
+
+     /* Block too long, continue in a new one */
+     recomp_add_target(r, bank, pc);
+
+     return n;
+}
+
+static void recomp_load_rom(struct recomp *r, const char *path) {
+     FILE *f = fopen(path, "rb");
+     long l;
+
+     if (f == NULL) {
+          perror("Can't open ROM file");
+          die();
+     }
+
+     if (fseek(f, 0, SEEK_END) < 0 || (l = ftell(f)) < 0) {
+          perror("Can't get ROM file length");
+          die();
+     }
+
+     if (l < 2 * GB_ROM_BANK_SIZE) {
+          fprintf(stderr, "ROM file is too small!\n");
+          die();
+     }
+
+     rewind(f);
+
+     r->rom_length = l;
+     r->rom_banks = r->rom_length / GB_ROM_BANK_SIZE;
+     r->rom = malloc(r->rom_length);
+     r->is_block = calloc(r->rom_length, sizeof(*r->is_block));
+     r->pending = malloc(r->rom_length * sizeof(*r->pending));
+     r->npending = 0;
+     r->bank_seen = calloc(r->rom_banks, sizeof(*r->bank_seen));
+     r->bank0_targets = malloc(GB_ROM_BANK_SIZE * sizeof(*r->bank0_targets));
+     r->nbank0_targets = 0;
+     r->is_bank0_target = calloc(GB_ROM_BANK_SIZE,
+                                 sizeof(*r->is_bank0_target));
+
+     if (r->rom == NULL || r->is_block == NULL || r->pending == NULL ||
+         r->bank_seen == NULL || r->bank0_targets == NULL ||
+         r->is_bank0_target == NULL) {
+          perror("malloc failed");
+          die();
+     }
+
+     if (fread(r->rom, 1, r->rom_length, f) != r->rom_length) {
+          perror("Can't read ROM file");
+          die();
+     }
+
+     fclose(f);
+
+     /* Bank 1 is mapped at reset */
+     r->bank_seen[1] = true;
+}
+
+/*
+ * Code generation
+ */
+
+/* Definitions at the start of every generated file. The helpers do the same
+ * thing as their counterparts in cpu.c. */
+static const char recomp_preamble[] =
+     "#include \"gb.h\"\n"
+     "\n"
+     "/* Advance the clock by `mcycles` machine cycles */\n"
+     "static inline void aot_tick(struct gb *gb, int32_t mcycles) {\n"
+     "     gb->timestamp += mcycles * gb->mcycle_duration;\n"
+     "}\n"
+     "\n"
+     "/* Same as gb_cpu_readb. Memory that can't be observed by the devices\n"
+     " * is read directly, everything else goes through the emulator. */\n"
+     "static inline uint8_t aot_readb(struct gb *gb,\n"
+     "                                const struct gb_aot_ops *ops,\n"
+     "                                uint16_t addr) {\n"
+     "     const uint8_t *page = gb->memory.read_map[addr >> 8];\n"
+     "     uint8_t v;\n"
+     "\n"
+     "     if (addr >= 0xff80 && addr < 0xffff) {\n"
+     "          v = gb->zram[addr - 0xff80];\n"
+     "     } else if (page != NULL &&\n"
+     "                (addr < 0x8000 || (addr >= 0xc000 && addr < 0xfe00))) {\n"
+     "          v = page[addr & 0xff];\n"
+     "     } else {\n"
+     "          v = ops->readb(gb, addr);\n"
+     "     }\n"
+     "\n"
+     "     aot_tick(gb, 1);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "/* Same as gb_cpu_writeb */\n"
+     "static inline void aot_writeb(struct gb *gb,\n"
+     "                              const struct gb_aot_ops *ops,\n"
+     "                              uint16_t addr, uint8_t v) {\n"
+     "     uint8_t *page = gb->memory.write_map[addr >> 8];\n"
+     "\n"
+     "     if (addr >= 0xff80 && addr < 0xffff) {\n"
+     "          gb->zram[addr - 0xff80] = v;\n"
+     "     } else if (page != NULL && addr >= 0xc000 && addr < 0xfe00 &&\n"
+     "                !gb->dma.running && !gb->hdma.run_on_hblank) {\n"
+     "          page[addr & 0xff] = v;\n"
+     "     } else {\n"
+     "          ops->writeb(gb, addr, v);\n"
+     "     }\n"
+     "\n"
+     "     aot_tick(gb, 1);\n"
+     "}\n"
+     "\n"
+     "static inline void aot_pushb(struct gb *gb,\n"
+     "                             const struct gb_aot_ops *ops, uint8_t v) {\n"
+     "     gb->cpu.sp--;\n"
+     "     aot_writeb(gb, ops, gb->cpu.sp, v);\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_popb(struct gb *gb,\n"
+     "                               const struct gb_aot_ops *ops) {\n"
+     "     uint8_t v = aot_readb(gb, ops, gb->cpu.sp);\n"
+     "\n"
+     "     gb->cpu.sp++;\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "/* Instruction boundary before the instruction at `pc`. Returns false if\n"
+     " * the main loop has something to do first, in which case the block must\n"
+     " * return. `bank_off` is the ROM bank the block has been compiled for. */\n"
+     "static inline bool aot_next(struct gb *gb, const struct gb_aot_ops *ops,\n"
+     "                            uint16_t pc, uint32_t bank_off) {\n"
+     "     if (gb->timestamp >= gb->sync.first_event) {\n"
+     "          ops->check_events(gb);\n"
+     "     }\n"
+     "\n"
+     "     if (gb->timestamp >= gb->cpu.limit || gb->irq.pending ||\n"
+     "         (pc >= GB_ROM_BANK_SIZE && gb->cart.rom_bank_off != bank_off)) {\n"
+     "          gb->cpu.pc = pc;\n"
+     "          return false;\n"
+     "     }\n"
+     "\n"
+     "     return true;\n"
+     "}\n"
+     "\n"
+     "static inline bool aot_flag_z(const struct gb_cpu *cpu) {\n"
+     "     return (cpu->f_res & 0xff) == 0;\n"
+     "}\n"
+     "\n"
+     "static inline bool aot_flag_h(const struct gb_cpu *cpu) {\n"
+     "     return (cpu->f_op_a ^ cpu->f_op_b ^ cpu->f_res) & 0x10;\n"
+     "}\n"
+     "\n"
+     "static inline bool aot_flag_c(const struct gb_cpu *cpu) {\n"
+     "     return cpu->f_res & 0x100;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_set_alu_flags(struct gb_cpu *cpu, uint16_t r,\n"
+     "                                     uint8_t a, uint8_t b, bool n) {\n"
+     "     cpu->f_res = r;\n"
+     "     cpu->f_op_a = a;\n"
+     "     cpu->f_op_b = b;\n"
+     "     cpu->f_n = n;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_set_flags(struct gb_cpu *cpu,\n"
+     "                                 bool z, bool n, bool h, bool c) {\n"
+     "     cpu->f_res = ((uint16_t)c << 8) | !z;\n"
+     "     cpu->f_op_a = h << 4;\n"
+     "     cpu->f_op_b = 0;\n"
+     "     cpu->f_n = n;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_get_f(const struct gb_cpu *cpu) {\n"
+     "     return (aot_flag_z(cpu) << 7) | (cpu->f_n << 6) |\n"
+     "          (aot_flag_h(cpu) << 5) | (aot_flag_c(cpu) << 4);\n"
+     "}\n"
+     "\n"
+     "static inline void aot_set_f(struct gb_cpu *cpu, uint8_t f) {\n"
+     "     aot_set_flags(cpu, f & 0x80, f & 0x40, f & 0x20, f & 0x10);\n"
+     "}\n"
+     "\n"
+     "static inline void aot_add(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint16_t r = cpu->a + v;\n"
+     "\n"
+     "     aot_set_alu_flags(cpu, r, cpu->a, v, false);\n"
+     "     cpu->a = r;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_adc(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint16_t r = cpu->a + v + aot_flag_c(cpu);\n"
+     "\n"
+     "     aot_set_alu_flags(cpu, r, cpu->a, v, false);\n"
+     "     cpu->a = r;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_sub(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint16_t r = cpu->a - v;\n"
+     "\n"
+     "     aot_set_alu_flags(cpu, r, cpu->a, v, true);\n"
+     "     cpu->a = r;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_sbc(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint16_t r = cpu->a - v - aot_flag_c(cpu);\n"
+     "\n"
+     "     aot_set_alu_flags(cpu, r, cpu->a, v, true);\n"
+     "     cpu->a = r;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_and(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t r = cpu->a & v;\n"
+     "\n"
+     "     /* Half-carry is always set */\n"
+     "     aot_set_alu_flags(cpu, r, r ^ 0x10, 0, false);\n"
+     "     cpu->a = r;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_xor(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t r = cpu->a ^ v;\n"
+     "\n"
+     "     aot_set_alu_flags(cpu, r, r, 0, false);\n"
+     "     cpu->a = r;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_or(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t r = cpu->a | v;\n"
+     "\n"
+     "     aot_set_alu_flags(cpu, r, r, 0, false);\n"
+     "     cpu->a = r;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_cp(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint16_t r = cpu->a - v;\n"
+     "\n"
+     "     aot_set_alu_flags(cpu, r, cpu->a, v, true);\n"
+     "}\n"
+     "\n"
+     "/* INC r and DEC r don't modify the carry */\n"
+     "static inline uint8_t aot_inc(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t r = v + 1;\n"
+     "\n"
+     "     cpu->f_res = (cpu->f_res & 0x100) | r;\n"
+     "     cpu->f_op_a = v;\n"
+     "     cpu->f_op_b = 1;\n"
+     "     cpu->f_n = false;\n"
+     "\n"
+     "     return r;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_dec(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t r = v - 1;\n"
+     "\n"
+     "     cpu->f_res = (cpu->f_res & 0x100) | r;\n"
+     "     cpu->f_op_a = v;\n"
+     "     cpu->f_op_b = 1;\n"
+     "     cpu->f_n = true;\n"
+     "\n"
+     "     return r;\n"
+     "}\n"
+     "\n"
+     "/* ADD HL, rr: Z isn't modified */\n"
+     "static inline uint16_t aot_addw(struct gb_cpu *cpu,\n"
+     "                                uint16_t a, uint16_t b) {\n"
+     "     uint32_t r = (uint32_t)a + b;\n"
+     "\n"
+     "     aot_set_flags(cpu, aot_flag_z(cpu), false,\n"
+     "                   (a ^ b ^ r) & 0x1000, r & 0x10000);\n"
+     "\n"
+     "     return r;\n"
+     "}\n"
+     "\n"
+     "/* SP + e for ADD SP, e and LD HL, SP + e */\n"
+     "static inline uint16_t aot_add_sp(struct gb_cpu *cpu, int8_t e) {\n"
+     "     int32_t r = cpu->sp + e;\n"
+     "\n"
+     "     aot_set_flags(cpu, false, false,\n"
+     "                   (cpu->sp ^ e ^ r) & 0x10,\n"
+     "                   (cpu->sp ^ e ^ r) & 0x100);\n"
+     "\n"
+     "     return r;\n"
+     "}\n"
+     "\n"
+     "static inline void aot_daa(struct gb_cpu *cpu) {\n"
+     "     uint8_t a = cpu->a;\n"
+     "     uint8_t adj = 0;\n"
+     "\n"
+     "     if (aot_flag_h(cpu)) {\n"
+     "          adj |= 0x06;\n"
+     "     }\n"
+     "\n"
+     "     if (aot_flag_c(cpu)) {\n"
+     "          adj |= 0x60;\n"
+     "     }\n"
+     "\n"
+     "     if (cpu->f_n) {\n"
+     "          a -= adj;\n"
+     "     } else {\n"
+     "          if ((a & 0xf) > 0x09) {\n"
+     "               adj |= 0x06;\n"
+     "          }\n"
+     "\n"
+     "          if (a > 0x99) {\n"
+     "               adj |= 0x60;\n"
+     "          }\n"
+     "\n"
+     "          a += adj;\n"
+     "     }\n"
+     "\n"
+     "     cpu->a = a;\n"
+     "     aot_set_flags(cpu, a == 0, cpu->f_n, false, (adj & 0x60) != 0);\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_rlc(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t c = v >> 7;\n"
+     "\n"
+     "     v = (v << 1) | c;\n"
+     "     aot_set_alu_flags(cpu, ((uint16_t)c << 8) | v, v, 0, false);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_rrc(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t c = v & 1;\n"
+     "\n"
+     "     v = (v >> 1) | (c << 7);\n"
+     "     aot_set_alu_flags(cpu, ((uint16_t)c << 8) | v, v, 0, false);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_rl(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t c = v >> 7;\n"
+     "\n"
+     "     v = (v << 1) | aot_flag_c(cpu);\n"
+     "     aot_set_alu_flags(cpu, ((uint16_t)c << 8) | v, v, 0, false);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_rr(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t c = v & 1;\n"
+     "\n"
+     "     v = (v >> 1) | (aot_flag_c(cpu) << 7);\n"
+     "     aot_set_alu_flags(cpu, ((uint16_t)c << 8) | v, v, 0, false);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_sla(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t c = v >> 7;\n"
+     "\n"
+     "     v = v << 1;\n"
+     "     aot_set_alu_flags(cpu, ((uint16_t)c << 8) | v, v, 0, false);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_sra(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t c = v & 1;\n"
+     "\n"
+     "     v = (v >> 1) | (v & 0x80);\n"
+     "     aot_set_alu_flags(cpu, ((uint16_t)c << 8) | v, v, 0, false);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_swap(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     v = (v << 4) | (v >> 4);\n"
+     "     aot_set_alu_flags(cpu, v, v, 0, false);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n"
+     "static inline uint8_t aot_srl(struct gb_cpu *cpu, uint8_t v) {\n"
+     "     uint8_t c = v & 1;\n"
+     "\n"
+     "     v = v >> 1;\n"
+     "     aot_set_alu_flags(cpu, ((uint16_t)c << 8) | v, v, 0, false);\n"
+     "\n"
+     "     return v;\n"
+     "}\n"
+     "\n";
+
+/* Registers in the order used by the opcode encoding. (HL) has to be
+ * handled separately. */
+static const char *const recomp_reg8[8] = {
+     "cpu->b", "cpu->c", "cpu->d", "cpu->e", "cpu->h", "cpu->l", NULL, "cpu->a"
+};
+
+static const char *const recomp_reg16[4] = {
+     "cpu->bc", "cpu->de", "cpu->hl", "cpu->sp"
+};
+
+/* ALU operations in the order used by the opcode encoding */
+static const char *const recomp_alu[8] = {
+     "aot_add", "aot_adc", "aot_sub", "aot_sbc",
+     "aot_and", "aot_xor", "aot_or", "aot_cp"
+};
+
+/* Rotations and shifts of the 0xCB opcode map */
+static const char *const recomp_shift[8] = {
+     "aot_rlc", "aot_rrc", "aot_rl", "aot_rr",
+     "aot_sla", "aot_sra", "aot_swap", "aot_srl"
+};
+
+/* Branch conditions NZ, Z, NC and C */
+static const char *const recomp_cond[4] = {
+     "!aot_flag_z(cpu)", "aot_flag_z(cpu)", "!aot_flag_c(cpu)", "aot_flag_c(cpu)"
+};
+
+/* Code generation state for a block */
+struct recomp_emit {
+     FILE *out;
+     /* Instructions of the block */
+     const struct recomp_insn *insns;
+     /* Number of entries in `insns` */
+     unsigned n;
+     /* Offset of the ROM bank the block runs from */
+     uint32_t bank_off;
+     /* Machine cycles run since the generated code last updated the
+      * timestamp. Everything that can look at the timestamp must be
+      * preceded by a recomp_flush. */
+     unsigned pending;
+     /* Indentation level of the generated code */
+     unsigned indent;
+};
+
+/* Output one line of generated code */
+static void recomp_line(struct recomp_emit *e, const char *fmt, ...) {
+     va_list ap;
+     unsigned i;
+
+     if (fmt[0] == '\0') {
+          /* Don't indent empty lines */
+          fputc('\n', e->out);
+          return;
+     }
+
+     for (i = 0; i < e->indent; i++) {
+          fputs("     ", e->out);
+     }
+
+     va_start(ap, fmt);
+     vfprintf(e->out, fmt, ap);
+     va_end(ap);
+
+     fputc('\n', e->out);
+}
+
+/* Bring the timestamp up to date */
+static void recomp_flush(struct recomp_emit *e) {
+     if (e->pending > 0) {
+          recomp_line(e, "aot_tick(gb, %u);", e->pending);
+          e->pending = 0;
+     }
+}
+
+/* Returns the index of the instruction at `pc` in the block, -1 if it isn't
+ * part of it */
+static int recomp_find(const struct recomp_emit *e, uint16_t pc) {
+     unsigned i;
+
+     for (i = 0; i < e->n; i++) {
+          if (e->insns[i].pc == pc) {
+               return i;
+          }
+     }
+
+     return -1;
+}
+
+/* Continue with the instruction at `pc`, within the block if it's part of it,
+ * otherwise in the main loop */
+static void recomp_goto(struct recomp_emit *e, uint16_t pc) {
+     recomp_flush(e);
+
+     if (recomp_find(e, pc) < 0) {
+          recomp_line(e, "cpu->pc = 0x%04x;", pc);
+          recomp_line(e, "return;");
+          return;
+     }
+
+     recomp_line(e, "if (!aot_next(gb, ops, 0x%04x, 0x%x)) {", pc, e->bank_off);
+     recomp_line(e, "     return;");
+     recomp_line(e, "}");
+     recomp_line(e, "goto l_%04x;", pc);
+}
+
+/* Return to the main loop with PC already set */
+static void recomp_exit(struct recomp_emit *e) {
+     recomp_flush(e);
+     recomp_line(e, "return;");
+}
+
+/* Taken JR at `pc` with offset `offset` */
+static void recomp_jr(struct recomp_emit *e, uint16_t pc, int8_t offset) {
+     uint16_t target = pc + 2 + offset;
+
+     /* gb_cpu_load_pc */
+     e->pending++;
+
+     if (offset < 0) {
+          /* Backward jump, we may be spinning in a polling loop */
+          recomp_flush(e);
+          recomp_line(e, "cpu->pc = 0x%04x;", target);
+          recomp_line(e, "ops->idle_loop(gb, 0x%04x);", pc);
+     }
+
+     recomp_goto(e, target);
+}
+
+/* Push the return address `pc` and jump to `target` */
+static void recomp_call(struct recomp_emit *e, uint16_t pc, uint16_t target) {
+     recomp_flush(e);
+     recomp_line(e, "aot_pushb(gb, ops, 0x%02x);", pc >> 8);
+     recomp_line(e, "aot_pushb(gb, ops, 0x%02x);", pc & 0xff);
+     /* gb_cpu_load_pc */
+     e->pending++;
+     recomp_goto(e, target);
+}
+
+/* Pop PC from the stack */
+static void recomp_ret(struct recomp_emit *e) {
+     recomp_flush(e);
+     recomp_line(e, "cpu->pc = aot_popb(gb, ops);");
+     recomp_line(e, "cpu->pc |= aot_popb(gb, ops) << 8;");
+     /* gb_cpu_load_pc */
+     e->pending++;
+}
+
+/* Set the IME right away or, if `delayed` is true, after the next
+ * instruction */
+static void recomp_set_ime(struct recomp_emit *e, bool enable, bool delayed) {
+     recomp_flush(e);
+     if (!delayed) {
+          recomp_line(e, "cpu->irq_enable = %s;", enable ? "true" : "false");
+     }
+     recomp_line(e, "cpu->irq_enable_next = %s;", enable ? "true" : "false");
+     recomp_line(e, "ops->update_irq(gb);");
+}
+
+/* Instruction of the 0xCB opcode map */
+static void recomp_cb(struct recomp_emit *e, uint8_t op) {
+     const char *reg = recomp_reg8[op & 7];
+     unsigned bit = (op >> 3) & 7;
+
+     if (reg == NULL) {
+          /* (HL): read, modify and write back unless it's BIT */
+          recomp_flush(e);
+          recomp_line(e, "{");
+          e->indent++;
+          recomp_line(e, "uint8_t v = aot_readb(gb, ops, cpu->hl);");
+          recomp_line(e, "");
+          reg = "v";
+     }
+
+     switch (op >> 6) {
+     case 0:
+          recomp_line(e, "%s = %s(cpu, %s);", reg, recomp_shift[bit], reg);
+          break;
+     case 1:
+          recomp_line(e, "aot_set_flags(cpu, !(%s & 0x%02x), false, true, "
+                      "aot_flag_c(cpu));", reg, 1U << bit);
+          break;
+     case 2:
+          recomp_line(e, "%s &= 0x%02x;", reg, ~(1U << bit) & 0xff);
+          break;
+     case 3:
+          recomp_line(e, "%s |= 0x%02x;", reg, 1U << bit);
+          break;
+     }
+
+     if ((op & 7) == 6) {
+          if ((op >> 6) != 1) {
+               recomp_line(e, "aot_writeb(gb, ops, cpu->hl, v);");
+          }
+          e->indent--;
+          recomp_line(e, "}");
+     }
+}
+
+/* Generate the code for `insn`. Returns true if it falls through to the next
+ * instruction, false if it always transfers control. */
+static bool recomp_emit_insn(struct recomp_emit *e,
+                             const struct recomp_insn *insn) {
+     uint8_t op = insn->opcode;
+     uint8_t i8 = insn->operands[0];
+     uint16_t i16 = insn->operands[0] | (insn->operands[1] << 8);
+     uint16_t next_pc = insn->pc + gb_opcode_len[op];
+     const char *src = recomp_reg8[op & 7];
+     const char *dst = recomp_reg8[(op >> 3) & 7];
+     const char *rr = recomp_reg16[(op >> 4) & 3];
+     unsigned pending;
+
+     /* Opcode and operand fetches */
+     e->pending += gb_opcode_len[op];
+
+     if (op >= 0x40 && op < 0x80) {
+          /* LD r, r' */
+          if (src == NULL) {
+               recomp_flush(e);
+               recomp_line(e, "%s = aot_readb(gb, ops, cpu->hl);", dst);
+          } else if (dst == NULL) {
+               recomp_flush(e);
+               recomp_line(e, "aot_writeb(gb, ops, cpu->hl, %s);", src);
+          } else if (src != dst) {
+               recomp_line(e, "%s = %s;", dst, src);
+          }
+          return true;
+     }
+
+     if (op >= 0x80 && op < 0xc0) {
+          /* ALU A, r */
+          if (src == NULL) {
+               recomp_flush(e);
+               recomp_line(e, "%s(cpu, aot_readb(gb, ops, cpu->hl));",
+                           recomp_alu[(op >> 3) & 7]);
+          } else {
+               recomp_line(e, "%s(cpu, %s);", recomp_alu[(op >> 3) & 7], src);
+          }
+          return true;
+     }
+
+     switch (op & 0xcf) {
+     case 0x01:
+          /* LD rr, i16 */
+          recomp_line(e, "%s = 0x%04x;", rr, i16);
+          return true;
+     case 0x03:
+          /* INC rr */
+          recomp_line(e, "%s++;", rr);
+          e->pending++;
+          return true;
+     case 0x0b:
+          /* DEC rr */
+          recomp_line(e, "%s--;", rr);
+          e->pending++;
+          return true;
+     case 0x09:
+          /* ADD HL, rr */
+          recomp_line(e, "cpu->hl = aot_addw(cpu, cpu->hl, %s);", rr);
+          e->pending++;
+          return true;
+     case 0xc1:
+          /* POP rr */
+          recomp_flush(e);
+          if (op == 0xf1) {
+               recomp_line(e, "aot_set_f(cpu, aot_popb(gb, ops));");
+               recomp_line(e, "cpu->a = aot_popb(gb, ops);");
+          } else {
+               recomp_line(e, "%s = aot_popb(gb, ops);",
+                           recomp_reg8[((op >> 3) & 6) + 1]);
+               recomp_line(e, "%s = aot_popb(gb, ops);",
+                           recomp_reg8[(op >> 3) & 6]);
+          }
+          return true;
+     case 0xc5:
+          /* PUSH rr */
+          recomp_flush(e);
+          if (op == 0xf5) {
+               recomp_line(e, "aot_pushb(gb, ops, cpu->a);");
+               recomp_line(e, "aot_pushb(gb, ops, aot_get_f(cpu));");
+          } else {
+               recomp_line(e, "aot_pushb(gb, ops, %s);",
+                           recomp_reg8[(op >> 3) & 6]);
+               recomp_line(e, "aot_pushb(gb, ops, %s);",
+                           recomp_reg8[((op >> 3) & 6) + 1]);
+          }
+          e->pending++;
+          return true;
+     }
+
+     switch (op & 0xc7) {
+     case 0x04:
+     case 0x05:
+          /* INC r, DEC r */
+          if (dst == NULL) {
+               recomp_flush(e);
+               recomp_line(e, "{");
+               recomp_line(e, "     uint8_t v = aot_readb(gb, ops, cpu->hl);");
+               recomp_line(e, "");
+               recomp_line(e, "     aot_writeb(gb, ops, cpu->hl, %s(cpu, v));",
+                           (op & 1) ? "aot_dec" : "aot_inc");
+               recomp_line(e, "}");
+          } else {
+               recomp_line(e, "%s = %s(cpu, %s);", dst,
+                           (op & 1) ? "aot_dec" : "aot_inc", dst);
+          }
+          return true;
+     case 0x06:
+          /* LD r, i8 */
+          if (dst == NULL) {
+               recomp_flush(e);
+               recomp_line(e, "aot_writeb(gb, ops, cpu->hl, 0x%02x);", i8);
+          } else {
+               recomp_line(e, "%s = 0x%02x;", dst, i8);
+          }
+          return true;
+     case 0xc6:
+          /* ALU A, i8 */
+          recomp_line(e, "%s(cpu, 0x%02x);", recomp_alu[(op >> 3) & 7], i8);
+          return true;
+     case 0xc7:
+          /* RST */
+          recomp_call(e, next_pc, op & 0x38);
+          return false;
+     }
+
+     switch (op & 0xe7) {
+     case 0x20:
+     case 0xc0:
+     case 0xc2:
+     case 0xc4:
+          /* Conditional JR, RET, JP and CALL. The branch taken leaves the
+           * generated code through a return or a goto. */
+          pending = e->pending;
+
+          recomp_line(e, "if (%s) {", recomp_cond[(op >> 3) & 3]);
+          e->indent++;
+
+          switch (op & 0xe7) {
+          case 0x20:
+               recomp_jr(e, insn->pc, i8);
+               break;
+          case 0xc0:
+               recomp_ret(e);
+               e->pending++;
+               recomp_exit(e);
+               break;
+          case 0xc2:
+               /* gb_cpu_load_pc */
+               e->pending++;
+               recomp_goto(e, i16);
+               break;
+          case 0xc4:
+               recomp_call(e, next_pc, i16);
+               break;
+          }
+
+          e->indent--;
+          recomp_line(e, "}");
+
+          /* Condition false */
+          e->pending = pending;
+          if ((op & 0xe7) == 0xc0) {
+               e->pending++;
+          }
+          return true;
+     }
+
+     switch (op) {
+     case 0x00:
+          /* NOP */
+          return true;
+     case 0x02:
+     case 0x12:
+          /* LD (BC), A and LD (DE), A */
+          recomp_flush(e);
+          recomp_line(e, "aot_writeb(gb, ops, %s, cpu->a);", rr);
+          return true;
+     case 0x22:
+     case 0x32:
+          /* LDI (HL), A and LDD (HL), A */
+          recomp_flush(e);
+          recomp_line(e, "aot_writeb(gb, ops, cpu->hl, cpu->a);");
+          recomp_line(e, "cpu->hl%s;", op == 0x22 ? "++" : "--");
+          return true;
+     case 0x0a:
+     case 0x1a:
+          /* LD A, (BC) and LD A, (DE) */
+          recomp_flush(e);
+          recomp_line(e, "cpu->a = aot_readb(gb, ops, %s);", rr);
+          return true;
+     case 0x2a:
+     case 0x3a:
+          /* LDI A, (HL) and LDD A, (HL) */
+          recomp_flush(e);
+          recomp_line(e, "cpu->a = aot_readb(gb, ops, cpu->hl);");
+          recomp_line(e, "cpu->hl%s;", op == 0x2a ? "++" : "--");
+          return true;
+     case 0x07:
+     case 0x0f:
+     case 0x17:
+     case 0x1f:
+          /* RLCA, RRCA, RLA, RRA: same as their 0xCB counterparts but Z is
+           * always cleared */
+          recomp_line(e, "cpu->a = %s(cpu, cpu->a);", recomp_shift[op >> 3]);
+          recomp_line(e, "aot_set_flags(cpu, false, false, false, "
+                      "aot_flag_c(cpu));");
+          return true;
+     case 0x08:
+          /* LD (i16), SP */
+          recomp_flush(e);
+          recomp_line(e, "aot_writeb(gb, ops, 0x%04x, cpu->sp & 0xff);", i16);
+          recomp_line(e, "aot_writeb(gb, ops, 0x%04x, cpu->sp >> 8);",
+                      (i16 + 1) & 0xffff);
+          return true;
+     case 0x18:
+          /* JR */
+          recomp_jr(e, insn->pc, i8);
+          return false;
+     case 0x27:
+          recomp_line(e, "aot_daa(cpu);");
+          return true;
+     case 0x2f:
+          /* CPL */
+          recomp_line(e, "cpu->a = ~cpu->a;");
+          recomp_line(e, "aot_set_flags(cpu, aot_flag_z(cpu), true, true, "
+                      "aot_flag_c(cpu));");
+          return true;
+     case 0x37:
+          /* SCF */
+          recomp_line(e, "aot_set_flags(cpu, aot_flag_z(cpu), false, false, "
+                      "true);");
+          return true;
+     case 0x3f:
+          /* CCF */
+          recomp_line(e, "aot_set_flags(cpu, aot_flag_z(cpu), false, false, "
+                      "!aot_flag_c(cpu));");
+          return true;
+     case 0xc3:
+          /* JP i16 */
+          e->pending++;
+          recomp_goto(e, i16);
+          return false;
+     case 0xc9:
+          /* RET */
+          recomp_ret(e);
+          recomp_exit(e);
+          return false;
+     case 0xd9:
+          /* RETI */
+          recomp_ret(e);
+          recomp_set_ime(e, true, false);
+          recomp_exit(e);
+          return false;
+     case 0xcb:
+          recomp_cb(e, i8);
+          return true;
+     case 0xcd:
+          /* CALL i16 */
+          recomp_call(e, next_pc, i16);
+          return false;
+     case 0xe0:
+          /* LDH (i8), A */
+          recomp_flush(e);
+          recomp_line(e, "aot_writeb(gb, ops, 0x%04x, cpu->a);", 0xff00 | i8);
+          return true;
+     case 0xf0:
+          /* LDH A, (i8) */
+          recomp_flush(e);
+          recomp_line(e, "cpu->a = aot_readb(gb, ops, 0x%04x);", 0xff00 | i8);
+          return true;
+     case 0xe2:
+          /* LD (C), A */
+          recomp_flush(e);
+          recomp_line(e, "aot_writeb(gb, ops, 0xff00 | cpu->c, cpu->a);");
+          return true;
+     case 0xf2:
+          /* LD A, (C) */
+          recomp_flush(e);
+          recomp_line(e, "cpu->a = aot_readb(gb, ops, 0xff00 | cpu->c);");
+          return true;
+     case 0xea:
+          /* LD (i16), A */
+          recomp_flush(e);
+          recomp_line(e, "aot_writeb(gb, ops, 0x%04x, cpu->a);", i16);
+          return true;
+     case 0xfa:
+          /* LD A, (i16) */
+          recomp_flush(e);
+          recomp_line(e, "cpu->a = aot_readb(gb, ops, 0x%04x);", i16);
+          return true;
+     case 0xe8:
+          /* ADD SP, e */
+          recomp_line(e, "cpu->sp = aot_add_sp(cpu, %d);", (int8_t)i8);
+          e->pending += 2;
+          return true;
+     case 0xf8:
+          /* LD HL, SP + e */
+          recomp_line(e, "cpu->hl = aot_add_sp(cpu, %d);", (int8_t)i8);
+          e->pending++;
+          return true;
+     case 0xe9:
+          /* JP HL, no additional delay */
+          recomp_line(e, "cpu->pc = cpu->hl;");
+          recomp_exit(e);
+          return false;
+     case 0xf9:
+          /* LD SP, HL */
+          recomp_line(e, "cpu->sp = cpu->hl;");
+          e->pending++;
+          return true;
+     case 0xf3:
+          /* DI */
+          recomp_set_ime(e, false, false);
+          return true;
+     case 0xfb:
+          /* EI, interrupts are re-enabled after the *next* instruction */
+          recomp_set_ime(e, true, true);
+          return true;
+     }
+
+     /* recomp_supported let through something we don't know about */
+     fprintf(stderr, "Can't recompile opcode 0x%02x\n", op);
+     die();
+     return false;
+}
+
+static void recomp_emit_block(FILE *out, uint32_t rom_off,
+                              const struct recomp_insn *insns, unsigned n) {
+     struct recomp_emit e;
+     bool label[RECOMP_MAX_BLOCK_LEN] = { false };
+     unsigned i;
+
+     e.out = out;
+     e.insns = insns;
+     e.n = n;
+     e.bank_off = rom_off - (rom_off % GB_ROM_BANK_SIZE);
+     e.pending = 0;
+     e.indent = 1;
+
+     /* Find the instructions we can jump to from within the block */
+     for (i = 0; i < n; i++) {
+          uint16_t target;
+          int t;
+
+          if (recomp_branch_target(&insns[i], &target)) {
+               t = recomp_find(&e, target);
+               if (t >= 0) {
+                    label[t] = true;
+               }
+          }
+     }
+
+     fprintf(out,
+             "static void b_%06x(struct gb *gb, const struct gb_aot_ops *ops) {\n"
+             "     struct gb_cpu *cpu = &gb->cpu;\n"
+             "     /* Only used by the blocks calling back into the emulator */\n"
+             "     (void)ops;\n",
+             rom_off);
+
+     for (i = 0; i < n; i++) {
+          const struct recomp_insn *insn = &insns[i];
+          uint16_t next_pc = insn->pc + gb_opcode_len[insn->opcode];
+          unsigned len = gb_opcode_len[insn->opcode];
+
+          fprintf(out, "\n");
+          if (label[i]) {
+               fprintf(out, "l_%04x:\n", insn->pc);
+          }
+
+          if (len == 1) {
+               recomp_line(&e, "/* %04x: %02x */", insn->pc, insn->opcode);
+          } else if (len == 2) {
+               recomp_line(&e, "/* %04x: %02x %02x */", insn->pc,
+                           insn->opcode, insn->operands[0]);
+          } else {
+               recomp_line(&e, "/* %04x: %02x %02x %02x */", insn->pc,
+                           insn->opcode,
+                           insn->operands[0], insn->operands[1]);
+          }
+
+          if (!recomp_emit_insn(&e, insn)) {
+               continue;
+          }
+
+          recomp_flush(&e);
+          if (i + 1 < n) {
+               /* Instruction boundary */
+               recomp_line(&e, "if (!aot_next(gb, ops, 0x%04x, 0x%x)) {",
+                           next_pc, e.bank_off);
+               recomp_line(&e, "     return;");
+               recomp_line(&e, "}");
+          } else {
+               /* End of the block, the main loop takes over */
+               recomp_line(&e, "cpu->pc = 0x%04x;", next_pc);
+          }
+     }
+
+     fprintf(out, "}\n\n");
+}
+
+int main(int argc, char **argv) {
+     struct recomp r;
+     struct recomp_insn insns[RECOMP_MAX_BLOCK_LEN];
+     bool *emitted;
+     uint32_t rom_off, count;
+     unsigned i;
+     FILE *out;
+
+     if (argc < 3) {
+          fprintf(stderr, "Usage: %s <rom> <output.c>\n", argv[0]);
+          return EXIT_FAILURE;
+     }
+
+     recomp_load_rom(&r, argv[1]);
+
+     /* Entry point */
+     recomp_add_block(&r, 0, 0x100);
+     /* RST and IRQ vectors */
+     for (i = 0; i <= 0x60; i += 8) {
+          recomp_add_block(&r, 0, i);
+     }
+
+     out = fopen(argv[2], "w");
+     if (out == NULL) {
+          perror("Can't open output file");
+          die();
+     }
+
+     emitted = calloc(r.rom_length, sizeof(*emitted));
+     if (emitted == NULL) {
+          perror("malloc failed");
+          die();
+     }
+
+     fprintf(out, "/* Generated by gaembuoy-recomp from %s */\n\n", argv[1]);
+     fputs(recomp_preamble, out);
+
+     /* Explore and emit every reachable block */
+     count = 0;
+     while (r.npending > 0) {
+          unsigned n;
+
+          rom_off = r.pending[--r.npending];
+
+          n = recomp_decode_block(&r, rom_off, insns);
+          if (n == 0) {
+               continue;
+          }
+
+          recomp_emit_block(out, rom_off, insns, n);
+          emitted[rom_off] = true;
+          count++;
+     }
+
+     /* Index sorted by ROM offset so that the emulator can do a binary
+      * search */
+     fprintf(out, "static const uint32_t block_rom_off[] = {\n");
+     for (rom_off = 0; rom_off < r.rom_length; rom_off++) {
+          if (emitted[rom_off]) {
+               fprintf(out, "     0x%06x,\n", rom_off);
+          }
+     }
+     fprintf(out, "};\n\n");
+
+     fprintf(out, "static const gb_aot_block_f blocks[] = {\n");
+     for (rom_off = 0; rom_off < r.rom_length; rom_off++) {
+          if (emitted[rom_off]) {
+               fprintf(out, "     b_%06x,\n", rom_off);
+          }
+     }
+     fprintf(out, "};\n\n");
+
+     fprintf(out,
+             "const struct gb_aot_image gb_aot_image = {\n"
+             "     .version = %u,\n"
+             "     .gb_size = sizeof(struct gb),\n"
+             "     .layout = GB_AOT_LAYOUT,\n"
+             "     .rom_length = %u,\n"
+             "     .rom_hash = 0x%08x,\n"
+             "     .block_count = %u,\n"
+             "     .block_rom_off = block_rom_off,\n"
+             "     .blocks = blocks,\n"
+             "};\n",
+             GB_AOT_VERSION, r.rom_length,
+             gb_aot_rom_hash(r.rom, r.rom_length), count);
+
+     fclose(out);
+
+     printf("Recompiled %u blocks\n", count);
+
+     free(emitted);
+     free(r.is_bank0_target);
+     free(r.bank0_targets);
+     free(r.bank_seen);
+     free(r.pending);
+     free(r.is_block);
+     free(r.rom);
+
+     return 0;
+}
@@ -12,8 +12,46 @@ struct gb_sdl_context {
      uint32_t pixels[GB_LCD_WIDTH * GB_LCD_HEIGHT];
      /* Index of the next audio buffer we want to play */
      unsigned audio_buf_index;
+     /* Percentage of skipped frames currently shown in the window title */
+     unsigned skip_percent;
 };
 
+/* Number of emulated frames (about one second) over which the frameskip
+ * ratio is measured */
+#define GB_SDL_SKIP_PERIOD 60
+
+/* Display the ratio of frames skipped by the GPU in the window title */
+static void gb_sdl_update_skip_ratio(struct gb *gb) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
+     struct gb_gpu_frameskip *fs = &gb->gpu.frameskip;
+     unsigned total = fs->drawn + fs->skipped;
+     unsigned percent;
+     char title[64];
+
+     if (total < GB_SDL_SKIP_PERIOD) {
+          return;
+     }
+
+     percent = (fs->skipped * 100) / total;
+     fs->drawn = 0;
+     fs->skipped = 0;
+
+     if (percent == ctx->skip_percent) {
+          /* Nothing changed */
+          return;
+     }
+
+     ctx->skip_percent = percent;
+
+     if (percent == 0) {
+          SDL_SetWindowTitle(ctx->window, "Gaembuoy");
+     } else {
+          snprintf(title, sizeof(title),
+                   "Gaembuoy (skipping %u%% of frames)", percent);
+          SDL_SetWindowTitle(ctx->window, title);
+     }
+}
+
 static void gb_sdl_draw_line_dmg(struct gb *gb, unsigned ly,
                                  union gb_gpu_color line[GB_LCD_WIDTH]) {
      struct gb_sdl_context *ctx = gb->frontend.data;
@@ -225,6 +263,8 @@ static void gb_sdl_flip(struct gb *gb) {
      /* Render the canvas */
      SDL_RenderCopy(ctx->renderer, ctx->canvas, NULL, NULL);
      SDL_RenderPresent(ctx->renderer);
+
+     gb_sdl_update_skip_ratio(gb);
 }
 
 static void gb_sdl_destroy(struct gb *gb) {
@@ -282,6 +322,7 @@ void gb_sdl_frontend_init(struct gb *gb) {
      gb->frontend.data = ctx;
 
      ctx->audio_buf_index = 0;
+     ctx->skip_percent = 0;
 
      if (SDL_Init(SDL_INIT_VIDEO |
                   SDL_INIT_GAMECONTROLLER |
@@ -497,6 +497,25 @@ static void gb_spu_send_sample_to_frontend(struct gb *gb,
      }
 }
 
+/* Returns true if the frontend has no complete sample buffer left to play.
+ * Since audio plays in real time this means that the emulation is running
+ * late and that the frontend is about to starve. */
+bool gb_spu_is_late(struct gb *gb) {
+     struct gb_spu *spu = &gb->spu;
+     unsigned i;
+
+     for (i = 0; i < GB_SPU_SAMPLE_BUFFER_COUNT; i++) {
+          int ready;
+
+          sem_getvalue(&spu->buffers[i].ready, &ready);
+          if (ready > 0) {
+               return false;
+          }
+     }
+
+     return true;
+}
+
 void gb_spu_sync(struct gb *gb) {
      struct gb_spu *spu = &gb->spu;
      int32_t elapsed = gb_sync_resync(gb, GB_SYNC_SPU);
@@ -191,6 +191,7 @@ struct gb_spu {
 
 void gb_spu_reset(struct gb *gb);
 void gb_spu_sync(struct gb *gb);
+bool gb_spu_is_late(struct gb *gb);
 void gb_spu_update_sound_amp(struct gb *gb);
 void gb_spu_nr1_start(struct gb *gb);
 void gb_spu_nr2_start(struct gb *gb);
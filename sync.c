@@ -1,6 +1,15 @@
 #include <stdio.h>
 #include "gb.h"
 
+/* Sync function for each token, called when its next event is due */
+static void (*const gb_sync_handlers[GB_SYNC_NUM])(struct gb *gb) = {
+     [GB_SYNC_GPU]   = gb_gpu_sync,
+     [GB_SYNC_DMA]   = gb_dma_sync,
+     [GB_SYNC_TIMER] = gb_timer_sync,
+     [GB_SYNC_SPU]   = gb_spu_sync,
+     [GB_SYNC_CART]  = gb_cart_sync,
+};
+
 void gb_sync_reset(struct gb *gb) {
      struct gb_sync *sync = &gb->sync;
      unsigned i;
@@ -8,6 +17,9 @@ void gb_sync_reset(struct gb *gb) {
      for (i = 0; i < GB_SYNC_NUM; i++) {
           sync->last_sync[i] = 0;
           sync->next_event[i] = 0;
+          /* All the dates are equal, the heap is sorted by token */
+          sync->heap[i] = i;
+          sync->heap_pos[i] = i;
      }
 
      gb->timestamp = 0;
@@ -16,6 +28,8 @@ void gb_sync_reset(struct gb *gb) {
 
 int32_t gb_sync_resync(struct gb *gb, enum gb_sync_token token) {
      struct gb_sync *sync = &gb->sync;
+     /* Devices resync at least every GB_SYNC_NEVER cycles so this always
+      * fits */
      int32_t elapsed = gb->timestamp - sync->last_sync[token];
 
      if (elapsed < 0) {
@@ -28,67 +42,80 @@ int32_t gb_sync_resync(struct gb *gb, enum gb_sync_token token) {
      return elapsed;
 }
 
-void gb_sync_next(struct gb *gb, enum gb_sync_token token, int32_t cycles) {
-     struct gb_sync *sync = &gb->sync;
-     unsigned i;
+/* Returns true if token `a` must run before token `b` */
+static bool gb_sync_before(struct gb_sync *sync,
+                           enum gb_sync_token a, enum gb_sync_token b) {
+     if (sync->next_event[a] != sync->next_event[b]) {
+          return sync->next_event[a] < sync->next_event[b];
+     }
 
-     sync->next_event[token] = gb->timestamp + cycles;
+     return a < b;
+}
 
-     /* Recompute the date of the first event to come */
-     sync->first_event = sync->next_event[0];
+static void gb_sync_heap_swap(struct gb_sync *sync, unsigned i, unsigned j) {
+     enum gb_sync_token ti = sync->heap[i];
+     enum gb_sync_token tj = sync->heap[j];
 
-     for (i = 1; i < GB_SYNC_NUM; i++) {
-          int32_t e = sync->next_event[i];
-          if (e < sync->first_event) {
-               sync->first_event = e;
-          }
-     }
+     sync->heap[i] = tj;
+     sync->heap[j] = ti;
+     sync->heap_pos[tj] = i;
+     sync->heap_pos[ti] = j;
 }
 
-void gb_sync_check_events(struct gb *gb) {
+void gb_sync_next(struct gb *gb, enum gb_sync_token token, int32_t cycles) {
      struct gb_sync *sync = &gb->sync;
+     unsigned pos = sync->heap_pos[token];
 
-     /* It's possible for an event to actually "freeze" the CPU and increase the
-      * timestamp counter (in particular the HDMA running on HSYNC). Therefore
-      * we have to recheck for a potential event in a loop to make sure we only
-      * return control to the caller when all events have been processed. */
-     while (gb->timestamp >= gb->sync.first_event) {
-          int32_t ts = gb->timestamp;
+     sync->next_event[token] = gb->timestamp + cycles;
 
-          if (ts >= sync->next_event[GB_SYNC_GPU]) {
-               gb_gpu_sync(gb);
-          }
+     /* Move the token up the heap if it's now due earlier than its parent... */
+     while (pos > 0) {
+          unsigned parent = (pos - 1) / 2;
 
-          if (ts >= sync->next_event[GB_SYNC_DMA]) {
-               gb_dma_sync(gb);
+          if (!gb_sync_before(sync, token, sync->heap[parent])) {
+               break;
           }
 
-          if (ts >= sync->next_event[GB_SYNC_TIMER]) {
-               gb_timer_sync(gb);
+          gb_sync_heap_swap(sync, pos, parent);
+          pos = parent;
+     }
+
+     /* ...or down if it's now due later than one of its children */
+     for (;;) {
+          unsigned first = pos;
+          unsigned child = pos * 2 + 1;
+
+          if (child < GB_SYNC_NUM &&
+              gb_sync_before(sync, sync->heap[child], sync->heap[first])) {
+               first = child;
           }
 
-          if (ts >= sync->next_event[GB_SYNC_SPU]) {
-               gb_spu_sync(gb);
+          child++;
+          if (child < GB_SYNC_NUM &&
+              gb_sync_before(sync, sync->heap[child], sync->heap[first])) {
+               first = child;
           }
 
-          if (ts >= sync->next_event[GB_SYNC_CART]) {
-               gb_cart_sync(gb);
+          if (first == pos) {
+               break;
           }
+
+          gb_sync_heap_swap(sync, pos, first);
+          pos = first;
      }
+
+     sync->first_event = sync->next_event[sync->heap[0]];
 }
 
-/* Subtract the current value of the timestamp from all last_sync and next_event
- * dates, therefore avoiding potential overflows while keeping everything in
- * sync */
-void gb_sync_rebase(struct gb *gb) {
+void gb_sync_check_events(struct gb *gb) {
      struct gb_sync *sync = &gb->sync;
-     unsigned i;
 
-     for (i = 0; i < GB_SYNC_NUM; i++) {
-          sync->last_sync[i] -= gb->timestamp;
-          sync->next_event[i] -= gb->timestamp;
+     /* Run the due events in order. Every handler schedules its next event
+      * which moves it down the heap. It's possible for an event to actually
+      * "freeze" the CPU and increase the timestamp counter (in particular the
+      * HDMA running on HSYNC) so we only return control to the caller when
+      * all events have been processed. */
+     while (gb->timestamp >= sync->first_event) {
+          gb_sync_handlers[sync->heap[0]](gb);
      }
-
-     sync->first_event -= gb->timestamp;
-     gb->timestamp = 0;
 }
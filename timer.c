@@ -36,8 +36,9 @@ void gb_timer_sync(struct gb *gb) {
           die();
      }
 
-     /* Timer runs twice as fast in double-speed mode */
-     elapsed <<= gb->double_speed;
+     /* The timer counts CPU cycles, 4 per machine cycle of `mcycle_duration`
+      * timestamp ticks. It runs twice as fast in double-speed mode. */
+     elapsed = (int64_t)elapsed * 4 / gb->mcycle_duration;
 
      /* Number of counter ticks since last sync */
      count = (elapsed + timer->divider_counter % div) / div;
@@ -66,11 +67,25 @@ void gb_timer_sync(struct gb *gb) {
      /* Subtract the remainder in the divider */
      next -= timer->divider_counter % div;
 
-     next >>= gb->double_speed;
+     /* Back to timestamp ticks */
+     next = (int64_t)next * gb->mcycle_duration / 4;
 
      gb_sync_next(gb, GB_SYNC_TIMER, next);
 }
 
+/* Return the value of the DIV register. The divider runs freely so we can
+ * compute it from the time elapsed since the last sync without having to
+ * sync the timer. */
+uint8_t gb_timer_get_div(struct gb *gb) {
+     struct gb_timer *timer = &gb->timer;
+     uint32_t elapsed = gb->timestamp - gb->sync.last_sync[GB_SYNC_TIMER];
+
+     /* Convert to CPU cycles, see gb_timer_sync */
+     elapsed = (uint64_t)elapsed * 4 / gb->mcycle_duration;
+
+     return ((timer->divider_counter + elapsed) & 0xffff) >> 8;
+}
+
 void gb_timer_set_config(struct gb *gb, uint8_t config) {
      struct gb_timer *timer = &gb->timer;
 
@@ -22,6 +22,7 @@ struct gb_timer {
 
 void gb_timer_reset(struct gb *gb);
 void gb_timer_sync(struct gb *gb);
+uint8_t gb_timer_get_div(struct gb *gb);
 void gb_timer_set_config(struct gb *gb, uint8_t config);
 uint8_t gb_timer_get_config(struct gb *gb);
 